@@ -0,0 +1,156 @@
+#include "bitvector.h"
+
+#include <bit>
+
+namespace chp
+{
+
+bitvector::bitvector() {
+	bits = 0;
+}
+
+bitvector::bitvector(size_t bits) {
+	this->bits = 0;
+	resize(bits);
+}
+
+bitvector::~bitvector() {
+}
+
+void bitvector::resize(size_t bits) {
+	this->bits = bits;
+	words.resize((bits+63)/64, 0);
+	// Keep the bits past the end clear so that any() and count() stay exact
+	if (bits%64 != 0) {
+		words.back() &= (((uint64_t)1) << (bits%64)) - 1;
+	}
+}
+
+void bitvector::clear() {
+	std::fill(words.begin(), words.end(), 0);
+}
+
+void bitvector::set(size_t i) {
+	words[i/64] |= ((uint64_t)1) << (i%64);
+}
+
+void bitvector::reset(size_t i) {
+	words[i/64] &= ~(((uint64_t)1) << (i%64));
+}
+
+bool bitvector::test(size_t i) const {
+	return i < bits and ((words[i/64] >> (i%64)) & 1) != 0;
+}
+
+bool bitvector::any() const {
+	for (uint64_t w : words) {
+		if (w != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t bitvector::count() const {
+	size_t result = 0;
+	for (uint64_t w : words) {
+		result += std::popcount(w);
+	}
+	return result;
+}
+
+bool bitvector::intersects(const bitvector &b) const {
+	size_t n = std::min(words.size(), b.words.size());
+	for (size_t i = 0; i < n; i++) {
+		if ((words[i] & b.words[i]) != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t bitvector::next(size_t i) const {
+	if (i >= bits) {
+		return bits;
+	}
+
+	size_t w = i/64;
+	uint64_t word = words[w] & (~((uint64_t)0) << (i%64));
+	while (word == 0) {
+		if (++w >= words.size()) {
+			return bits;
+		}
+		word = words[w];
+	}
+	return w*64 + std::countr_zero(word);
+}
+
+vector<size_t> bitvector::elems() const {
+	vector<size_t> result;
+	for (size_t i = next(0); i < bits; i = next(i+1)) {
+		result.push_back(i);
+	}
+	return result;
+}
+
+bitvector &bitvector::operator|=(const bitvector &b) {
+	if (b.bits > bits) {
+		resize(b.bits);
+	}
+	for (size_t i = 0; i < b.words.size(); i++) {
+		words[i] |= b.words[i];
+	}
+	return *this;
+}
+
+bitvector &bitvector::operator&=(const bitvector &b) {
+	size_t n = std::min(words.size(), b.words.size());
+	for (size_t i = 0; i < n; i++) {
+		words[i] &= b.words[i];
+	}
+	for (size_t i = n; i < words.size(); i++) {
+		words[i] = 0;
+	}
+	return *this;
+}
+
+bitvector &bitvector::operator-=(const bitvector &b) {
+	size_t n = std::min(words.size(), b.words.size());
+	for (size_t i = 0; i < n; i++) {
+		words[i] &= ~b.words[i];
+	}
+	return *this;
+}
+
+bitvector operator|(bitvector a, const bitvector &b) {
+	a |= b;
+	return a;
+}
+
+bitvector operator&(bitvector a, const bitvector &b) {
+	a &= b;
+	return a;
+}
+
+bitvector operator-(bitvector a, const bitvector &b) {
+	a -= b;
+	return a;
+}
+
+bool operator==(const bitvector &a, const bitvector &b) {
+	size_t n = std::max(a.words.size(), b.words.size());
+	for (size_t i = 0; i < n; i++) {
+		uint64_t x = i < a.words.size() ? a.words[i] : 0;
+		uint64_t y = i < b.words.size() ? b.words[i] : 0;
+		if (x != y) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool operator!=(const bitvector &a, const bitvector &b) {
+	return not (a == b);
+}
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <common/standard.h>
+
+namespace chp
+{
+
+// A dense set of small integers stored one bit per element in 64-bit words.
+// This is used by the dataflow analyses and the simulator where sets are
+// indexed by definitions, variables, or tokens and most of the work is
+// word-parallel union, intersection, and difference.
+struct bitvector
+{
+	bitvector();
+	bitvector(size_t bits);
+	~bitvector();
+
+	vector<uint64_t> words;
+	size_t bits;
+
+	void resize(size_t bits);
+	void clear();
+
+	void set(size_t i);
+	void reset(size_t i);
+	bool test(size_t i) const;
+
+	bool any() const;
+	size_t count() const;
+	bool intersects(const bitvector &b) const;
+
+	// Returns the index of the first set bit at or after i, or bits if there
+	// isn't one. This is used to walk the elements of the set.
+	size_t next(size_t i) const;
+	vector<size_t> elems() const;
+
+	bitvector &operator|=(const bitvector &b);
+	bitvector &operator&=(const bitvector &b);
+	bitvector &operator-=(const bitvector &b);
+};
+
+bitvector operator|(bitvector a, const bitvector &b);
+bitvector operator&(bitvector a, const bitvector &b);
+bitvector operator-(bitvector a, const bitvector &b);
+bool operator==(const bitvector &a, const bitvector &b);
+bool operator!=(const bitvector &a, const bitvector &b);
+
+}
@@ -0,0 +1,306 @@
+#include "cache.h"
+#include "serialize.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+namespace chp
+{
+
+// Bump this whenever the serialized format or the behavior of a cached pass
+// changes so that stale entries are never read.
+const int CACHE_VERSION = 4;
+
+uint64_t fnv1a(const string &data, uint64_t seed) {
+	uint64_t hash = seed;
+	for (unsigned char c : data) {
+		hash ^= c;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+uint64_t structuralHash(const graph &g) {
+	ostringstream os;
+	write(os, g, false);
+	return fnv1a(os.str());
+}
+
+diskCache::diskCache() {
+	capacity = 0;
+	size = 0;
+	hits = 0;
+	misses = 0;
+}
+
+diskCache::diskCache(std::filesystem::path root, uintmax_t capacity) {
+	this->root = root;
+	this->capacity = capacity;
+	size = 0;
+	hits = 0;
+	misses = 0;
+
+	std::error_code ec;
+	std::filesystem::create_directories(root, ec);
+	scan();
+}
+
+diskCache::~diskCache() {
+}
+
+std::filesystem::path diskCache::pathOf(uint64_t key) const {
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+	return root / name;
+}
+
+/**
+ * @brief Read the result stored for key into blob
+ *
+ * An entry is the length of its input as a little-endian 64-bit word, the
+ * input, and then the result. The entry only matches if its input is the
+ * same as input. A match updates the modification time of the entry, which
+ * is what evict() uses to find the least recently used entries.
+ */
+bool diskCache::load(uint64_t key, const string &input, string &blob) {
+	std::filesystem::path path = pathOf(key);
+	ifstream in(path, ios::in | ios::binary);
+	if (not in) {
+		return false;
+	}
+
+	unsigned char word[8];
+	if (not in.read((char*)word, sizeof(word))) {
+		return false;
+	}
+	uint64_t length = 0;
+	for (int i = 7; i >= 0; i--) {
+		length = (length << 8) | word[i];
+	}
+	if (length != input.size()) {
+		return false;
+	}
+
+	string stored(length, '\0');
+	if (not in.read(stored.data(), length) or stored != input) {
+		return false;
+	}
+
+	ostringstream contents;
+	contents << in.rdbuf();
+	blob = contents.str();
+
+	std::error_code ec;
+	std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+	return true;
+}
+
+/**
+ * @brief A name for a temporary file that no other writer will pick
+ *
+ * Mixes a random number drawn once per process with the thread, the time
+ * and a counter, so concurrent writers of the same key, in this process or
+ * another, never share a temporary file.
+ */
+std::filesystem::path diskCache::tempOf(uint64_t key) const {
+	static const uint64_t salt = ((uint64_t)std::random_device()() << 32) ^ std::random_device()();
+	static std::atomic<uint64_t> counter(0);
+
+	ostringstream id;
+	id << salt << " " << std::this_thread::get_id() << " "
+	   << std::chrono::steady_clock::now().time_since_epoch().count() << " " << counter++;
+
+	std::filesystem::path result = pathOf(key);
+	char suffix[22];
+	snprintf(suffix, sizeof(suffix), ".%016llx", (unsigned long long)fnv1a(id.str()));
+	result += suffix;
+	result += ".tmp";
+	return result;
+}
+
+/**
+ * @brief Write an entry and evict old entries if the store is over capacity
+ *
+ * The entry is written to a temporary file first and then renamed into
+ * place so that concurrent readers never see a partial entry.
+ */
+void diskCache::store(uint64_t key, const string &input, const string &blob) {
+	std::filesystem::path path = pathOf(key);
+	std::filesystem::path tmp = tempOf(key);
+	{
+		ofstream out(tmp, ios::out | ios::binary | ios::trunc);
+		if (not out) {
+			return;
+		}
+
+		unsigned char word[8];
+		for (int i = 0; i < 8; i++) {
+			word[i] = (unsigned char)((uint64_t)input.size() >> (8*i));
+		}
+		out.write((const char*)word, sizeof(word));
+		out.write(input.data(), input.size());
+		out.write(blob.data(), blob.size());
+		if (not out) {
+			return;
+		}
+	}
+
+	std::error_code ec;
+	uintmax_t replaced = std::filesystem::file_size(path, ec);
+	if (ec) {
+		replaced = 0;
+	}
+	std::filesystem::rename(tmp, path, ec);
+	if (ec) {
+		std::filesystem::remove(tmp, ec);
+		return;
+	}
+
+	size += sizeof(uint64_t) + input.size() + blob.size();
+	size -= std::min(size, replaced);
+	evict();
+}
+
+/**
+ * @brief Remove the entry for key, for example because it couldn't be read
+ */
+void diskCache::remove(uint64_t key) {
+	std::filesystem::path path = pathOf(key);
+	std::error_code ec;
+	uintmax_t removed = std::filesystem::file_size(path, ec);
+	if (not ec and std::filesystem::remove(path, ec)) {
+		size -= std::min(size, removed);
+	}
+}
+
+/**
+ * @brief Recount the size of the entries in root
+ */
+void diskCache::scan() {
+	std::error_code ec;
+	size = 0;
+	for (const auto &entry : std::filesystem::directory_iterator(root, ec)) {
+		if (entry.is_regular_file(ec) and entry.path().extension() != ".tmp") {
+			size += entry.file_size(ec);
+		}
+	}
+}
+
+/**
+ * @brief Remove the least recently used entries once the store is over
+ * capacity
+ *
+ * This only touches the directory when the running size is over capacity.
+ * It then rescans root, which also picks up entries written by other
+ * processes, and removes entries until the store is down to three quarters
+ * of capacity so that the next few stores don't scan again.
+ */
+void diskCache::evict() {
+	if (size <= capacity) {
+		return;
+	}
+
+	std::error_code ec;
+	vector<pair<std::filesystem::file_time_type, std::filesystem::path> > entries;
+	size = 0;
+	for (const auto &entry : std::filesystem::directory_iterator(root, ec)) {
+		if (not entry.is_regular_file(ec) or entry.path().extension() == ".tmp") {
+			continue;
+		}
+		size += entry.file_size(ec);
+		entries.push_back({entry.last_write_time(ec), entry.path()});
+	}
+
+	if (size <= capacity) {
+		return;
+	}
+
+	uintmax_t target = capacity - capacity/4;
+	sort(entries.begin(), entries.end());
+	for (auto i = entries.begin(); i != entries.end() and size > target; i++) {
+		uintmax_t removed = std::filesystem::file_size(i->second, ec);
+		if (std::filesystem::remove(i->second, ec)) {
+			size -= std::min(size, removed);
+		}
+	}
+}
+
+string passInput(const graph &g, const string &pass) {
+	ostringstream os;
+	write(os, g, false);
+	os << '\0' << CACHE_VERSION << '\0' << pass;
+	return os.str();
+}
+
+uint64_t passKey(const graph &g, const string &pass) {
+	return fnv1a(passInput(g, pass));
+}
+
+/**
+ * @brief Run a pass through the cache
+ *
+ * An entry is only used if the input stored with it is the serialized
+ * input of this run, so a hash collision is a miss. On a hit, g is
+ * replaced by the stored result and run is never called. The key doesn't
+ * cover the name of the graph, so g keeps its own. The analyses computed
+ * from the old structure are dropped, and restore() rebuilds the derived
+ * state that run would have left behind. On a miss, including an entry
+ * that can't be read, run is called and its result is stored.
+ */
+template <typename Pass, typename Restore>
+void cachedPass(graph &g, diskCache &cache, const string &pass, Pass run, Restore restore) {
+	string input = passInput(g, pass);
+	uint64_t key = fnv1a(input);
+
+	string blob;
+	if (cache.load(key, input, blob)) {
+		istringstream in(blob);
+		graph result;
+		if (read(in, result)) {
+			cache.hits++;
+			bool splitGroups = g.split_groups_ready;
+			result.name = g.name;
+			g = result;
+			g.mark_modified();
+			g.split_groups_ready = false;
+			restore(splitGroups);
+			return;
+		}
+
+		// A corrupt entry is a miss, and is replaced below
+		cache.remove(key);
+	}
+	cache.misses++;
+
+	run();
+
+	ostringstream out;
+	write(out, g, false);
+	cache.store(key, input, out.str());
+}
+
+void cachedPostProcess(graph &g, diskCache &cache, bool proper_nesting, bool aggressive) {
+	cachedPass(g, cache, "post_process " + std::to_string(proper_nesting) + " " + std::to_string(aggressive), [&]() {
+		g.post_process(proper_nesting, aggressive);
+	}, [&](bool splitGroups) {
+		// post_process() leaves the split groups as they were
+		if (splitGroups) {
+			g.compute_split_groups();
+		}
+	});
+}
+
+void cachedFlatten(graph &g, diskCache &cache, bool share) {
+	cachedPass(g, cache, "flatten " + std::to_string(share), [&]() {
+		g.flatten(false, share);
+	}, [&](bool) {
+		// flatten() always recomputes the split groups
+		g.compute_split_groups();
+	});
+}
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <filesystem>
+
+#include <common/standard.h>
+
+#include "graph.h"
+
+namespace chp
+{
+
+// 64-bit FNV-1a. Unlike std::hash it is the same on every platform and in
+// every run, so it can be used to name files on disk.
+uint64_t fnv1a(const string &data, uint64_t seed=0xcbf29ce484222325ull);
+
+// A hash of the serialized form of the graph (see serialize.h). It covers
+// the vars, places, transitions, arcs and reset states, and ignores the
+// name of the graph, erased slots and arc order. The serialized form is
+// little-endian on every host, so the hash is too.
+uint64_t structuralHash(const graph &g);
+
+// A local content-addressed store of pass results. Each entry is one file
+// in root named by the 64-bit hash of its input. The entry also holds the
+// input itself, and load() only returns the result if the input matches,
+// so two inputs with the same hash never read each other's results.
+// Reading an entry marks it as recently used. The store keeps a running
+// total of the size of its entries and only scans root when that goes over
+// capacity. It then removes the least recently used entries until the
+// store is back to three quarters of capacity. Other processes sharing root
+// aren't seen until that scan.
+struct diskCache
+{
+	diskCache();
+	diskCache(std::filesystem::path root, uintmax_t capacity=((uintmax_t)256) << 20);
+	~diskCache();
+
+	std::filesystem::path root;
+	uintmax_t capacity;
+
+	// The total size of the entries in root, as of the last scan plus the
+	// entries stored and removed since.
+	uintmax_t size;
+
+	// Counted by the cached passes. A hit is only counted once the stored
+	// result has been read back successfully.
+	size_t hits;
+	size_t misses;
+
+	std::filesystem::path pathOf(uint64_t key) const;
+	std::filesystem::path tempOf(uint64_t key) const;
+	bool load(uint64_t key, const string &input, string &blob);
+	void store(uint64_t key, const string &input, const string &blob);
+	void remove(uint64_t key);
+	void scan();
+	void evict();
+};
+
+// The input of running pass with the given options on g, and its key.
+string passInput(const graph &g, const string &pass);
+uint64_t passKey(const graph &g, const string &pass);
+
+// Run graph::post_process() or graph::flatten() on g, or replace g with the
+// result of an earlier run on an identical graph. A hit leaves g with its
+// own name and the same derived state the pass would have.
+//
+// Synthesis isn't cached on disk: flow::Func has no serialized form. Use
+// SynthesisCache (see synthesize.h) to reuse synthesized conditions within
+// a process.
+void cachedPostProcess(graph &g, diskCache &cache, bool proper_nesting=false, bool aggressive=false);
+void cachedFlatten(graph &g, diskCache &cache, bool share=false);
+
+}
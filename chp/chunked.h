@@ -0,0 +1,183 @@
+#pragma once
+
+#include <iterator>
+#include <memory>
+
+#include <common/standard.h>
+
+namespace chp
+{
+
+// A vector stored in fixed size chunks that are shared between copies.
+// Copying a chunked vector only copies the pointers to its chunks, and a
+// chunk is copied the first time it is written through a vector that shares
+// it. So a copy costs the number of chunks, and afterwards each side only
+// pays for the chunks it changes. Reads go through operator[] and never
+// copy anything, writes go through write().
+//
+// The chunks that are left past the end when the vector shrinks are kept for
+// reuse unless another vector shares them, so a vector that shrinks and
+// grows again from one step to the next doesn't allocate.
+template <typename T>
+struct chunked
+{
+	static const size_t CHUNK = 32;
+	typedef vector<T> chunk;
+
+	chunked() {
+		count = 0;
+	}
+
+	chunked(const chunked &c) {
+		count = 0;
+		*this = c;
+	}
+
+	chunked(chunked &&c) = default;
+
+	~chunked() {
+	}
+
+	vector<std::shared_ptr<chunk> > chunks;
+	size_t count;
+
+	// Only the chunks in use are shared with the copy, never the spares.
+	chunked &operator=(const chunked &c) {
+		if (this != &c) {
+			chunks.assign(c.chunks.begin(), c.chunks.begin() + c.used());
+			count = c.count;
+		}
+		return *this;
+	}
+
+	chunked &operator=(chunked &&c) = default;
+
+	struct const_iterator
+	{
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef T value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const T *pointer;
+		typedef const T &reference;
+
+		const chunked *c;
+		size_t i;
+
+		reference operator*() const { return (*c)[i]; }
+		pointer operator->() const { return &(*c)[i]; }
+		reference operator[](difference_type n) const { return (*c)[i+n]; }
+
+		const_iterator &operator++() { i++; return *this; }
+		const_iterator operator++(int) { const_iterator r = *this; i++; return r; }
+		const_iterator &operator--() { i--; return *this; }
+		const_iterator operator--(int) { const_iterator r = *this; i--; return r; }
+		const_iterator &operator+=(difference_type n) { i += n; return *this; }
+		const_iterator &operator-=(difference_type n) { i -= n; return *this; }
+		const_iterator operator+(difference_type n) const { return const_iterator{c, i+n}; }
+		const_iterator operator-(difference_type n) const { return const_iterator{c, i-n}; }
+		difference_type operator-(const_iterator o) const { return (difference_type)i - (difference_type)o.i; }
+
+		bool operator==(const_iterator o) const { return i == o.i; }
+		bool operator!=(const_iterator o) const { return i != o.i; }
+		bool operator<(const_iterator o) const { return i < o.i; }
+		bool operator>(const_iterator o) const { return i > o.i; }
+		bool operator<=(const_iterator o) const { return i <= o.i; }
+		bool operator>=(const_iterator o) const { return i >= o.i; }
+	};
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	// The number of chunks that hold elements.
+	size_t used() const {
+		return (count + CHUNK - 1)/CHUNK;
+	}
+
+	size_t capacity() const {
+		return chunks.size()*CHUNK;
+	}
+
+	const T &operator[](size_t i) const {
+		return (*chunks[i/CHUNK])[i%CHUNK];
+	}
+
+	const T &back() const {
+		return (*this)[count-1];
+	}
+
+	const_iterator begin() const {
+		return const_iterator{this, 0};
+	}
+
+	const_iterator end() const {
+		return const_iterator{this, count};
+	}
+
+	// Whether chunk c is the same chunk in both vectors.
+	bool shares(const chunked &o, size_t c) const {
+		return c < used() and c < o.used() and chunks[c] == o.chunks[c];
+	}
+
+	// Make chunk c safe to write, copying it first if another vector
+	// shares it.
+	chunk &own(size_t c) {
+		std::shared_ptr<chunk> &p = chunks[c];
+		if (p == nullptr or p.use_count() > 1) {
+			std::shared_ptr<chunk> q = std::make_shared<chunk>();
+			q->reserve(CHUNK);
+			if (p != nullptr) {
+				q->assign(p->begin(), p->end());
+			}
+			p = q;
+		}
+		return *p;
+	}
+
+	T &write(size_t i) {
+		return own(i/CHUNK)[i%CHUNK];
+	}
+
+	void push_back(T value) {
+		size_t c = count/CHUNK;
+		if (c >= chunks.size()) {
+			chunks.push_back(nullptr);
+		}
+		own(c).push_back(std::move(value));
+		count++;
+	}
+
+	void resize(size_t n, const T &value = T()) {
+		if (n >= count) {
+			while (count < n) {
+				push_back(value);
+			}
+			return;
+		}
+
+		size_t keep = (n + CHUNK - 1)/CHUNK;
+		for (size_t c = keep; c < used(); c++) {
+			// Spares are only kept if nobody else can see them
+			if (chunks[c].use_count() > 1) {
+				chunks[c] = nullptr;
+			} else {
+				chunks[c]->clear();
+			}
+		}
+		if (keep > 0 and chunks[keep-1]->size() > n - (keep-1)*CHUNK) {
+			chunk &last = own(keep-1);
+			last.erase(last.begin() + (n - (keep-1)*CHUNK), last.end());
+		}
+		count = n;
+	}
+
+	void clear() {
+		resize(0);
+	}
+};
+
+}
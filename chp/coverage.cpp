@@ -0,0 +1,322 @@
+#include "coverage.h"
+
+namespace chp
+{
+
+coverage::coverage() {
+	lastStep = history_ring::NONE;
+	hits = 0;
+}
+
+coverage::coverage(const graph &g) {
+	lastStep = history_ring::NONE;
+	hits = 0;
+	resize(g);
+}
+
+coverage::~coverage() {
+}
+
+/**
+ * @brief Make room for every transition and term of g
+ *
+ * Counters that are already there are kept, so this can be called again
+ * after the graph has grown.
+ */
+void coverage::resize(const graph &g) {
+	int n = (int)g.transitions.size();
+	vector<int> offset(1, 0);
+	offset.reserve(n+1);
+	for (int i = 0; i < n; i++) {
+		offset.push_back(offset.back() + std::max(1, (int)g.transitions[i].action.terms.size()));
+	}
+
+	vector<uint64_t> count(offset.back(), 0);
+	for (int i = 0; i+1 < (int)termOffset.size() and i < n; i++) {
+		for (int j = termOffset[i]; j < termOffset[i+1] and j-termOffset[i] < offset[i+1]-offset[i]; j++) {
+			count[offset[i]+j-termOffset[i]] = firings[j];
+		}
+	}
+
+	termOffset.swap(offset);
+	firings.swap(count);
+	taken.resize(n, 0);
+	passed.resize(n, 0);
+	unstable.resize(n, 0);
+}
+
+void coverage::attach(simulator &sim) {
+	if (sim.base != NULL) {
+		resize(*sim.base);
+	}
+
+	if (find(sim.observers.begin(), sim.observers.end(), this) == sim.observers.end()) {
+		sim.observers.push_back(this);
+	}
+}
+
+/**
+ * @brief Count the guard outcomes of newly enabled transitions
+ *
+ * A transition that was enabled before the last firing keeps its 'since', so
+ * only the ones enabled since then are counted. Calling enabled() again
+ * without firing doesn't count anything twice.
+ */
+void coverage::enabled(const simulator &sim) {
+	uint64_t step = sim.history.next;
+	if (step != lastStep) {
+		lastStep = step;
+		for (const enabled_transition &t : sim.loaded) {
+			if (t.vacuous or t.since != step or t.index >= (int)passed.size()) {
+				continue;
+			}
+
+			if (t.stable) {
+				passed[t.index]++;
+			} else {
+				unstable[t.index]++;
+			}
+		}
+	}
+
+	// Remember the cause chains so that fired() can tell which vacuous
+	// transitions were taken.
+	loadedIndex.clear();
+	for (const enabled_transition &t : sim.loaded) {
+		loadedIndex.push_back(t.index);
+	}
+	if (sim.closed == (int)sim.loaded.size()) {
+		causeBegin = sim.causeBegin;
+		causeList = sim.causeList;
+	} else {
+		causeBegin.assign(sim.loaded.size()+1, 0);
+		causeList.clear();
+	}
+	readyLoaded.clear();
+	for (const pair<int, int> &r : sim.ready) {
+		readyLoaded.push_back(r.first);
+	}
+}
+
+void coverage::fired(const simulator &sim, int choice, term_index t) {
+	if (t.index >= (int)taken.size() and sim.base != NULL) {
+		resize(*sim.base);
+	}
+	if (t.index < 0 or t.index >= (int)taken.size()) {
+		return;
+	}
+
+	bool vacuous = sim.base != NULL and sim.base->transitions[t.index].action.isVacuous();
+	int term = termOffset[t.index] + t.term;
+	if (term < termOffset[t.index+1] and firings[term]++ == 0 and not vacuous) {
+		hits++;
+	}
+	if (taken[t.index]++ == 0 and vacuous) {
+		hits++;
+	}
+
+	if (choice < 0 or choice >= (int)readyLoaded.size()) {
+		return;
+	}
+
+	// Walk the vacuous transitions that caused the one that fired
+	int f = readyLoaded[choice];
+	seen.resize(loadedIndex.size());
+	seen.clear();
+	stack.assign(1, f);
+	while (not stack.empty()) {
+		int x = stack.back();
+		stack.pop_back();
+		for (int k = causeBegin[x]; k < causeBegin[x+1]; k++) {
+			int c = causeList[k];
+			if (c < f and not seen.test(c)) {
+				seen.set(c);
+				stack.push_back(c);
+				int index = loadedIndex[c];
+				if (index < (int)taken.size() and taken[index]++ == 0
+				  and sim.base != NULL and sim.base->transitions[index].action.isVacuous()) {
+					hits++;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * @brief Add the counts of another collector over the same graph
+ */
+void coverage::merge(const coverage &c) {
+	if (termOffset.empty()) {
+		termOffset = c.termOffset;
+		firings.assign(c.firings.size(), 0);
+		taken.assign(c.taken.size(), 0);
+		passed.assign(c.passed.size(), 0);
+		unstable.assign(c.unstable.size(), 0);
+	}
+
+	for (int i = 0; i < (int)c.firings.size() and i < (int)firings.size(); i++) {
+		firings[i] += c.firings[i];
+	}
+	for (int i = 0; i < (int)c.taken.size() and i < (int)taken.size(); i++) {
+		taken[i] += c.taken[i];
+		passed[i] += c.passed[i];
+		unstable[i] += c.unstable[i];
+	}
+}
+
+void coverage::clear() {
+	std::fill(firings.begin(), firings.end(), 0);
+	std::fill(taken.begin(), taken.end(), 0);
+	std::fill(passed.begin(), passed.end(), 0);
+	std::fill(unstable.begin(), unstable.end(), 0);
+	lastStep = history_ring::NONE;
+	hits = 0;
+}
+
+int coverage::points(const graph &g) const {
+	int result = 0;
+	for (int i = 0; i < (int)g.transitions.size() and i < (int)taken.size(); i++) {
+		if (not g.transitions.is_valid(i)) {
+			continue;
+		}
+
+		if (g.transitions[i].action.isVacuous()) {
+			result++;
+		} else {
+			result += termOffset[i+1] - termOffset[i];
+		}
+	}
+	return result;
+}
+
+/**
+ * @brief Count the coverage points that were hit
+ *
+ * A term is hit when it fired. A transition that doesn't assign anything
+ * never fires, so it is hit when it was taken.
+ */
+int coverage::covered(const graph &g) const {
+	int result = 0;
+	for (int i = 0; i < (int)g.transitions.size() and i < (int)taken.size(); i++) {
+		if (not g.transitions.is_valid(i)) {
+			continue;
+		}
+
+		if (g.transitions[i].action.isVacuous()) {
+			result += taken[i] > 0;
+		} else {
+			for (int j = termOffset[i]; j < termOffset[i+1]; j++) {
+				result += firings[j] > 0;
+			}
+		}
+	}
+	return result;
+}
+
+/**
+ * @brief Write the counters
+ *
+ * The first line is "coverage <transitions>". Every transition then has a
+ * line "<index> <taken> <passed> <unstable> <terms> <firings>...".
+ */
+void coverage::write(ostream &os) const {
+	os << "coverage " << taken.size() << endl;
+	for (int i = 0; i < (int)taken.size(); i++) {
+		os << i << " " << taken[i] << " " << passed[i] << " " << unstable[i] << " " << termOffset[i+1]-termOffset[i];
+		for (int j = termOffset[i]; j < termOffset[i+1]; j++) {
+			os << " " << firings[j];
+		}
+		os << endl;
+	}
+}
+
+/**
+ * @brief Read counters written by write()
+ *
+ * The current counters are replaced. Use merge() to add them up.
+ */
+bool coverage::read(istream &is) {
+	string magic;
+	int n = 0;
+	if (not (is >> magic >> n) or magic != "coverage" or n < 0) {
+		return false;
+	}
+
+	termOffset.assign(1, 0);
+	firings.clear();
+	taken.assign(n, 0);
+	passed.assign(n, 0);
+	unstable.assign(n, 0);
+	for (int i = 0; i < n; i++) {
+		int index = 0, terms = 0;
+		if (not (is >> index >> taken[i] >> passed[i] >> unstable[i] >> terms)
+		  or index != i or terms < 0) {
+			return false;
+		}
+		for (int j = 0; j < terms; j++) {
+			uint64_t count = 0;
+			if (not (is >> count)) {
+				return false;
+			}
+			firings.push_back(count);
+		}
+		termOffset.push_back((int)firings.size());
+	}
+	lastStep = history_ring::NONE;
+	return true;
+}
+
+/**
+ * @brief Print a summary for a person to read
+ *
+ * Lists the transitions and terms that were never hit, and the branches
+ * taken at each place with more than one output.
+ */
+void coverage::report(ostream &os, const graph &g) const {
+	int total = points(g);
+	int hit = covered(g);
+	os << "covered " << hit << " of " << total << " points";
+	if (total > 0) {
+		os << " (" << (100*hit/total) << "%)";
+	}
+	os << endl;
+
+	for (int i = 0; i < (int)g.transitions.size() and i < (int)taken.size(); i++) {
+		if (not g.transitions.is_valid(i)) {
+			continue;
+		}
+
+		if (taken[i] == 0) {
+			os << "T" << i << " never taken: " << g.transitions[i] << endl;
+		} else if (not g.transitions[i].action.isVacuous()) {
+			for (int j = termOffset[i]; j < termOffset[i+1]; j++) {
+				if (firings[j] == 0) {
+					os << "T" << i << "." << j-termOffset[i] << " never fired: " << g.transitions[i] << endl;
+				}
+			}
+		}
+	}
+
+	for (int p = 0; p < (int)g.places.size(); p++) {
+		if (not g.places.is_valid(p)) {
+			continue;
+		}
+
+		vector<int> branches = g.next(place::type, p);
+		if (branches.size() < 2) {
+			continue;
+		}
+
+		int count = 0;
+		for (int t : branches) {
+			count += t < (int)taken.size() and taken[t] > 0;
+		}
+		os << "P" << p << (g.places[p].arbiter ? " arbiter" : " selection") << " took " << count << " of " << branches.size() << " branches:";
+		for (int t : branches) {
+			os << " T" << t << "=" << (t < (int)taken.size() ? taken[t] : 0);
+		}
+		os << endl;
+	}
+}
+
+}
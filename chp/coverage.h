@@ -0,0 +1,75 @@
+#pragma once
+
+#include <common/standard.h>
+
+#include "simulator.h"
+
+namespace chp
+{
+
+// Collects the coverage of a simulation. attach() adds the collector to the
+// simulator's observers. From then on, it counts
+//  - how many times each term of each transition fired,
+//  - how many times each transition was taken, either by firing or by being
+//    passed through as a vacuous transition in the chain of one that fired,
+//  - how many times each transition was newly enabled with a guard that
+//    passed, and how many times with a guard that was unstable.
+// Taken transitions also cover the branches of selections and arbiters: a
+// branch was taken if the first transition after the choice was.
+//
+// All counters are dense arrays indexed by transition, or by term through
+// termOffset. Collectors over the same graph can be merged, so the coverage
+// of several runs, from different seeds or different machines, adds up. The
+// report format is plain text with one line per transition.
+struct coverage : observer
+{
+	coverage();
+	coverage(const graph &g);
+	~coverage();
+
+	// firings[termOffset[i]+j] counts the firings of term j of transition i.
+	// termOffset has one more entry than there are transitions.
+	vector<int> termOffset;
+	vector<uint64_t> firings;
+
+	vector<uint64_t> taken;
+	vector<uint64_t> passed;
+	vector<uint64_t> unstable;
+
+	// The number of coverage points that fired() hit for the first time,
+	// since the collector was made or cleared. This is kept up to date so
+	// that a driver can tell whether a step covered anything new without
+	// calling covered().
+	int hits;
+
+	// The cause chains of the ready transitions as of the last call to
+	// simulator::enabled(), used to find the vacuous transitions that are
+	// taken along with the one that fires.
+	vector<int> loadedIndex;
+	vector<int> causeBegin;
+	vector<int> causeList;
+	vector<int> readyLoaded;
+	vector<int> stack;
+	bitvector seen;
+	uint64_t lastStep;
+
+	void resize(const graph &g);
+	void attach(simulator &sim);
+
+	void enabled(const simulator &sim) override;
+	void fired(const simulator &sim, int choice, term_index t) override;
+
+	void merge(const coverage &c);
+	void clear();
+
+	// A coverage point is a term of a transition that assigns something, or a
+	// transition that doesn't. Returns the number of points that were hit.
+	int points(const graph &g) const;
+	int covered(const graph &g) const;
+
+	void write(ostream &os) const;
+	bool read(istream &is);
+	void report(ostream &os, const graph &g) const;
+};
+
+}
@@ -0,0 +1,283 @@
+#include "dataflow.h"
+
+#include <deque>
+
+namespace chp
+{
+
+definition::definition() {
+	var = 0;
+	transition = 0;
+}
+
+definition::definition(size_t var, size_t transition) {
+	this->var = var;
+	this->transition = transition;
+}
+
+definition::~definition() {
+}
+
+dataflow::dataflow() {
+	webCount = 0;
+}
+
+dataflow::dataflow(graph &g) {
+	webCount = 0;
+	compute(g);
+}
+
+dataflow::~dataflow() {
+}
+
+/**
+ * @brief Run every analysis over the control flow graph of g
+ *
+ * Computes the use-def chains and the control flow graph first if they
+ * haven't been computed yet.
+ */
+void dataflow::compute(graph &g) {
+	if (not g.useDefChainsReady) {
+		g.computeUseDefChains();
+	}
+	if (not g.controlFlowGraphReady) {
+		g.computeControlFlowGraph();
+	}
+
+	computeLocal(g);
+	computeReaching(g);
+	computeLiveness(g);
+	computeWebs(g);
+}
+
+/**
+ * @brief Number the definitions and compute the per-block local sets
+ *
+ * Walks each block in order to compute gen and kill over definitions, and
+ * in reverse to compute use (read before written in the block) and def
+ * (written in the block) over variables.
+ */
+void dataflow::computeLocal(const graph &g) {
+	size_t nvars = g.vars.size();
+	size_t ntrans = g.transitions.size();
+	size_t nblocks = g.controlFlowGraph.size();
+
+	defs.clear();
+	varDefs.assign(nvars, bitvector());
+	transitionUses.assign(ntrans, vector<size_t>());
+	transitionDefs.assign(ntrans, vector<size_t>());
+
+	for (const auto &[var, chain] : g.useDefChains) {
+		vector<size_t> sites = chain.defs;
+		sort(sites.begin(), sites.end());
+		sites.erase(unique(sites.begin(), sites.end()), sites.end());
+		for (size_t t : sites) {
+			transitionDefs[t].push_back(defs.size());
+			defs.push_back(definition(var, t));
+		}
+
+		sites = chain.uses;
+		sort(sites.begin(), sites.end());
+		sites.erase(unique(sites.begin(), sites.end()), sites.end());
+		for (size_t t : sites) {
+			transitionUses[t].push_back(var);
+		}
+	}
+
+	for (size_t v = 0; v < nvars; v++) {
+		varDefs[v].resize(defs.size());
+	}
+	for (size_t d = 0; d < defs.size(); d++) {
+		varDefs[defs[d].var].set(d);
+	}
+
+	gen.assign(nblocks, bitvector(defs.size()));
+	kill.assign(nblocks, bitvector(defs.size()));
+	use.assign(nblocks, bitvector(nvars));
+	def.assign(nblocks, bitvector(nvars));
+
+	for (size_t b = 0; b < nblocks; b++) {
+		std::span<const petri::iterator> block = g.controlFlowGraph.transitionsOf(b);
+		for (const petri::iterator &t : block) {
+			for (size_t d : transitionDefs[t.index]) {
+				gen[b] -= varDefs[defs[d].var];
+				kill[b] |= varDefs[defs[d].var];
+			}
+			for (size_t d : transitionDefs[t.index]) {
+				gen[b].set(d);
+			}
+		}
+
+		for (int i = (int)block.size()-1; i >= 0; i--) {
+			size_t t = block[i].index;
+			for (size_t d : transitionDefs[t]) {
+				use[b].reset(defs[d].var);
+				def[b].set(defs[d].var);
+			}
+			for (size_t v : transitionUses[t]) {
+				use[b].set(v);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Forward worklist solution of reaching definitions
+ *
+ * in[B] = union of out[P] over predecessors P
+ * out[B] = gen[B] | (in[B] - kill[B])
+ */
+void dataflow::computeReaching(const graph &g) {
+	size_t nblocks = g.controlFlowGraph.size();
+	reachIn.assign(nblocks, bitvector(defs.size()));
+	reachOut = gen;
+
+	std::deque<size_t> worklist;
+	vector<bool> queued(nblocks, true);
+	for (size_t b = 0; b < nblocks; b++) {
+		worklist.push_back(b);
+	}
+
+	while (not worklist.empty()) {
+		size_t b = worklist.front();
+		worklist.pop_front();
+		queued[b] = false;
+
+		bitvector in(defs.size());
+		for (size_t p : g.controlFlowGraph.insOf(b)) {
+			in |= reachOut[p];
+		}
+		reachIn[b] = in;
+
+		bitvector out = gen[b] | (in - kill[b]);
+		if (out != reachOut[b]) {
+			reachOut[b] = out;
+			for (size_t s : g.controlFlowGraph.outsOf(b)) {
+				if (not queued[s]) {
+					worklist.push_back(s);
+					queued[s] = true;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * @brief Backward worklist solution of liveness
+ *
+ * out[B] = union of in[S] over successors S
+ * in[B] = use[B] | (out[B] - def[B])
+ */
+void dataflow::computeLiveness(const graph &g) {
+	size_t nvars = g.vars.size();
+	size_t nblocks = g.controlFlowGraph.size();
+	liveIn = use;
+	liveOut.assign(nblocks, bitvector(nvars));
+
+	std::deque<size_t> worklist;
+	vector<bool> queued(nblocks, true);
+	for (size_t b = nblocks; b > 0; b--) {
+		worklist.push_back(b-1);
+	}
+
+	while (not worklist.empty()) {
+		size_t b = worklist.front();
+		worklist.pop_front();
+		queued[b] = false;
+
+		bitvector out(nvars);
+		for (size_t s : g.controlFlowGraph.outsOf(b)) {
+			out |= liveIn[s];
+		}
+		liveOut[b] = out;
+
+		bitvector in = use[b] | (out - def[b]);
+		if (in != liveIn[b]) {
+			liveIn[b] = in;
+			for (size_t p : g.controlFlowGraph.insOf(b)) {
+				if (not queued[p]) {
+					worklist.push_back(p);
+					queued[p] = true;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * @brief Link every use to the definitions that reach it and group those
+ * definitions into webs
+ *
+ * Definitions that reach the same use must be stored in the same register,
+ * so they are joined with a union-find over definitions.
+ */
+void dataflow::computeWebs(const graph &g) {
+	useSites.assign(defs.size(), vector<size_t>());
+
+	vector<int> parent(defs.size());
+	for (size_t d = 0; d < defs.size(); d++) {
+		parent[d] = (int)d;
+	}
+
+	auto find = [&parent](int d) {
+		while (parent[d] != d) {
+			parent[d] = parent[parent[d]];
+			d = parent[d];
+		}
+		return d;
+	};
+
+	for (size_t b = 0; b < g.controlFlowGraph.size(); b++) {
+		bitvector current = reachIn[b];
+		for (const petri::iterator &t : g.controlFlowGraph.transitionsOf(b)) {
+			for (size_t v : transitionUses[t.index]) {
+				int first = -1;
+				bitvector reaching = current & varDefs[v];
+				for (size_t d = reaching.next(0); d < reaching.bits; d = reaching.next(d+1)) {
+					useSites[d].push_back(t.index);
+					if (first < 0) {
+						first = find((int)d);
+					} else {
+						parent[find((int)d)] = first;
+					}
+				}
+			}
+
+			for (size_t d : transitionDefs[t.index]) {
+				current -= varDefs[defs[d].var];
+			}
+			for (size_t d : transitionDefs[t.index]) {
+				current.set(d);
+			}
+		}
+	}
+
+	web.assign(defs.size(), -1);
+	webCount = 0;
+	vector<int> id(defs.size(), -1);
+	for (size_t d = 0; d < defs.size(); d++) {
+		int root = find((int)d);
+		if (id[root] < 0) {
+			id[root] = webCount++;
+		}
+		web[d] = id[root];
+	}
+}
+
+bool dataflow::reaches(size_t def, size_t block) const {
+	return block < reachIn.size() and reachIn[block].test(def);
+}
+
+bool dataflow::isLive(size_t var, size_t block) const {
+	return block < liveIn.size() and liveIn[block].test(var);
+}
+
+bitvector dataflow::live() const {
+	bitvector result;
+	for (const bitvector &in : liveIn) {
+		result |= in;
+	}
+	return result;
+}
+
+}
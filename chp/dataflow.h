@@ -0,0 +1,80 @@
+#pragma once
+
+#include <common/standard.h>
+
+#include "bitvector.h"
+#include "graph.h"
+
+namespace chp
+{
+
+// A single definition of a variable: variable 'var' is assigned by the
+// action of transition 'transition'. Definitions are numbered densely so
+// that sets of them can be stored in a bitvector.
+struct definition
+{
+	definition();
+	definition(size_t var, size_t transition);
+	~definition();
+
+	size_t var;
+	size_t transition;
+};
+
+// Bit-vector dataflow analyses over the blocks of graph::controlFlowGraph.
+// Reaching definitions is a forward may-analysis over definitions and
+// liveness is a backward may-analysis over variables. Both are solved with
+// a worklist of blocks. Parallel branches are treated like choices, which
+// is conservative for both analyses: a definition on either side of a fork
+// may reach the join, and a variable used on either side is live at the fork.
+struct dataflow
+{
+	dataflow();
+	dataflow(graph &g);
+	~dataflow();
+
+	// All definitions in the graph and, for each variable, the set of
+	// definitions of that variable.
+	vector<definition> defs;
+	vector<bitvector> varDefs;
+
+	// For each transition, the variables it reads (in its guard or any
+	// right-hand side) and the definitions it makes.
+	vector<vector<size_t> > transitionUses;
+	vector<vector<size_t> > transitionDefs;
+
+	// Reaching definitions per block, indexed by block uid.
+	vector<bitvector> gen;
+	vector<bitvector> kill;
+	vector<bitvector> reachIn;
+	vector<bitvector> reachOut;
+
+	// Liveness per block, indexed by block uid, over variables.
+	vector<bitvector> use;
+	vector<bitvector> def;
+	vector<bitvector> liveIn;
+	vector<bitvector> liveOut;
+
+	// Def-use webs. useSites[d] lists the transitions that may read
+	// definition d. Definitions that reach a common use are joined into the
+	// same web, and web[d] is the web of definition d.
+	vector<vector<size_t> > useSites;
+	vector<int> web;
+	int webCount;
+
+	void compute(graph &g);
+
+	bool reaches(size_t def, size_t block) const;
+	bool isLive(size_t var, size_t block) const;
+
+	// The set of variables that are live on entry to any block. Variables
+	// that are never live don't need to be stored between iterations.
+	bitvector live() const;
+
+	void computeLocal(const graph &g);
+	void computeReaching(const graph &g);
+	void computeLiveness(const graph &g);
+	void computeWebs(const graph &g);
+};
+
+}
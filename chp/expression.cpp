@@ -1,35 +1,377 @@
 #include "expression.h"
-#include <parse_cog/expression.h>
-#include <interpret_arithmetic/export.h>
+
+#include <sstream>
+
+#include <interpret_arithmetic/import.h>
+#include <parse/tokenizer.h>
+#include <parse_expression/expression.h>
 
 namespace chp {
 
+const char *builtinName(int id) {
+	switch (id) {
+	case RECV: return "recv";
+	case SEND: return "send";
+	case PROBE: return "probe";
+	default: return "";
+	}
+}
+
+/**
+ * @brief Resolve the name of a function to its built-in id
+ *
+ * Dispatches on the length of the name first so that names which can't be a
+ * built-in are rejected without a full comparison.
+ */
+int builtinOf(const string &name) {
+	if (name.size() == 4) {
+		if (name == "recv") {
+			return RECV;
+		} else if (name == "send") {
+			return SEND;
+		}
+	} else if (name.size() == 5 and name == "probe") {
+		return PROBE;
+	}
+	return NOT_BUILTIN;
+}
+
+/**
+ * @brief The built-in id of a CALL operation, or NOT_BUILTIN for any other
+ * operation or function
+ */
+int builtinOf(const arithmetic::Operation &op) {
+	if (op.func != arithmetic::Operation::OpType::CALL or op.operands.empty()) {
+		return NOT_BUILTIN;
+	}
+	return builtinOf(op.operands[0].cnst.sval);
+}
+
+builtinTable::builtinTable() {
+}
+
+builtinTable::builtinTable(const arithmetic::Expression &e) {
+	for (const arithmetic::Operand &operand : e.exprIndex()) {
+		int id = builtinOf(*e.getExpr(operand.index));
+		if (id != NOT_BUILTIN) {
+			if (operand.index >= ids.size()) {
+				ids.resize(operand.index+1, NOT_BUILTIN);
+			}
+			ids[operand.index] = (int8_t)id;
+		}
+	}
+}
+
+builtinTable::~builtinTable() {
+}
+
+int builtinTable::operator[](size_t operation) const {
+	return operation < ids.size() ? ids[operation] : NOT_BUILTIN;
+}
+
+/**
+ * @brief How tightly an operation binds when written out, higher binds
+ * tighter
+ *
+ * This follows the precedence levels of the expression grammar, so the text
+ * reads back into the same tree with read_expression().
+ */
+int precedenceOf(int func) {
+	switch (func) {
+	case arithmetic::Operation::TERNARY: return 0;
+	case arithmetic::Operation::BOOLEAN_OR: return 1;
+	case arithmetic::Operation::BOOLEAN_XOR: return 2;
+	case arithmetic::Operation::BOOLEAN_AND: return 3;
+	case arithmetic::Operation::BITWISE_OR: return 4;
+	case arithmetic::Operation::BITWISE_XOR: return 5;
+	case arithmetic::Operation::BITWISE_AND: return 6;
+	case arithmetic::Operation::EQUAL:
+	case arithmetic::Operation::NOT_EQUAL: return 7;
+	case arithmetic::Operation::LESS:
+	case arithmetic::Operation::GREATER:
+	case arithmetic::Operation::LESS_EQUAL:
+	case arithmetic::Operation::GREATER_EQUAL: return 8;
+	case arithmetic::Operation::LEFT_SHIFT:
+	case arithmetic::Operation::RIGHT_SHIFT: return 9;
+	case arithmetic::Operation::ADD:
+	case arithmetic::Operation::SUBTRACT: return 10;
+	case arithmetic::Operation::MULTIPLY:
+	case arithmetic::Operation::DIVIDE:
+	case arithmetic::Operation::MOD: return 11;
+	case arithmetic::Operation::BITWISE_NOT:
+	case arithmetic::Operation::IDENTITY:
+	case arithmetic::Operation::NEGATION:
+	case arithmetic::Operation::VALIDITY:
+	case arithmetic::Operation::BOOLEAN_NOT:
+	case arithmetic::Operation::INVERSE: return 12;
+	default: return 13;
+	}
+}
+
+const char *symbolOf(int func) {
+	switch (func) {
+	case arithmetic::Operation::BITWISE_NOT: return "~";
+	case arithmetic::Operation::IDENTITY: return "+";
+	case arithmetic::Operation::NEGATION: return "-";
+	case arithmetic::Operation::VALIDITY: return "(bool)";
+	case arithmetic::Operation::BOOLEAN_NOT: return "!";
+	case arithmetic::Operation::INVERSE: return "1/";
+	case arithmetic::Operation::BITWISE_OR: return "|";
+	case arithmetic::Operation::BITWISE_AND: return "&";
+	case arithmetic::Operation::BITWISE_XOR: return "^";
+	case arithmetic::Operation::EQUAL: return "==";
+	case arithmetic::Operation::NOT_EQUAL: return "!=";
+	case arithmetic::Operation::LESS: return "<";
+	case arithmetic::Operation::GREATER: return ">";
+	case arithmetic::Operation::LESS_EQUAL: return "<=";
+	case arithmetic::Operation::GREATER_EQUAL: return ">=";
+	case arithmetic::Operation::LEFT_SHIFT: return "<<";
+	case arithmetic::Operation::RIGHT_SHIFT: return ">>";
+	case arithmetic::Operation::ADD: return "+";
+	case arithmetic::Operation::SUBTRACT: return "-";
+	case arithmetic::Operation::MULTIPLY: return "*";
+	case arithmetic::Operation::DIVIDE: return "/";
+	case arithmetic::Operation::MOD: return "%";
+	case arithmetic::Operation::BOOLEAN_OR: return "||";
+	case arithmetic::Operation::BOOLEAN_AND: return "&&";
+	case arithmetic::Operation::BOOLEAN_XOR: return "^^";
+	default: return "";
+	}
+}
+
+/**
+ * @brief Write one operand of expr and everything below it
+ *
+ * The operand is wrapped in parentheses when it binds more loosely than
+ * level, the precedence its parent requires at this position.
+ */
+void emit_operand(ostream &os, const arithmetic::Expression &expr, const arithmetic::Operand &op, const ucs::ConstNetlist &nets, int level) {
+	if (op.isConst() or op.type == arithmetic::Operand::TYPE) {
+		os << op.cnst;
+		return;
+	} else if (op.isVar()) {
+		os << nets.netAt(op.index);
+		return;
+	} else if (not op.isExpr()) {
+		return;
+	}
+
+	const arithmetic::Operation *operation = expr.getExpr(op.index);
+	if (operation == nullptr or operation->operands.empty()) {
+		return;
+	}
+
+	const vector<arithmetic::Operand> &args = operation->operands;
+	int prec = precedenceOf(operation->func);
+	if (prec < level) {
+		os << "(";
+	}
+
+	switch (operation->func) {
+	case arithmetic::Operation::BITWISE_NOT:
+	case arithmetic::Operation::IDENTITY:
+	case arithmetic::Operation::NEGATION:
+	case arithmetic::Operation::VALIDITY:
+	case arithmetic::Operation::BOOLEAN_NOT:
+	case arithmetic::Operation::INVERSE:
+		os << symbolOf(operation->func);
+		emit_operand(os, expr, args[0], nets, prec);
+		break;
+	case arithmetic::Operation::TERNARY:
+		for (int i = 0; i < (int)args.size(); i++) {
+			if (i != 0) {
+				os << (i == 1 ? "?" : ":");
+			}
+			emit_operand(os, expr, args[i], nets, prec+1);
+		}
+		break;
+	case arithmetic::Operation::ARRAY:
+		os << "[";
+		for (int i = 0; i < (int)args.size(); i++) {
+			if (i != 0) {
+				os << ",";
+			}
+			emit_operand(os, expr, args[i], nets, 0);
+		}
+		os << "]";
+		break;
+	case arithmetic::Operation::INDEX:
+		emit_operand(os, expr, args[0], nets, prec);
+		os << "[";
+		for (int i = 1; i < (int)args.size(); i++) {
+			if (i != 1) {
+				os << ":";
+			}
+			emit_operand(os, expr, args[i], nets, 0);
+		}
+		os << "]";
+		break;
+	case arithmetic::Operation::MEMBER:
+		emit_operand(os, expr, args[0], nets, prec);
+		os << ".";
+		if (args.size() > 1 and args[1].isConst() and args[1].cnst.type == arithmetic::Value::STRING) {
+			os << args[1].cnst.sval;
+		} else if (args.size() > 1) {
+			emit_operand(os, expr, args[1], nets, prec);
+		}
+		break;
+	case arithmetic::Operation::CALL:
+		os << args[0].cnst.sval << "(";
+		for (int i = 1; i < (int)args.size(); i++) {
+			if (i != 1) {
+				os << ",";
+			}
+			emit_operand(os, expr, args[i], nets, 0);
+		}
+		os << ")";
+		break;
+	default:
+		// Binary operators associate to the left
+		for (int i = 0; i < (int)args.size(); i++) {
+			if (i != 0) {
+				os << symbolOf(operation->func);
+			}
+			emit_operand(os, expr, args[i], nets, i == 0 ? prec : prec+1);
+		}
+		break;
+	}
+
+	if (prec < level) {
+		os << ")";
+	}
+}
+
+void emit_composition(ostream &os, const arithmetic::Action &expr, ucs::ConstNetlist nets) {
+	if (not expr.lvalue.isNull()) {
+		emit_expression(os, expr.lvalue, nets);
+		os << "=";
+	}
+	emit_expression(os, expr.rvalue, nets);
+}
+
+void emit_composition(ostream &os, const arithmetic::Parallel &expr, ucs::ConstNetlist nets) {
+	if (expr.actions.empty()) {
+		os << "skip";
+	}
+	for (int i = 0; i < (int)expr.actions.size(); i++) {
+		if (i != 0) {
+			os << ",";
+		}
+		emit_composition(os, expr.actions[i], nets);
+	}
+}
+
+void emit_composition(ostream &os, const arithmetic::Choice &expr, ucs::ConstNetlist nets) {
+	for (int i = 0; i < (int)expr.terms.size(); i++) {
+		if (i != 0) {
+			os << ":";
+		}
+		emit_composition(os, expr.terms[i], nets);
+	}
+}
+
+void emit_composition(ostream &os, const arithmetic::State &expr, ucs::ConstNetlist nets) {
+	bool first = true;
+	for (int i = 0; i < (int)expr.values.size(); i++) {
+		if (not expr.values[i].isUnknown()) {
+			if (not first) {
+				os << ",";
+			}
+			os << nets.netAt(i) << "=" << expr.values[i];
+			first = false;
+		}
+	}
+	if (first) {
+		os << "skip";
+	}
+}
+
+void emit_composition(ostream &os, const arithmetic::Region &expr, ucs::ConstNetlist nets) {
+	for (int i = 0; i < (int)expr.states.size(); i++) {
+		if (i != 0) {
+			os << ":";
+		}
+		emit_composition(os, expr.states[i], nets);
+	}
+}
+
+void emit_expression(ostream &os, const arithmetic::Expression &expr, ucs::ConstNetlist nets) {
+	if (not expr.isNull()) {
+		emit_operand(os, expr, expr.top, nets, 0);
+	}
+}
+
+void emit_expression(ostream &os, const arithmetic::State &expr, ucs::ConstNetlist nets) {
+	bool first = true;
+	for (int i = 0; i < (int)expr.values.size(); i++) {
+		if (not expr.values[i].isUnknown()) {
+			if (not first) {
+				os << "&&";
+			}
+			os << nets.netAt(i) << "==" << expr.values[i];
+			first = false;
+		}
+	}
+	if (first) {
+		os << "true";
+	}
+}
+
 string emit_composition(const arithmetic::Action &expr, ucs::ConstNetlist nets) {
-	return arithmetic::export_assignment<parse_cog::assignment>(expr, nets).to_string();
+	ostringstream os;
+	emit_composition(os, expr, nets);
+	return os.str();
 }
 
 string emit_composition(const arithmetic::Parallel &expr, ucs::ConstNetlist nets) {
-	return arithmetic::export_composition<parse_cog::simple_composition>(expr, nets).to_string();
+	ostringstream os;
+	emit_composition(os, expr, nets);
+	return os.str();
 }
 
 string emit_composition(const arithmetic::Choice &expr, ucs::ConstNetlist nets) {
-	return arithmetic::export_composition<parse_cog::simple_composition>(expr, nets).to_string();
+	ostringstream os;
+	emit_composition(os, expr, nets);
+	return os.str();
 }
 
 string emit_composition(const arithmetic::State &expr, ucs::ConstNetlist nets) {
-	return arithmetic::export_composition<parse_cog::simple_composition>(expr, nets).to_string();
+	ostringstream os;
+	emit_composition(os, expr, nets);
+	return os.str();
 }
 
 string emit_composition(const arithmetic::Region &expr, ucs::ConstNetlist nets) {
-	return arithmetic::export_composition<parse_cog::simple_composition>(expr, nets).to_string();
+	ostringstream os;
+	emit_composition(os, expr, nets);
+	return os.str();
 }
 
 string emit_expression(const arithmetic::Expression &expr, ucs::ConstNetlist nets) {
-	return arithmetic::export_expression<parse_cog::expression>(expr, nets).to_string();
+	ostringstream os;
+	emit_expression(os, expr, nets);
+	return os.str();
 }
 
 string emit_expression(const arithmetic::State &expr, ucs::ConstNetlist nets) {
-	return arithmetic::export_expression<parse_cog::expression>(expr, nets).to_string();
+	ostringstream os;
+	emit_expression(os, expr, nets);
+	return os.str();
+}
+
+arithmetic::Expression read_expression(const string &text, ucs::Netlist nets) {
+	tokenizer tokens;
+	parse_expression::expression::register_syntax(tokens);
+	tokens.insert("expression", text, nullptr);
+
+	arithmetic::Expression result;
+	tokens.increment(true);
+	tokens.expect<parse_expression::expression>();
+	if (tokens.decrement(__FILE__, __LINE__)) {
+		parse_expression::expression syntax(tokens);
+		result = arithmetic::import_expression(syntax, nets, 0, &tokens, false);
+	}
+	return result;
 }
 
 }
@@ -6,6 +6,50 @@
 
 namespace chp {
 
+// Channel actions are represented in expressions as calls to these built-in
+// functions. builtinOf() resolves the name of a CALL to one of these ids
+// with a length check and at most one comparison. Synthesis and width
+// inference dispatch on these ids. The simulator doesn't: calls are
+// evaluated inside the arithmetic library.
+enum builtin {
+	NOT_BUILTIN = 0,
+	RECV = 1,
+	SEND = 2,
+	PROBE = 3
+};
+
+const char *builtinName(int id);
+int builtinOf(const string &name);
+int builtinOf(const arithmetic::Operation &op);
+
+// The built-in id of every operation in one expression, indexed by the
+// index of the operation. The names are resolved once when the table is
+// built, so passes that walk the same expression many times dispatch on an
+// integer afterwards. The table is kept beside the expression rather than
+// in it and is only valid until the expression changes.
+struct builtinTable {
+	builtinTable();
+	builtinTable(const arithmetic::Expression &e);
+	~builtinTable();
+
+	vector<int8_t> ids;
+
+	int operator[](size_t operation) const;
+};
+
+// The ostream overloads append to the stream, so callers can format many
+// expressions into one buffer without concatenating temporary strings. They
+// walk the expression directly instead of building a syntax tree, and only
+// add parentheses where precedence requires them. The string overloads are
+// wrappers around the ostream ones.
+void emit_composition(ostream &os, const arithmetic::Action &expr, ucs::ConstNetlist nets);
+void emit_composition(ostream &os, const arithmetic::Parallel &expr, ucs::ConstNetlist nets);
+void emit_composition(ostream &os, const arithmetic::Choice &expr, ucs::ConstNetlist nets);
+void emit_composition(ostream &os, const arithmetic::State &expr, ucs::ConstNetlist nets);
+void emit_composition(ostream &os, const arithmetic::Region &expr, ucs::ConstNetlist nets);
+void emit_expression(ostream &os, const arithmetic::Expression &expr, ucs::ConstNetlist nets);
+void emit_expression(ostream &os, const arithmetic::State &expr, ucs::ConstNetlist nets);
+
 string emit_composition(const arithmetic::Action &expr, ucs::ConstNetlist nets);
 string emit_composition(const arithmetic::Parallel &expr, ucs::ConstNetlist nets);
 string emit_composition(const arithmetic::Choice &expr, ucs::ConstNetlist nets);
@@ -15,4 +59,8 @@ string emit_expression(const arithmetic::Expression &expr, ucs::ConstNetlist net
 string emit_expression(const arithmetic::State &expr, ucs::ConstNetlist nets);
 string emit_expression(const arithmetic::Region &expr, ucs::ConstNetlist nets);
 
+// Parse the text produced by emit_expression() back into an expression.
+// Variables are looked up by name in nets and are not defined if missing.
+arithmetic::Expression read_expression(const string &text, ucs::Netlist nets);
+
 }
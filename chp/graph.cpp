@@ -1,7 +1,9 @@
 #include "graph.h"
 
+#include <functional>
 #include <queue>
 #include <ranges>
+#include <sstream>
 
 #include <arithmetic/expression.h>
 #include <chp/simulator.h>
@@ -10,6 +12,8 @@
 #include <common/mapping.h>
 #include <interpret_arithmetic/export.h>
 
+#include "instrument.h"
+
 namespace chp
 {
 
@@ -93,6 +97,12 @@ bool transition::is_vacuous()
 	return guard.isConstant() and action.isVacuous();
 }
 
+string transition::key() const {
+	ostringstream os;
+	os << guard << "->" << action;
+	return os.str();
+}
+
 ostream &operator<<(ostream &os, const transition &t) {
 	os << t.guard << "->" << t.action;
 	return os;
@@ -325,7 +335,136 @@ Mapping<petri::iterator> graph::merge(graph g) {
 }
 
 
+/**
+ * @brief Remove the invalid slots left behind by erased places and transitions
+ *
+ * Transformations like flatten() and merge() erase nodes in place, leaving
+ * holes in places and transitions that every later pass has to skip over.
+ * This rebuilds the graph so that all valid nodes are numbered densely in
+ * their original order, then remaps the arcs, the reset states, the use-def
+ * chains and the control flow graph. Split groups are recomputed if they had
+ * been computed before.
+ *
+ * @return The mapping from old iterators to new iterators. Iterators of
+ * erased nodes are not in the mapping.
+ */
+Mapping<petri::iterator> graph::compact() {
+	Mapping<petri::iterator> result(petri::iterator(), false);
+
+	graph dense;
+	dense.name = name;
+	dense.vars = vars;
+
+	vector<int> placeMap(places.size(), -1);
+	for (int i = 0; i < (int)places.size(); i++) {
+		if (places.is_valid(i)) {
+			petri::iterator to = dense.create(places[i]);
+			placeMap[i] = to.index;
+			result.set(petri::iterator(place::type, i), to);
+		}
+	}
+
+	vector<int> transitionMap(transitions.size(), -1);
+	for (int i = 0; i < (int)transitions.size(); i++) {
+		if (transitions.is_valid(i)) {
+			petri::iterator to = dense.create(transitions[i]);
+			transitionMap[i] = to.index;
+			result.set(petri::iterator(transition::type, i), to);
+		}
+	}
+
+	auto remap = [&](petri::iterator i) {
+		int index = -1;
+		if (i.index >= 0) {
+			index = i.type == place::type ? placeMap[i.index] : transitionMap[i.index];
+		}
+		return petri::iterator(i.type, index);
+	};
+
+	for (int type = 0; type < 2; type++) {
+		for (const petri::arc &a : arcs[type]) {
+			petri::iterator from = remap(a.from);
+			petri::iterator to = remap(a.to);
+			if (from.index >= 0 and to.index >= 0) {
+				dense.connect(from, to);
+			}
+		}
+	}
+
+	for (state s : reset) {
+		vector<petri::token> tokens;
+		for (petri::token t : s.tokens) {
+			if (t.index >= 0 and placeMap[t.index] >= 0) {
+				t.index = placeMap[t.index];
+				tokens.push_back(t);
+			}
+		}
+		s.tokens = tokens;
+		dense.reset.push_back(s);
+	}
+
+	// Use-def chains and the control flow graph only refer to transitions, so
+	// they can be carried over rather than recomputed.
+	dense.useDefChainsReady = useDefChainsReady;
+	for (auto &[var, chain] : useDefChains) {
+		useDefChain &to = dense.useDefChains[var];
+		to.name = chain.name;
+		for (size_t t : chain.defs) {
+			if (transitionMap[t] >= 0) {
+				to.defs.push_back(transitionMap[t]);
+			}
+		}
+		for (size_t t : chain.uses) {
+			if (transitionMap[t] >= 0) {
+				to.uses.push_back(transitionMap[t]);
+			}
+		}
+	}
+
+	dense.controlFlowGraphReady = controlFlowGraphReady;
+	dense.controlFlowGraph = controlFlowGraph;
+	controlFlow &cfg = dense.controlFlowGraph;
+	for (petri::iterator &t : cfg.transitions) {
+		t = remap(t);
+	}
+	for (controlFlowBlock &b : cfg.blocks) {
+		b.first = remap(b.first);
+		b.last = remap(b.last);
+	}
+	cfg.transitionToBlock.assign(dense.transitions.size(), -1);
+	for (int i = 0; i < (int)controlFlowGraph.transitionToBlock.size(); i++) {
+		if (i < (int)transitionMap.size() and transitionMap[i] >= 0) {
+			cfg.transitionToBlock[transitionMap[i]] = controlFlowGraph.transitionToBlock[i];
+		}
+	}
+
+	bool splitGroups = split_groups_ready;
+	*this = std::move(dense);
+	split_groups_ready = false;
+	if (splitGroups) {
+		compute_split_groups();
+	}
+
+	return result;
+}
+
+
+/**
+ * @brief Drop the analyses that were computed from the current structure
+ *
+ * Every pass that edits the graph calls this so that dataflow::compute()
+ * recomputes the use-def chains and the control flow graph instead of
+ * reading stale ones.
+ */
+void graph::mark_modified() {
+	controlFlowGraphReady = false;
+	useDefChainsReady = false;
+}
+
 void graph::post_process(bool proper_nesting, bool aggressive) {
+	CHP_TIME(PHASE_POST_PROCESS);
+	mark_modified();
+
 	// Handle Reset Behavior
 
 	bool change = true;
@@ -522,22 +661,15 @@ void graph::post_process(bool proper_nesting, bool aggressive) {
 }
 
 void graph::setUseDef(size_t chp_var_idx, size_t transition_idx, bool is_definition) {
-	string chp_var_name = this->netAt(chp_var_idx);
-
 	// New variable? Record its name
 	if (this->useDefChains.find(chp_var_idx) == this->useDefChains.end()) {
-		this->useDefChains[chp_var_idx].name = chp_var_name;
+		this->useDefChains[chp_var_idx].name = this->netAt(chp_var_idx);
 	}
 
 	if (is_definition) {
 		this->useDefChains[chp_var_idx].defs.push_back(transition_idx);
-		//this->defs[chp_var_name].push_back(transition_idx);
-		cout << "DEF _,.=~-^*'\"`\\r-=>" << chp_var_name << " @" << transition_idx << endl;
-
 	} else {
 		this->useDefChains[chp_var_idx].uses.push_back(transition_idx);
-		//this->uses[chp_var_name].push_back(transition_idx);
-		cout << "USE _,.=~-^*'\"`\\r-=>" << chp_var_name << " @" << transition_idx << endl;
 	}
 }
 
@@ -574,139 +706,188 @@ void graph::extractUseDefFromTransition(size_t transition_idx) {
 	}
 }
 
+size_t graph::controlFlow::size() const {
+	return blocks.size();
+}
+
+void graph::controlFlow::clear() {
+	blocks.clear();
+	transitions.clear();
+	ins.clear();
+	outs.clear();
+	transitionToBlock.clear();
+}
+
+const graph::controlFlowBlock &graph::controlFlow::operator[](size_t block) const {
+	return blocks[block];
+}
+
+std::span<const petri::iterator> graph::controlFlow::transitionsOf(size_t block) const {
+	return std::span<const petri::iterator>(transitions.data() + blocks[block].transitionsBegin, blocks[block].transitionsEnd - blocks[block].transitionsBegin);
+}
+
+std::span<const size_t> graph::controlFlow::insOf(size_t block) const {
+	return std::span<const size_t>(ins.data() + blocks[block].insBegin, blocks[block].insEnd - blocks[block].insBegin);
+}
+
+std::span<const size_t> graph::controlFlow::outsOf(size_t block) const {
+	return std::span<const size_t>(outs.data() + blocks[block].outsBegin, blocks[block].outsEnd - blocks[block].outsBegin);
+}
+
+/**
+ * @brief Group the transitions into basic blocks and connect them
+ *
+ * This runs in time linear in the number of places, transitions and arcs.
+ * First, the arcs are bucketed by node so that the input and output places
+ * of each transition and the input and output transitions of each place are
+ * available as contiguous ranges. A transition continues the block of its
+ * predecessor if it has exactly one input place and that place has exactly
+ * one input transition, which has no other output place, and exactly one
+ * output transition. Every other valid transition leads a block. Blocks are
+ * then grown from their leaders along those links. Loops without any split
+ * or merge have no natural leader, so the remaining transitions are picked
+ * up afterwards. Terminating transitions simply end a block with no
+ * successors.
+ */
 void graph::computeControlFlowGraph() {
+	CHP_TIME(PHASE_CONTROL_FLOW);
+	controlFlow &cfg = this->controlFlowGraph;
+	cfg.clear();
+
+	size_t nplaces = places.size();
+	size_t ntrans = transitions.size();
+
+	// Bucket the arcs by node: [offset[i], offset[i+1]) indexes into adj
+	auto bucket = [](size_t n, const auto &arcs, bool byFrom, vector<size_t> &offset, vector<int> &adj) {
+		offset.assign(n+1, 0);
+		for (const auto &a : arcs) {
+			offset[(byFrom ? a.from : a.to).index+1]++;
+		}
+		for (size_t i = 0; i < n; i++) {
+			offset[i+1] += offset[i];
+		}
+		adj.assign(arcs.size(), -1);
+		vector<size_t> fill(offset.begin(), offset.end()-1);
+		for (const auto &a : arcs) {
+			adj[fill[(byFrom ? a.from : a.to).index]++] = (byFrom ? a.to : a.from).index;
+		}
+	};
+
+	// place -> output transitions, transition -> input places
+	vector<size_t> placeOutOffset, transInOffset;
+	vector<int> placeOut, transIn;
+	bucket(nplaces, arcs[place::type], true, placeOutOffset, placeOut);
+	bucket(ntrans, arcs[place::type], false, transInOffset, transIn);
+
+	// transition -> output places, place -> input transitions
+	vector<size_t> transOutOffset, placeInOffset;
+	vector<int> transOut, placeIn;
+	bucket(ntrans, arcs[transition::type], true, transOutOffset, transOut);
+	bucket(nplaces, arcs[transition::type], false, placeInOffset, placeIn);
+
+	// The predecessor that a transition continues, or -1 if it leads a block
+	vector<int> continues(ntrans, -1);
+	for (size_t t = 0; t < ntrans; t++) {
+		if (not transitions.is_valid(t) or transInOffset[t+1] - transInOffset[t] != 1) {
+			continue;
+		}
 
-	// Find starting node & populate entry block
-	petri::iterator init_transition;
-	for (size_t transition_idx = 0; transition_idx < this->transitions.size(); transition_idx++) {
-		init_transition = petri::iterator(transition::type, transition_idx);
-		if (this->is_valid(init_transition)) {
-			break;
+		int p = transIn[transInOffset[t]];
+		if (placeInOffset[p+1] - placeInOffset[p] != 1 or placeOutOffset[p+1] - placeOutOffset[p] != 1) {
+			continue;
+		}
+
+		int prev = placeIn[placeInOffset[p]];
+		if (prev != (int)t and transOutOffset[prev+1] - transOutOffset[prev] == 1) {
+			continues[t] = prev;
 		}
 	}
 
-	if (init_transition.index == -1) {
-		cout << "DFG is empty" << endl;
-		return;
+	// The transition that continues each transition, or -1
+	vector<int> continuedBy(ntrans, -1);
+	for (size_t t = 0; t < ntrans; t++) {
+		if (continues[t] >= 0) {
+			continuedBy[continues[t]] = (int)t;
+		}
 	}
 
-	// Populate initial block
-	chp::graph::controlFlowBlock current_block(
-			0,
-			{},
-			{},
-			init_transition,
-			init_transition,
-			{init_transition});
-	this->controlFlowGraph.push_back(current_block);
-	this->transitionToBlock[0] = 0;
-
-	// Crawl transitions breadth-first to cluster into Control-Flow Graph blocks
-	petri::iterator current_it(init_transition);
-	std::set<petri::iterator> visited;
-	std::queue<petri::iterator> queue;
-	queue.push(current_it);
-
-	while (not queue.empty()) {
-		current_it = queue.front();
-		queue.pop();
-		visited.insert(current_it);
-
-		size_t current_block_uid = this->transitionToBlock[current_it.index];
-		current_block = this->controlFlowGraph[current_block_uid];
-
-		vector<petri::iterator> out_transitions;
-		for (petri::iterator out_place : this->next(current_it)) {
-			for (petri::iterator out_transition : this->next(out_place)) {
-				out_transitions.push_back(out_transition);
+	// Transitions enabled by a reset state always lead their block
+	vector<bool> entry(ntrans, false);
+	for (const state &s : reset) {
+		for (const petri::token &tok : s.tokens) {
+			for (size_t i = placeOutOffset[tok.index]; i < placeOutOffset[tok.index+1]; i++) {
+				entry[placeOut[i]] = true;
 			}
 		}
+	}
 
-		// Only leads to 1 transition: could it be in the same block?
-		size_t out_transitions_count = out_transitions.size();
-		if (out_transitions_count == 1) {
-			petri::iterator next_transition_it = out_transitions[0];
-
-			// Edge-case: returning to init entry OR joining a pre-discovered merge ahead
-			bool already_in_block = this->transitionToBlock.contains(next_transition_it.index);
-			if (already_in_block) {
-				size_t block_uid = this->transitionToBlock[next_transition_it.index];
-				this->controlFlowGraph[block_uid].ins.insert(current_block.uid);
-				this->controlFlowGraph[current_block.uid].outs.insert(block_uid);
-				continue;
-			}
+	cfg.transitionToBlock.assign(ntrans, -1);
+	auto grow = [&](size_t leader) {
+		controlFlowBlock block;
+		block.uid = cfg.blocks.size();
+		block.first = petri::iterator(transition::type, leader);
+		block.transitionsBegin = cfg.transitions.size();
+		block.join = transInOffset[leader+1] - transInOffset[leader] > 1;
+		block.entry = entry[leader];
+
+		int t = (int)leader;
+		do {
+			cfg.transitionToBlock[t] = (int)block.uid;
+			cfg.transitions.push_back(petri::iterator(transition::type, t));
+			block.last = cfg.transitions.back();
+			t = continuedBy[t];
+		} while (t >= 0 and cfg.transitionToBlock[t] < 0 and not entry[t]);
+
+		block.transitionsEnd = cfg.transitions.size();
+		block.fork = transOutOffset[block.last.index+1] - transOutOffset[block.last.index] > 1;
+		cfg.blocks.push_back(block);
+	};
+
+	for (size_t t = 0; t < ntrans; t++) {
+		if (transitions.is_valid(t) and (entry[t] or continues[t] < 0)) {
+			grow(t);
+		}
+	}
+	for (size_t t = 0; t < ntrans; t++) {
+		if (transitions.is_valid(t) and cfg.transitionToBlock[t] < 0) {
+			grow(t);
+		}
+	}
 
-			// Edge-case: discovering a new merge ahead
-			// There might be a merge at the next transition OR even the place on the way!
-			// Pure, self-contained cases where (ONLY 1 transition -> many local-only places -> 1 transition) aren't a concern
-			set<petri::iterator> neighbor_transitions_merging_ahead;
-			for (petri::iterator place_to_next_transition : this->prev(next_transition_it)) {
-				for (petri::iterator neighbor_transition : this->prev(place_to_next_transition)) {
-					neighbor_transitions_merging_ahead.insert(neighbor_transition);
+	// Successor edges, deduplicated per block
+	vector<size_t> inCount(cfg.blocks.size()+1, 0);
+	for (controlFlowBlock &block : cfg.blocks) {
+		block.outsBegin = cfg.outs.size();
+		size_t last = block.last.index;
+		for (size_t i = transOutOffset[last]; i < transOutOffset[last+1]; i++) {
+			int p = transOut[i];
+			for (size_t j = placeOutOffset[p]; j < placeOutOffset[p+1]; j++) {
+				int b = cfg.transitionToBlock[placeOut[j]];
+				if (b >= 0) {
+					cfg.outs.push_back((size_t)b);
 				}
 			}
-
-			size_t next_transition_in_count = neighbor_transitions_merging_ahead.size();
-			if (next_transition_in_count > 1) {
-
-				// Create new block
-				size_t new_block_uid = this->controlFlowGraph.size();
-				chp::graph::controlFlowBlock new_block(
-						new_block_uid,
-						{current_block.uid},
-						{},
-						next_transition_it,
-						next_transition_it,
-						{next_transition_it});
-				this->controlFlowGraph.push_back(new_block);
-				this->transitionToBlock[next_transition_it.index] = new_block_uid;
-				this->controlFlowGraph[current_block.uid].outs.insert(new_block_uid);
-
-				queue.push(next_transition_it);
-				continue;
-			}
-
-			// Default-case (sequence): Append to current block
-			this->controlFlowGraph[current_block_uid].last = next_transition_it;
-			this->controlFlowGraph[current_block_uid].transitions.push_back(next_transition_it);
-			this->transitionToBlock[next_transition_it.index] = current_block.uid;
-			queue.push(next_transition_it);
-			continue;
-
-		// We assume ALWAYS non-terminating process (i.e. no dead-ends)
-		} else if (out_transitions_count == 0) {
-			cerr << "ERROR: Terminating / dead-end Transition found. We assume ALWAYS non-terminating processes." << endl;
-			return;
 		}
+		auto begin = cfg.outs.begin() + block.outsBegin;
+		sort(begin, cfg.outs.end());
+		cfg.outs.erase(unique(begin, cfg.outs.end()), cfg.outs.end());
+		block.outsEnd = cfg.outs.size();
 
-		// Wrap up the current block & initiate new ones
-		for (petri::iterator &next_transition_it : out_transitions) {
-
-			// Has this already been documented? If so, ensure our block connects to theirs
-			bool already_in_block = this->transitionToBlock.contains(next_transition_it.index);
-			if (already_in_block) {
-				size_t block_uid = this->transitionToBlock[next_transition_it.index];
-				this->controlFlowGraph[block_uid].ins.insert(current_block.uid);
-				this->controlFlowGraph[current_block.uid].outs.insert(block_uid);
-				continue;
-			}
+		for (size_t i = block.outsBegin; i < block.outsEnd; i++) {
+			inCount[cfg.outs[i]+1]++;
+		}
+	}
 
-			// Create new block
-			size_t new_block_uid = this->controlFlowGraph.size();
-			chp::graph::controlFlowBlock new_block(
-					new_block_uid,
-					{current_block.uid},
-					{},
-					next_transition_it,
-					next_transition_it,
-					{next_transition_it});
-			this->controlFlowGraph.push_back(new_block);
-			this->transitionToBlock[next_transition_it.index] = new_block_uid;
-			this->controlFlowGraph[current_block.uid].outs.insert(new_block_uid);
-
-			if (!visited.contains(next_transition_it)) {
-				queue.push(next_transition_it);
-			}
+	// Predecessor edges are the transpose of the successor edges
+	for (size_t b = 0; b < cfg.blocks.size(); b++) {
+		inCount[b+1] += inCount[b];
+		cfg.blocks[b].insBegin = inCount[b];
+		cfg.blocks[b].insEnd = inCount[b];
+	}
+	cfg.ins.resize(cfg.outs.size());
+	for (const controlFlowBlock &block : cfg.blocks) {
+		for (size_t i = block.outsBegin; i < block.outsEnd; i++) {
+			cfg.ins[cfg.blocks[cfg.outs[i]].insEnd++] = block.uid;
 		}
 	}
 
@@ -714,12 +895,14 @@ void graph::computeControlFlowGraph() {
 }
 
 void graph::computeUseDefChains() {
+	this->useDefChains.clear();
 	for (size_t transition_idx = 0; transition_idx < this->transitions.size(); transition_idx++) {
 		petri::iterator t_it(transition::type, transition_idx);
 		if (not this->is_valid(t_it)) { continue; }
 
 		extractUseDefFromTransition(transition_idx);
 	}
+	this->useDefChainsReady = true;
 }
 
 void graph::decompose() {  //chp::graph &g) {}
@@ -832,7 +1015,153 @@ void graph::expand() {
 	// 3. Document as needed
 }
 
-void graph::flatten(bool debug) {
+/**
+ * @brief Copy a sequence of transitions and connect it to an exit place
+ *
+ * The copy is built back to front. When a hash-consing table is provided,
+ * each transition is first looked up by its structural hash and the place it
+ * exits into. A hit means that an identical tail has already been copied, so
+ * the new sequence joins it at its entry place instead of duplicating it.
+ *
+ * @param sequence The transitions to copy, in order
+ * @param exit The place that the last transition of the copy leads to
+ * @param shared The hash-consing table, or nullptr to always copy
+ * @return The place that enters the copied sequence (exit if it is empty)
+ */
+petri::iterator graph::copy_sequence(const vector<petri::iterator> &sequence, petri::iterator exit, sequenceTable *shared) {
+	petri::iterator entry = exit;
+	for (int i = (int)sequence.size()-1; i >= 0; i--) {
+		string key;
+		uint64_t hash = 0;
+		if (shared != nullptr) {
+			key = transitions[sequence[i].index].key();
+			hash = std::hash<string>()(key);
+
+			bool found = false;
+			auto bucket = shared->find(hash);
+			if (bucket != shared->end()) {
+				for (const sequenceEntry &e : bucket->second) {
+					if (e.exit == entry and e.key == key) {
+						entry = e.entry;
+						found = true;
+						break;
+					}
+				}
+			}
+			if (found) {
+				continue;
+			}
+		}
+
+		petri::iterator t = copy(sequence[i]);
+		petri::iterator p = create(place());
+		connect(t, entry);
+		connect(p, t);
+		if (shared != nullptr) {
+			(*shared)[hash].push_back(sequenceEntry{key, entry, p});
+		}
+		entry = p;
+	}
+	return entry;
+}
+
+/**
+ * @brief Merge the branches of a selection that have identical bodies
+ *
+ * Each branch out of the split place is walked along its linear chain of
+ * transitions until it returns to the split or reaches a shared merge place.
+ * Branches whose actions and exits are structurally identical are collapsed
+ * into the first one, and their guards are ORed together. Branches with
+ * logically equivalent predicates collapse to a single guard when minimized.
+ *
+ * @param split The place whose output branches are compared
+ * @return The number of branches that were removed
+ */
+int graph::merge_duplicate_branches(petri::iterator split) {
+	struct branch {
+		petri::iterator head;
+		string key;
+		vector<petri::iterator> nodes;
+	};
+
+	vector<branch> branches;
+	for (petri::iterator head : next(split)) {
+		if (prev(head).size() != 1) {
+			continue;
+		}
+
+		ostringstream os;
+		os << transitions[head.index].action;
+
+		branch b;
+		b.head = head;
+		b.key = os.str();
+		b.nodes.push_back(head);
+
+		bool linear = true;
+		petri::iterator curr = head;
+		while (linear) {
+			vector<petri::iterator> n = next(curr);
+			if (n.size() != 1) {
+				linear = false;
+				break;
+			}
+
+			// Stop at the split or at a tail that is shared with another branch
+			if (n[0] == split or prev(n[0]).size() > 1) {
+				b.key += "|P" + ::to_string(n[0].index);
+				break;
+			}
+
+			vector<petri::iterator> t = next(n[0]);
+			if (t.size() != 1) {
+				linear = false;
+				break;
+			}
+
+			b.nodes.push_back(n[0]);
+			b.nodes.push_back(t[0]);
+			b.key += "|" + transitions[t[0].index].key();
+			curr = t[0];
+		}
+
+		if (linear) {
+			branches.push_back(b);
+		}
+	}
+
+	int removed = 0;
+	std::unordered_map<uint64_t, vector<int> > groups;
+	for (int i = 0; i < (int)branches.size(); i++) {
+		vector<int> &group = groups[std::hash<string>()(branches[i].key)];
+
+		bool merged = false;
+		for (int j = 0; j < (int)group.size() and not merged; j++) {
+			branch &keep = branches[group[j]];
+			if (keep.key != branches[i].key) {
+				continue;
+			}
+
+			transitions[keep.head.index].guard = transitions[keep.head.index].guard | transitions[branches[i].head.index].guard;
+			transitions[keep.head.index].guard.minimize();
+			for (int k = (int)branches[i].nodes.size()-1; k >= 0; k--) {
+				erase(branches[i].nodes[k]);
+			}
+			merged = true;
+			removed++;
+		}
+
+		if (not merged) {
+			group.push_back(i);
+		}
+	}
+
+	return removed;
+}
+
+void graph::flatten(bool debug, bool share) {
+	CHP_TIME(PHASE_FLATTEN);
+	mark_modified();
 	if (debug) { cout << "¿Yµ wWµøT? " << this->name << endl; }
 
 	if (!this->split_groups_ready) {
@@ -969,6 +1298,10 @@ void graph::flatten(bool debug) {
 	if (debug) { cout << endl << "][][][][  DOM> " << most_dominant_split_place << endl << endl; }
 	petri::iterator dominator(place::type, most_dominant_split_place);
 
+	// Structurally identical tails of the flattened branches, keyed on the
+	// hash of their guard and action. Only used if share is set.
+	sequenceTable shared;
+
 	//TODO: each of these big comments could be a helper
 	// From "dominator" split, iteratively merge child splits by depth
 	//TODO: durr, you gotta start bottom-up
@@ -1023,7 +1356,7 @@ void graph::flatten(bool debug) {
 								this->erase_arc(parent_in_arc);
 							}
 
-							// Create graph copies of desired sequences
+							// Create graph copies of desired sequences, sharing identical tails
 							//TODO: but that'll over-sequentialize tiny sub-parallelism within branch ( but we'll reconstruct it when we analyze it anyways)
 							//TODO: can we copy a region or bound?
 							petri::iterator new_head = this->create(transition::type);
@@ -1031,17 +1364,11 @@ void graph::flatten(bool debug) {
 							new_transition->guard = merged_predicate;
 							this->connect(dominator, new_head);
 
-							vector<petri::iterator> new_sequence = this->copy(child_sequence);
-							this->connect(new_sequence);
-							if (debug) {
-								cout << "NEW> ";
-								std::copy(new_sequence.begin(), new_sequence.end(), std::ostream_iterator<petri::iterator>(cout, " "));
-								cout << endl << endl;
-							}
+							petri::iterator entry = this->copy_sequence(child_sequence, dominator, share ? &shared : nullptr);
+							if (debug) { cout << "NEW> " << entry << endl << endl; }
 
 							// Attach new sequence/branch where parent used to be
-							this->connect(new_head, new_sequence.front());
-							this->connect(new_sequence.back(), dominator);
+							this->connect(new_head, entry);
 						}
 						continue; // don't proceed to full-parent search if parent_sequence.empty()! Find a better way to merge these 2 cases
 					}
@@ -1070,7 +1397,6 @@ void graph::flatten(bool debug) {
 							if (debug) { cout << "M_predicate> " << merged_predicate.to_string() << endl; }
 							//merged_predicate.minimize(); //TODO: !!! What petri::graph vars/etc need to be updated on modification (e.g. info deleted & added)
 																					 //TODO: petri/tests/graph.cpp::flatten
-																					 //TODO: merge branches with logically-equivalent predicates
 
 																					 // Concatenate the transition sequences
 																					 //TODO: be mindful of what labels/etc are duplicated/copied or referenced
@@ -1089,7 +1415,7 @@ void graph::flatten(bool debug) {
 								this->erase_arc(parent_in_arc); //TODO: NONONO MODIFIYING THE LIST YOU'RE ITERATING OVER
 							}
 
-							// Create graph copies of desired sequences
+							// Create graph copies of desired sequences, sharing identical tails
 							//TODO: but that'll over-sequentialize tiny sub-parallelism within branch ( but we'll reconstruct it when we analyze it anyways)
 							//TODO: can we copy a region or bound?
 							petri::iterator new_head = this->create(transition::type);
@@ -1097,18 +1423,12 @@ void graph::flatten(bool debug) {
 							new_transition->guard = merged_predicate;
 							this->connect(dominator, new_head);
 
-							vector<petri::iterator> new_sequence = this->copy(merged_sequence);
-							this->connect(new_sequence);
-							if (debug) {
-								cout << "NEW> ";
-								std::copy(new_sequence.begin(), new_sequence.end(), std::ostream_iterator<petri::iterator>(cout, " "));
-								cout << endl << endl;
-							}
+							//TODO: only connect if monopartite projection terminates or include dominator
+							petri::iterator entry = this->copy_sequence(merged_sequence, dominator, share ? &shared : nullptr);
+							if (debug) { cout << "NEW> " << entry << endl << endl; }
 
 							// Attach new sequence/branch where parent used to be
-							this->connect(new_head, new_sequence.front());
-							//TODO: only connect if monopartite projection terminates or include dominator
-							this->connect(new_sequence.back(), dominator);
+							this->connect(new_head, entry);
 						}
 
 						break;
@@ -1178,8 +1498,15 @@ void graph::flatten(bool debug) {
 	}
 	if (debug) { cout << endl; }
 
+	// Collapse branches whose bodies turned out identical after flattening.
+	// Like the shared tails, this changes the shape of the output, so it's
+	// only done when sharing was asked for.
+	if (share) {
+		int merged_branches = this->merge_duplicate_branches(dominator);
+		if (debug) { cout << "merged " << merged_branches << " duplicate branches" << endl; }
+	}
+
 	// Recompute split groups after flattening
-	//this->mark_modified();
 	this->post_process(true, false);
 	this->split_groups_ready = false;
 	this->compute_split_groups();
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <span>
+
 #include <common/standard.h>
 #include <common/net.h>
 #include <arithmetic/action.h>
@@ -100,6 +102,10 @@ struct transition : petri::transition
 
 	bool is_infeasible();
 	bool is_vacuous();
+
+	// Canonical text of the guard and action. Two transitions with the same
+	// key are structurally identical, which lets flatten() hash-cons them.
+	string key() const;
 };
 
 ostream &operator<<(ostream &os, const transition &t);
@@ -148,36 +154,90 @@ struct graph : petri::graph<chp::place, chp::transition, petri::token, chp::stat
 	using super::merge;
 	Mapping<petri::iterator> merge(graph g);
 
+	// Renumber places and transitions densely, dropping the slots left
+	// behind by erase(). Returns the mapping from old to new iterators.
+	Mapping<petri::iterator> compact();
+
+	void mark_modified();
 	void post_process(bool proper_nesting=false, bool aggressive=false);
 	void decompose();
 	void expand();
-	void flatten(bool debug=false);
+
+	// Hash-consing table for copy_sequence(). A copied transition is keyed on
+	// its structural hash and the place it exits into, and maps to the place
+	// that enters it. Two sequences with identical tails therefore resolve to
+	// the same entry place and share every node from that point on.
+	struct sequenceEntry {
+		string key;
+		petri::iterator exit;
+		petri::iterator entry;
+	};
+	typedef std::unordered_map<uint64_t, vector<sequenceEntry> > sequenceTable;
+
+	petri::iterator copy_sequence(const vector<petri::iterator> &sequence, petri::iterator exit, sequenceTable *shared=nullptr);
+	int merge_duplicate_branches(petri::iterator split);
+
+	// With share set, identical tails are copied once and branches whose
+	// bodies are identical are merged. Otherwise every branch is copied.
+	void flatten(bool debug=false, bool share=false);
 	bool isFlat() const;  //TODO: cache in property for quick look-up
 	arithmetic::Expression exclusion(int index) const;
 
+	// Reaching definitions and liveness over these chains are computed by
+	// chp::dataflow (see dataflow.h).
 	struct useDefChain {
 		string name;
 		vector<size_t> defs;
 		vector<size_t> uses;
-		//TODO: reaching defs / is_killed
 	};
 
+	// A basic block is a maximal chain of transitions in which each
+	// transition is the only successor of the one before it through a place
+	// that is neither a split nor a merge. Blocks start at choice or
+	// parallel merges, at transitions enabled by a reset state, and after
+	// choice or parallel splits.
 	struct controlFlowBlock {
 		size_t uid;
-		set<size_t> ins;
-		set<size_t> outs;
 		petri::iterator first;
 		petri::iterator last;
+
+		// [begin, end) ranges into controlFlow::{transitions, ins, outs}
+		size_t transitionsBegin, transitionsEnd;
+		size_t insBegin, insEnd;
+		size_t outsBegin, outsEnd;
+
+		// join: the first transition waits on more than one place
+		// fork: the last transition marks more than one place
+		// entry: the first transition is enabled by a reset state
+		bool join;
+		bool fork;
+		bool entry;
+	};
+
+	// Blocks, their transitions and their edges are each stored in one
+	// contiguous array and reference each other by index.
+	struct controlFlow {
+		vector<controlFlowBlock> blocks;
 		vector<petri::iterator> transitions;
-		//vector<size_t> pre_defs;
-		//vector<size_t> post_defs;
-		//UseDefChain usedef;
+		vector<size_t> ins;
+		vector<size_t> outs;
+
+		// The block of each transition, indexed by transition, or -1 if the
+		// transition is invalid.
+		vector<int> transitionToBlock;
+
+		size_t size() const;
+		void clear();
+
+		const controlFlowBlock &operator[](size_t block) const;
+		std::span<const petri::iterator> transitionsOf(size_t block) const;
+		std::span<const size_t> insOf(size_t block) const;
+		std::span<const size_t> outsOf(size_t block) const;
 	};
 
-	//TODO: size_t vs petri::iterator?
+	bool useDefChainsReady = false;
 	std::unordered_map<size_t, useDefChain> useDefChains;
-	std::unordered_map<size_t, size_t> transitionToBlock;
-	std::vector<controlFlowBlock> controlFlowGraph;
+	controlFlow controlFlowGraph;
 
 	void setUseDef(size_t var_idx, size_t transition_idx, bool is_definition=false);
 	void computeUseDefChains();
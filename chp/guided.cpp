@@ -0,0 +1,162 @@
+#include "guided.h"
+
+namespace chp
+{
+
+guided::guided(graph *base, state initial, uint64_t seed) : sim(base, initial), random(seed) {
+	maxFrontier = 64;
+	patience = 1000;
+	steps = 0;
+	stale = 0;
+	restarts = 0;
+	cov.attach(sim);
+	total = base != NULL ? cov.points(*base) : 0;
+	baseline = base != NULL ? cov.covered(*base) : 0;
+}
+
+guided::~guided() {
+}
+
+int guided::covered() const {
+	return baseline + cov.hits;
+}
+
+bool guided::saturated() const {
+	return covered() >= total;
+}
+
+/**
+ * @brief Pick one of the ready transitions, weighted toward low coverage
+ *
+ * This must be called right after simulator::enabled(), while the coverage
+ * collector still has the cause chains of the ready transitions. The weight
+ * of each choice is left in weights, and is 1 for choices that would hit
+ * something that has never been hit.
+ */
+int guided::choose() {
+	const vector<pair<int, int> > &ready = sim.ready;
+	weights.resize(ready.size());
+	double sum = 0.0;
+	for (int r = 0; r < (int)ready.size(); r++) {
+		int i = ready[r].first;
+		int x = sim.loaded[i].index;
+		int term = x+1 < (int)cov.termOffset.size() ? cov.termOffset[x] + ready[r].second : -1;
+		uint64_t least = (term >= 0 and term < cov.termOffset[x+1]) ? cov.firings[term] : 0;
+
+		// The vacuous transitions in the chain are taken along with it
+		if (i+1 < (int)cov.causeBegin.size()) {
+			seen.resize(cov.loadedIndex.size());
+			seen.clear();
+			stack.assign(1, i);
+			while (not stack.empty() and least > 0) {
+				int y = stack.back();
+				stack.pop_back();
+				for (int k = cov.causeBegin[y]; k < cov.causeBegin[y+1]; k++) {
+					int c = cov.causeList[k];
+					if (c < i and not seen.test(c)) {
+						seen.set(c);
+						stack.push_back(c);
+						int index = cov.loadedIndex[c];
+						if (index < (int)cov.taken.size()) {
+							least = std::min(least, cov.taken[index]);
+						}
+					}
+				}
+			}
+		}
+
+		weights[r] = 1.0/(1.0 + (double)least);
+		sum += weights[r];
+	}
+
+	double pick = std::uniform_real_distribution<double>(0.0, sum)(random);
+	for (int r = 0; r < (int)weights.size(); r++) {
+		pick -= weights[r];
+		if (pick < 0.0) {
+			return r;
+		}
+	}
+	return (int)weights.size()-1;
+}
+
+/**
+ * @brief Go back to the most recent state that left a choice uncovered
+ *
+ * Returns false if the frontier is empty.
+ */
+bool guided::restart() {
+	if (frontier.empty()) {
+		return false;
+	}
+
+	sim.restore(frontier.back());
+	frontier.pop_back();
+	restarts++;
+	stale = 0;
+	return true;
+}
+
+/**
+ * @brief Fire one transition
+ *
+ * Returns false when the simulation deadlocked and there is nothing left on
+ * the frontier to go back to.
+ */
+bool guided::step() {
+	int n = sim.enabled();
+	while (n == 0) {
+		if (not restart()) {
+			return false;
+		}
+		n = sim.enabled();
+	}
+
+	int choice = choose();
+
+	// Remember this state if the choice leaves something uncovered behind
+	bool left = false;
+	for (int r = 0; r < (int)weights.size() and not left; r++) {
+		left = r != choice and weights[r] == 1.0;
+	}
+	if (left) {
+		frontier.push_back(sim.snapshot());
+		if (frontier.size() > maxFrontier) {
+			frontier.pop_front();
+		}
+	}
+
+	int before = cov.hits;
+	sim.fire(choice);
+	steps++;
+
+	if (cov.hits != before) {
+		stale = 0;
+		curve.push_back(pair<uint64_t, int>(steps, covered()));
+	} else if (++stale >= patience) {
+		restart();
+	}
+	return true;
+}
+
+/**
+ * @brief Simulate until coverage saturates or the budget runs out
+ *
+ * Returns the total number of steps taken so far.
+ */
+uint64_t guided::run(uint64_t budget) {
+	while (steps < budget and not saturated() and step());
+	return steps;
+}
+
+void guided::report(ostream &os) const {
+	os << "steps covered" << endl;
+	for (const pair<uint64_t, int> &point : curve) {
+		os << point.first << " " << point.second << endl;
+	}
+	os << steps << " steps, " << restarts << " restarts, covered " << covered() << " of " << total << " points" << endl;
+	if (sim.base != NULL) {
+		cov.report(os, *sim.base);
+	}
+}
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <deque>
+#include <random>
+
+#include <common/standard.h>
+
+#include "coverage.h"
+#include "simulator.h"
+
+namespace chp
+{
+
+// Coverage-guided random simulation
+//
+// Picking uniformly among the ready transitions almost never takes the rare
+// branches of wide selections and arbiters. Instead, each ready choice is
+// weighted by 1/(1+n) where n is the least number of times the term that
+// would fire, or any vacuous transition in its chain, has been hit so far.
+// Choices that have never been hit are strongly preferred.
+//
+// When a step leaves an uncovered choice behind, the state before the step
+// is kept as a snapshot on the frontier. Once 'patience' steps go by without
+// covering anything new, or the simulation deadlocks, the most recent
+// frontier snapshot is restored so that the choice it left behind can be
+// taken. The run stops when every coverage point is covered, when the
+// budget runs out, or when there is nowhere left to go.
+//
+// The coverage collector is an observer of the simulator, so this isn't
+// copyable.
+struct guided
+{
+	guided(graph *base, state initial, uint64_t seed=0);
+	guided(const guided &g) = delete;
+	~guided();
+
+	guided &operator=(const guided &g) = delete;
+
+	simulator sim;
+	coverage cov;
+	std::mt19937_64 random;
+
+	std::deque<chp::snapshot> frontier;
+	size_t maxFrontier;
+	uint64_t patience;
+
+	// stale counts the steps since something new was last covered.
+	uint64_t steps;
+	uint64_t stale;
+	int restarts;
+
+	// The number of coverage points in the graph, and the number that were
+	// already covered when the run started.
+	int total;
+	int baseline;
+
+	// The number of covered points after each step that covered something
+	// new, as (steps, covered) pairs.
+	vector<pair<uint64_t, int> > curve;
+
+	// Scratch space for choose()
+	vector<double> weights;
+	vector<int> stack;
+	bitvector seen;
+
+	int covered() const;
+	bool saturated() const;
+
+	int choose();
+	bool restart();
+	bool step();
+	uint64_t run(uint64_t budget);
+
+	void report(ostream &os) const;
+};
+
+}
@@ -0,0 +1,170 @@
+#include "instrument.h"
+
+#include <atomic>
+#include <iomanip>
+#include <mutex>
+
+namespace chp
+{
+
+const char *instrumentCounterNames[COUNTER_COUNT] = {
+	"preload_iterations",
+	"guards_evaluated",
+	"minimize_calls",
+	"history_length",
+	"interference_checks"
+};
+
+const char *instrumentPhaseNames[PHASE_COUNT] = {
+	"enabled",
+	"fire",
+	"post_process",
+	"flatten",
+	"computeControlFlowGraph",
+	"synthesizeFuncFromCHP"
+};
+
+// Every live thread's block, and the totals of the threads that exited.
+struct instrumentRegistry {
+	std::mutex lock;
+	vector<instrumentBlock*> blocks;
+	instrumentBlock retired;
+	int threads = 0;
+	std::atomic<bool> tracing{false};
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
+static instrumentRegistry &registry() {
+	static instrumentRegistry r;
+	return r;
+}
+
+instrumentBlock::instrumentBlock() {
+	thread = -1;
+	clear();
+}
+
+instrumentBlock::~instrumentBlock() {
+}
+
+void instrumentBlock::clear() {
+	std::fill(counts, counts+COUNTER_COUNT, 0);
+	std::fill(calls, calls+PHASE_COUNT, 0);
+	std::fill(nanoseconds, nanoseconds+PHASE_COUNT, 0);
+	events.clear();
+}
+
+void instrumentBlock::add(const instrumentBlock &b) {
+	for (int i = 0; i < COUNTER_COUNT; i++) {
+		counts[i] += b.counts[i];
+	}
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		calls[i] += b.calls[i];
+		nanoseconds[i] += b.nanoseconds[i];
+	}
+	size_t room = events.size() < maxTraceEvents ? maxTraceEvents - events.size() : 0;
+	events.insert(events.end(), b.events.begin(), b.events.begin() + std::min(room, b.events.size()));
+}
+
+// Registers the thread's block when it is first used, and folds it into the
+// retired totals when the thread exits.
+struct instrumentThread {
+	instrumentThread() {
+		instrumentRegistry &r = registry();
+		std::unique_lock<std::mutex> guard(r.lock);
+		block.thread = r.threads++;
+		r.blocks.push_back(&block);
+	}
+
+	~instrumentThread() {
+		instrumentRegistry &r = registry();
+		std::unique_lock<std::mutex> guard(r.lock);
+		r.retired.add(block);
+		r.blocks.erase(std::remove(r.blocks.begin(), r.blocks.end(), &block), r.blocks.end());
+	}
+
+	instrumentBlock block;
+};
+
+instrumentBlock &instrumentLocal() {
+	thread_local instrumentThread local;
+	return local.block;
+}
+
+uint64_t instrumentNow() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - registry().start).count();
+}
+
+scopedTimer::scopedTimer(instrumentPhase phase) {
+	this->phase = phase;
+	begin = instrumentNow();
+}
+
+scopedTimer::~scopedTimer() {
+	uint64_t duration = instrumentNow() - begin;
+	instrumentBlock &b = instrumentLocal();
+	b.calls[phase]++;
+	b.nanoseconds[phase] += duration;
+	if (registry().tracing.load(std::memory_order_relaxed) and b.events.size() < maxTraceEvents) {
+		b.events.push_back(traceEvent{b.thread, (int)phase, begin, duration});
+	}
+}
+
+void instrumentTrace(bool enable) {
+	registry().tracing.store(enable, std::memory_order_relaxed);
+}
+
+void instrumentReset() {
+	instrumentRegistry &r = registry();
+	std::unique_lock<std::mutex> guard(r.lock);
+	for (instrumentBlock *b : r.blocks) {
+		b->clear();
+	}
+	r.retired.clear();
+}
+
+instrumentBlock instrumentTotals() {
+	instrumentRegistry &r = registry();
+	std::unique_lock<std::mutex> guard(r.lock);
+	instrumentBlock result;
+	result.add(r.retired);
+	for (instrumentBlock *b : r.blocks) {
+		result.add(*b);
+	}
+	return result;
+}
+
+void writeInstrumentJSON(ostream &os) {
+	instrumentBlock totals = instrumentTotals();
+	os << "{\"counters\": {";
+	for (int i = 0; i < COUNTER_COUNT; i++) {
+		os << (i == 0 ? "" : ", ") << "\"" << instrumentCounterNames[i] << "\": " << totals.counts[i];
+	}
+	os << "}, \"phases\": {";
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		os << (i == 0 ? "" : ", ") << "\"" << instrumentPhaseNames[i] << "\": {\"calls\": " << totals.calls[i] << ", \"ns\": " << totals.nanoseconds[i] << "}";
+	}
+	os << "}}" << endl;
+}
+
+/**
+ * @brief Write the traced scopes as Chrome trace events
+ *
+ * Each scope is a complete ("X") event. Times are in microseconds, as the
+ * format requires, with the nanoseconds kept as a fraction.
+ */
+void writeInstrumentTrace(ostream &os) {
+	instrumentBlock totals = instrumentTotals();
+	os << "{\"traceEvents\": [";
+	for (size_t i = 0; i < totals.events.size(); i++) {
+		const traceEvent &e = totals.events[i];
+		os << (i == 0 ? "\n" : ",\n");
+		os << "{\"name\": \"" << instrumentPhaseNames[e.phase] << "\", \"cat\": \"chp\", \"ph\": \"X\", "
+		   << "\"ts\": " << e.begin/1000 << "." << std::setw(3) << std::setfill('0') << e.begin%1000 << ", "
+		   << "\"dur\": " << e.duration/1000 << "." << std::setw(3) << std::setfill('0') << e.duration%1000 << ", "
+		   << "\"pid\": 0, \"tid\": " << e.thread << "}" << std::setfill(' ');
+	}
+	os << "\n]}" << endl;
+}
+
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+
+#include <common/standard.h>
+
+namespace chp
+{
+
+// Hot-path instrumentation
+//
+// The simulator and the graph passes are annotated with CHP_COUNT and
+// CHP_TIME. Unless the library is built with CHP_INSTRUMENT defined (make
+// INSTRUMENT=1), both expand to nothing and cost nothing.
+//
+// Counters and phase timers are plain integers in a thread-local block, so
+// counting is an add and timing is two clock reads. Every thread registers
+// its block, and a thread's totals are kept when it exits. The exports add
+// up every block, so they should be called while the instrumented threads
+// are idle. When tracing is turned on, every timed scope also appends an
+// event to its thread's block, up to maxTraceEvents per thread, and those
+// are exported in the Chrome trace event format for chrome://tracing or
+// Perfetto.
+
+enum instrumentCounter {
+	PRELOAD_ITERATIONS = 0,
+	GUARDS_EVALUATED,
+	MINIMIZE_CALLS,
+	HISTORY_LENGTH,
+	INTERFERENCE_CHECKS,
+	COUNTER_COUNT
+};
+
+enum instrumentPhase {
+	PHASE_ENABLED = 0,
+	PHASE_FIRE,
+	PHASE_POST_PROCESS,
+	PHASE_FLATTEN,
+	PHASE_CONTROL_FLOW,
+	PHASE_SYNTHESIZE,
+	PHASE_COUNT
+};
+
+extern const char *instrumentCounterNames[COUNTER_COUNT];
+extern const char *instrumentPhaseNames[PHASE_COUNT];
+
+const size_t maxTraceEvents = 1 << 20;
+
+struct traceEvent {
+	int thread;
+	int phase;
+	uint64_t begin;
+	uint64_t duration;
+};
+
+struct instrumentBlock {
+	instrumentBlock();
+	~instrumentBlock();
+
+	int thread;
+	uint64_t counts[COUNTER_COUNT];
+	uint64_t calls[PHASE_COUNT];
+	uint64_t nanoseconds[PHASE_COUNT];
+	vector<traceEvent> events;
+
+	void clear();
+	void add(const instrumentBlock &b);
+};
+
+// The block of the calling thread
+instrumentBlock &instrumentLocal();
+
+// Nanoseconds since the instrumentation was first used
+uint64_t instrumentNow();
+
+// Times the scope it's declared in
+struct scopedTimer {
+	scopedTimer(instrumentPhase phase);
+	~scopedTimer();
+
+	instrumentPhase phase;
+	uint64_t begin;
+};
+
+void instrumentTrace(bool enable);
+void instrumentReset();
+
+// The totals over all threads
+instrumentBlock instrumentTotals();
+
+// {"counters": {name: count}, "phases": {name: {"calls": n, "ns": n}}}
+void writeInstrumentJSON(ostream &os);
+
+// {"traceEvents": [...]} with one complete event per timed scope
+void writeInstrumentTrace(ostream &os);
+
+}
+
+#define CHP_CONCAT_(a, b) a##b
+#define CHP_CONCAT(a, b) CHP_CONCAT_(a, b)
+
+#ifdef CHP_INSTRUMENT
+#define CHP_COUNT(counter, n) (chp::instrumentLocal().counts[chp::counter] += (uint64_t)(n))
+#define CHP_TIME(phase) chp::scopedTimer CHP_CONCAT(chp_timer_, __LINE__)(chp::phase)
+#else
+#define CHP_COUNT(counter, n) ((void)0)
+#define CHP_TIME(phase) ((void)0)
+#endif
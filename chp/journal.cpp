@@ -0,0 +1,235 @@
+#include "journal.h"
+
+namespace chp
+{
+
+edit::edit() {
+	type = CREATE;
+}
+
+edit::edit(int type, petri::iterator node) {
+	this->type = type;
+	this->node = node;
+}
+
+edit::edit(int type, petri::iterator from, petri::iterator to) {
+	this->type = type;
+	this->from = from;
+	this->to = to;
+}
+
+edit::~edit() {
+}
+
+journal::journal() {
+	base = nullptr;
+}
+
+journal::journal(graph *base) {
+	this->base = base;
+}
+
+journal::~journal() {
+}
+
+/**
+ * @brief Open a new checkpoint
+ *
+ * @return The position in the journal that rollback() returns to.
+ */
+size_t journal::checkpoint() {
+	marks.push_back(edits.size());
+	covered.push_back(false);
+	return marks.back();
+}
+
+/**
+ * @brief Undo every edit made since the innermost checkpoint and close it
+ *
+ * The cached analyses of the graph are invalidated since they may refer to
+ * nodes that no longer exist.
+ */
+void journal::rollback() {
+	if (marks.empty()) {
+		return;
+	}
+
+	size_t mark = marks.back();
+	marks.pop_back();
+	covered.pop_back();
+	while (edits.size() > mark) {
+		undo(edits.back());
+		edits.pop_back();
+	}
+
+	base->mark_modified();
+	base->split_groups_ready = false;
+}
+
+/**
+ * @brief Keep every edit made since the innermost checkpoint and close it
+ *
+ * The edits stay in the journal as long as an outer checkpoint is open so
+ * that the outer checkpoint can still roll them back.
+ */
+void journal::commit() {
+	if (marks.empty()) {
+		return;
+	}
+
+	// The snapshot stays in the journal, so it covers the outer checkpoint
+	// too.
+	bool snapshotted = covered.back();
+	marks.pop_back();
+	covered.pop_back();
+	if (marks.empty()) {
+		edits.clear();
+	} else if (snapshotted) {
+		covered.back() = true;
+	}
+}
+
+/**
+ * @brief Whether an edit made now needs to be recorded
+ *
+ * Nothing needs to be recorded outside of a checkpoint, or if a snapshot
+ * already covers the innermost checkpoint.
+ */
+bool journal::recording() const {
+	return not marks.empty() and not covered.back();
+}
+
+petri::iterator journal::create(chp::place p) {
+	petri::iterator result = base->create(p);
+	base->mark_modified();
+	if (recording()) {
+		edits.push_back(edit(edit::CREATE, result));
+	}
+	return result;
+}
+
+petri::iterator journal::create(chp::transition t) {
+	petri::iterator result = base->create(t);
+	base->mark_modified();
+	if (recording()) {
+		edits.push_back(edit(edit::CREATE, result));
+	}
+	return result;
+}
+
+int journal::create(variable v) {
+	int result = base->create(v);
+	base->mark_modified();
+	if (recording()) {
+		edits.push_back(edit(edit::VARIABLE, petri::iterator(-1, result)));
+	}
+	return result;
+}
+
+/**
+ * @brief Add an arc from one node to another
+ *
+ * Like petri::graph::connect(), connecting two nodes of the same type
+ * inserts a node of the other type between them. That node is created
+ * through the journal so that it is removed on rollback.
+ */
+void journal::connect(petri::iterator from, petri::iterator to) {
+	if (from.type == to.type) {
+		petri::iterator mid;
+		if (from.type == place::type) {
+			mid = create(chp::transition());
+		} else {
+			mid = create(chp::place());
+		}
+		connect(from, mid);
+		connect(mid, to);
+		return;
+	}
+
+	base->connect(from, to);
+	base->mark_modified();
+	if (recording()) {
+		edits.push_back(edit(edit::CONNECT, from, to));
+	}
+}
+
+void journal::erase_arc(petri::iterator arc) {
+	petri::arc a = base->arcs[arc.type][arc.index];
+	base->erase_arc(arc);
+	base->mark_modified();
+	if (recording()) {
+		edits.push_back(edit(edit::DISCONNECT, a.from, a.to));
+	}
+}
+
+void journal::setGuard(petri::iterator t, arithmetic::Expression guard) {
+	if (recording()) {
+		edits.push_back(edit(edit::GUARD, t));
+		edits.back().guard = base->transitions[t.index].guard;
+	}
+	base->transitions[t.index].guard = guard;
+	base->mark_modified();
+}
+
+void journal::setAction(petri::iterator t, arithmetic::Choice action) {
+	if (recording()) {
+		edits.push_back(edit(edit::ACTION, t));
+		edits.back().action = base->transitions[t.index].action;
+	}
+	base->transitions[t.index].action = action;
+	base->mark_modified();
+}
+
+/**
+ * @brief Save the whole graph before a pass that edits it directly
+ *
+ * This is the fallback for bulk passes like flatten() and post_process()
+ * that rewrite the graph through petri::graph, so it still costs a copy of
+ * the places, transitions, arcs and reset states. The cached analyses are
+ * recomputed after a rollback anyway, so they are moved aside instead of
+ * copied. Only one snapshot is taken per checkpoint.
+ */
+void journal::snapshot() {
+	if (recording()) {
+		graph::controlFlow cfg = std::move(base->controlFlowGraph);
+		std::unordered_map<size_t, graph::useDefChain> chains = std::move(base->useDefChains);
+
+		edits.push_back(edit(edit::SNAPSHOT, petri::iterator()));
+		edits.back().saved = std::make_shared<graph>(*base);
+		edits.back().saved->mark_modified();
+		covered.back() = true;
+
+		base->controlFlowGraph = std::move(cfg);
+		base->useDefChains = std::move(chains);
+	}
+}
+
+void journal::undo(edit &e) {
+	if (e.type == edit::CREATE) {
+		base->erase(e.node);
+	} else if (e.type == edit::CONNECT) {
+		// Arcs may have shifted since they were added, so search for it
+		vector<petri::arc> &arcs = base->arcs[e.from.type];
+		for (int i = (int)arcs.size()-1; i >= 0; i--) {
+			if (arcs[i].from == e.from and arcs[i].to == e.to) {
+				base->erase_arc(petri::iterator(e.from.type, i));
+				break;
+			}
+		}
+	} else if (e.type == edit::DISCONNECT) {
+		base->connect(e.from, e.to);
+	} else if (e.type == edit::GUARD) {
+		base->transitions[e.node.index].guard = e.guard;
+	} else if (e.type == edit::ACTION) {
+		base->transitions[e.node.index].action = e.action;
+	} else if (e.type == edit::VARIABLE) {
+		base->vars.pop_back();
+	} else if (e.type == edit::SNAPSHOT) {
+		// The edit is dropped after it is undone, so the saved graph can be
+		// moved back rather than copied
+		*base = std::move(*e.saved);
+		e.saved.reset();
+	}
+}
+
+}
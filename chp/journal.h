@@ -0,0 +1,95 @@
+#pragma once
+
+#include <memory>
+
+#include <common/standard.h>
+#include <arithmetic/expression.h>
+#include <arithmetic/action.h>
+
+#include "graph.h"
+
+namespace chp
+{
+
+// One undoable edit to a graph. The fields that are used depend on the type.
+//   CREATE      node was created
+//   CONNECT     an arc from -> to was added
+//   DISCONNECT  an arc from -> to was removed
+//   GUARD       the guard of transition node was replaced, guard is the old one
+//   ACTION      the action of transition node was replaced, action is the old one
+//   VARIABLE    a variable was appended to graph::vars
+//   SNAPSHOT    the whole graph was saved before a pass that isn't journaled
+struct edit
+{
+	enum {
+		CREATE = 0,
+		CONNECT = 1,
+		DISCONNECT = 2,
+		GUARD = 3,
+		ACTION = 4,
+		VARIABLE = 5,
+		SNAPSHOT = 6
+	};
+
+	edit();
+	edit(int type, petri::iterator node);
+	edit(int type, petri::iterator from, petri::iterator to);
+	~edit();
+
+	int type;
+	petri::iterator node;
+	petri::iterator from;
+	petri::iterator to;
+
+	arithmetic::Expression guard;
+	arithmetic::Choice action;
+	std::shared_ptr<graph> saved;
+};
+
+// An undo log of the edits made to a graph. Design-space exploration can
+// open a checkpoint, try a transformation through the journal, and roll it
+// back if it scores badly. The cost of the rollback is proportional to the
+// number of edits rather than the size of the graph.
+//
+// Only edits made through the journal are recorded. Passes that edit the
+// graph directly, like flatten() or post_process(), must be preceded by a
+// call to snapshot(). Those passes are built on petri::graph::reduce() and
+// friends, which can't be journaled, so a snapshot still copies the
+// structure of the graph. Once a snapshot covers the innermost checkpoint,
+// further edits at that level don't need to be recorded.
+//
+// Checkpoints nest. rollback() and commit() close the innermost one.
+struct journal
+{
+	journal();
+	journal(graph *base);
+	~journal();
+
+	graph *base;
+
+	vector<edit> edits;
+
+	// The position in edits at which each open checkpoint starts, and
+	// whether a snapshot was taken since then. This is kept per checkpoint
+	// so that recording() doesn't have to search the edits.
+	vector<size_t> marks;
+	vector<bool> covered;
+
+	size_t checkpoint();
+	void rollback();
+	void commit();
+	bool recording() const;
+
+	petri::iterator create(chp::place p);
+	petri::iterator create(chp::transition t);
+	int create(variable v);
+	void connect(petri::iterator from, petri::iterator to);
+	void erase_arc(petri::iterator arc);
+	void setGuard(petri::iterator t, arithmetic::Expression guard);
+	void setAction(petri::iterator t, arithmetic::Choice action);
+	void snapshot();
+
+	void undo(edit &e);
+};
+
+}
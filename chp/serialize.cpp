@@ -0,0 +1,649 @@
+#include "serialize.h"
+
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace chp
+{
+
+const bool hostIsLittleEndian = std::endian::native == std::endian::little;
+
+uint32_t swapBytes(uint32_t x) {
+	return (x >> 24) | ((x >> 8) & 0xff00u) | ((x << 8) & 0xff0000u) | (x << 24);
+}
+
+uint64_t swapBytes(uint64_t x) {
+	return ((uint64_t)swapBytes((uint32_t)x) << 32) | swapBytes((uint32_t)(x >> 32));
+}
+
+template <typename T>
+T littleEndian(T x) {
+	return hostIsLittleEndian ? x : swapBytes(x);
+}
+
+void appendWord(string &out, uint64_t x) {
+	x = littleEndian(x);
+	out.append((const char*)&x, sizeof(x));
+}
+
+uint64_t takeWord(std::string_view &in) {
+	uint64_t x;
+	memcpy(&x, in.data(), sizeof(x));
+	in.remove_prefix(sizeof(x));
+	return littleEndian(x);
+}
+
+/**
+ * @brief Swap every 32-bit word in a buffer
+ */
+void swapWords(char *data, size_t size) {
+	for (size_t i = 0; i+4 <= size; i += 4) {
+		uint32_t x;
+		memcpy(&x, data+i, 4);
+		x = swapBytes(x);
+		memcpy(data+i, &x, 4);
+	}
+}
+
+/**
+ * @brief Swap the byte order of a serialized graph in place
+ *
+ * This converts between the little-endian file and the host order on a
+ * big-endian host, in either direction. Every record is made of 32-bit
+ * fields, so sections are swapped word by word, except STRINGS and VALUES
+ * which are byte streams. Sections of unknown kinds are left alone, and
+ * readers skip them anyway.
+ */
+bool swapSerialized(char *data, size_t size, bool toHost) {
+	if (size < sizeof(serialHeader)) {
+		return false;
+	}
+
+	serialHeader *header = (serialHeader*)data;
+	uint32_t sections = toHost ? swapBytes(header->sections) : header->sections;
+	swapWords(data, sizeof(serialHeader));
+	if (sections > (size - sizeof(serialHeader))/sizeof(serialSection)) {
+		return false;
+	}
+
+	serialSection *table = (serialSection*)(data + sizeof(serialHeader));
+	for (uint32_t i = 0; i < sections; i++) {
+		serialSection &sec = table[i];
+		if (toHost) {
+			sec.kind = swapBytes(sec.kind);
+			sec.count = swapBytes(sec.count);
+			sec.offset = swapBytes(sec.offset);
+			sec.size = swapBytes(sec.size);
+		}
+
+		if (sec.offset <= size and sec.size <= size - sec.offset and sec.kind < serialSection::COUNT
+			and sec.kind != serialSection::STRINGS and sec.kind != serialSection::VALUES) {
+			swapWords(data + sec.offset, sec.size);
+		}
+
+		if (not toHost) {
+			sec.kind = swapBytes(sec.kind);
+			sec.count = swapBytes(sec.count);
+			sec.offset = swapBytes(sec.offset);
+			sec.size = swapBytes(sec.size);
+		}
+	}
+	return true;
+}
+
+// Encoding of arithmetic::Value in the VALUES section. Values are variable
+// length because they may contain strings and arrays. Every number is
+// stored as a little-endian 64-bit word.
+void writeValue(string &out, const arithmetic::Value &value) {
+	appendWord(out, (uint64_t)(int64_t)value.type);
+	appendWord(out, (uint64_t)value.bval);
+	appendWord(out, (uint64_t)value.ival);
+	uint64_t rval;
+	memcpy(&rval, &value.rval, sizeof(rval));
+	appendWord(out, rval);
+	appendWord(out, value.sval.size());
+	out.append(value.sval);
+	appendWord(out, value.arr.size());
+	for (const arithmetic::Value &elem : value.arr) {
+		writeValue(out, elem);
+	}
+}
+
+bool readValue(std::string_view &in, arithmetic::Value &value) {
+	if (in.size() < 6*sizeof(uint64_t)) {
+		return false;
+	}
+	value.type = (int)(int64_t)takeWord(in);
+	value.bval = takeWord(in) != 0;
+	value.ival = (int64_t)takeWord(in);
+	uint64_t rval = takeWord(in);
+	memcpy(&value.rval, &rval, sizeof(rval));
+
+	uint64_t size = takeWord(in);
+	if (in.size() < size + sizeof(size)) {
+		return false;
+	}
+	value.sval = string(in.substr(0, size));
+	in.remove_prefix(size);
+
+	size = takeWord(in);
+	value.arr.clear();
+	for (uint64_t i = 0; i < size; i++) {
+		value.arr.push_back(arithmetic::Value());
+		if (not readValue(in, value.arr.back())) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Accumulates the sections of a graph before they are written out.
+struct serialWriter {
+	string strings;
+	vector<serialString> name;
+	vector<serialVar> vars;
+	vector<int32_t> remote;
+	vector<serialPlace> places;
+	vector<serialTransition> transitions;
+	vector<serialRange> terms;
+	vector<serialAction> actions;
+	vector<serialArc> arcs[2];
+	vector<serialReset> reset;
+	vector<int32_t> tokens;
+	string values;
+	vector<serialOperation> operations;
+	vector<serialOperand> operands;
+
+	serialString str(const string &s) {
+		serialString result{(uint32_t)strings.size(), (uint32_t)s.size()};
+		strings.append(s);
+		return result;
+	}
+
+	serialOperand expr(const arithmetic::Expression &e) {
+		if (e.isNull() or e.isUndef()) {
+			return serialOperand{arithmetic::Operand::UNDEF, 0, 0};
+		}
+		map<size_t, uint32_t> written;
+		return operand(e, e.top, written);
+	}
+
+	/**
+	 * @brief Write an operand, and the operations below it, in post order
+	 *
+	 * Operations shared within an expression are written once. written maps
+	 * the operation indices of e to their records.
+	 */
+	serialOperand operand(const arithmetic::Expression &e, const arithmetic::Operand &op, map<size_t, uint32_t> &written) {
+		serialOperand result{op.type, 0, 0};
+		if (op.isConst() or op.type == arithmetic::Operand::TYPE) {
+			result.index = values.size();
+			writeValue(values, op.cnst);
+			result.length = values.size() - result.index;
+		} else if (op.isVar()) {
+			result.index = op.index;
+		} else if (op.isExpr()) {
+			auto pos = written.find(op.index);
+			if (pos == written.end()) {
+				const arithmetic::Operation *operation = e.getExpr(op.index);
+				if (operation == nullptr) {
+					return serialOperand{arithmetic::Operand::UNDEF, 0, 0};
+				}
+
+				vector<serialOperand> args;
+				args.reserve(operation->operands.size());
+				for (const arithmetic::Operand &arg : operation->operands) {
+					args.push_back(operand(e, arg, written));
+				}
+
+				serialOperation record{operation->func, {(uint32_t)operands.size(), 0}};
+				operands.insert(operands.end(), args.begin(), args.end());
+				record.operands.end = operands.size();
+				pos = written.insert({op.index, (uint32_t)operations.size()}).first;
+				operations.push_back(record);
+			}
+			result.index = pos->second;
+		} else {
+			result.type = arithmetic::Operand::UNDEF;
+		}
+		return result;
+	}
+};
+
+template <typename T>
+void addSection(vector<serialSection> &table, vector<std::pair<const char*, size_t> > &data, uint32_t kind, const T *ptr, size_t count) {
+	serialSection s;
+	s.kind = kind;
+	s.count = count;
+	s.offset = 0;
+	s.size = count*sizeof(T);
+	table.push_back(s);
+	data.push_back({(const char*)ptr, s.size});
+}
+
+/**
+ * @brief Write a buffer laid out in host order as a little-endian file
+ */
+void writeLittleEndian(ostream &os, string &buffer) {
+	if (not hostIsLittleEndian) {
+		swapSerialized(buffer.data(), buffer.size(), false);
+	}
+	os.write(buffer.data(), buffer.size());
+}
+
+void write(ostream &os, const graph &g, bool name) {
+	serialWriter w;
+	if (name) {
+		w.name.push_back(w.str(g.name));
+	}
+
+	for (const variable &v : g.vars) {
+		serialVar sv;
+		sv.name = w.str(v.name);
+		sv.region = v.region;
+		sv.remote.begin = w.remote.size();
+		w.remote.insert(w.remote.end(), v.remote.begin(), v.remote.end());
+		sv.remote.end = w.remote.size();
+		w.vars.push_back(sv);
+	}
+
+	vector<int> placeMap(g.places.size(), -1);
+	for (int i = 0; i < (int)g.places.size(); i++) {
+		if (g.places.is_valid(i)) {
+			placeMap[i] = w.places.size();
+			w.places.push_back(serialPlace{g.places[i].arbiter ? 1u : 0u});
+		}
+	}
+
+	vector<int> transitionMap(g.transitions.size(), -1);
+	for (int i = 0; i < (int)g.transitions.size(); i++) {
+		if (not g.transitions.is_valid(i)) {
+			continue;
+		}
+
+		transitionMap[i] = w.transitions.size();
+		serialTransition st;
+		st.guard = w.expr(g.transitions[i].guard);
+		st.terms.begin = w.terms.size();
+		for (const arithmetic::Parallel &term : g.transitions[i].action.terms) {
+			serialRange r;
+			r.begin = w.actions.size();
+			for (const arithmetic::Action &action : term.actions) {
+				w.actions.push_back(serialAction{w.expr(action.lvalue), w.expr(action.rvalue)});
+			}
+			r.end = w.actions.size();
+			w.terms.push_back(r);
+		}
+		st.terms.end = w.terms.size();
+		w.transitions.push_back(st);
+	}
+
+	// Arcs are sorted so that their order in the graph doesn't matter
+	for (int type = 0; type < 2; type++) {
+		const vector<int> &fromMap = type == place::type ? placeMap : transitionMap;
+		const vector<int> &toMap = type == place::type ? transitionMap : placeMap;
+		for (const petri::arc &a : g.arcs[type]) {
+			if (fromMap[a.from.index] >= 0 and toMap[a.to.index] >= 0) {
+				w.arcs[type].push_back(serialArc{fromMap[a.from.index], toMap[a.to.index]});
+			}
+		}
+		sort(w.arcs[type].begin(), w.arcs[type].end(), [](const serialArc &a, const serialArc &b) {
+			return a.from < b.from or (a.from == b.from and a.to < b.to);
+		});
+	}
+
+	for (const state &s : g.reset) {
+		serialReset sr;
+		sr.tokens.begin = w.tokens.size();
+		for (const petri::token &t : s.tokens) {
+			if (t.index >= 0 and placeMap[t.index] >= 0) {
+				w.tokens.push_back(placeMap[t.index]);
+			}
+		}
+		sort(w.tokens.begin() + sr.tokens.begin, w.tokens.end());
+		sr.tokens.end = w.tokens.size();
+
+		sr.values.offset = w.values.size();
+		for (const arithmetic::Value &value : s.encodings.values) {
+			writeValue(w.values, value);
+		}
+		sr.values.length = w.values.size() - sr.values.offset;
+		sr.count = s.encodings.values.size();
+		w.reset.push_back(sr);
+	}
+
+	vector<serialSection> table;
+	vector<std::pair<const char*, size_t> > data;
+	addSection(table, data, serialSection::STRINGS, w.strings.data(), w.strings.size());
+	addSection(table, data, serialSection::NAME, w.name.data(), w.name.size());
+	addSection(table, data, serialSection::VARS, w.vars.data(), w.vars.size());
+	addSection(table, data, serialSection::REMOTE, w.remote.data(), w.remote.size());
+	addSection(table, data, serialSection::PLACES, w.places.data(), w.places.size());
+	addSection(table, data, serialSection::TRANSITIONS, w.transitions.data(), w.transitions.size());
+	addSection(table, data, serialSection::TERMS, w.terms.data(), w.terms.size());
+	addSection(table, data, serialSection::ACTIONS, w.actions.data(), w.actions.size());
+	addSection(table, data, serialSection::PLACE_ARCS, w.arcs[place::type].data(), w.arcs[place::type].size());
+	addSection(table, data, serialSection::TRANS_ARCS, w.arcs[transition::type].data(), w.arcs[transition::type].size());
+	addSection(table, data, serialSection::RESET, w.reset.data(), w.reset.size());
+	addSection(table, data, serialSection::TOKENS, w.tokens.data(), w.tokens.size());
+	addSection(table, data, serialSection::VALUES, w.values.data(), w.values.size());
+	addSection(table, data, serialSection::OPERATIONS, w.operations.data(), w.operations.size());
+	addSection(table, data, serialSection::OPERANDS, w.operands.data(), w.operands.size());
+
+	auto align = [](uint64_t offset) {
+		return (offset + 7) & ~((uint64_t)7);
+	};
+
+	uint64_t offset = align(sizeof(serialHeader) + table.size()*sizeof(serialSection));
+	for (serialSection &s : table) {
+		s.offset = offset;
+		offset = align(offset + s.size);
+	}
+
+	// Lay the file out in host order, then fix the byte order as a whole
+	string buffer(offset, '\0');
+	serialHeader header{SERIAL_MAGIC, SERIAL_VERSION, (uint32_t)table.size(), 0};
+	memcpy(buffer.data(), &header, sizeof(header));
+	memcpy(buffer.data() + sizeof(header), table.data(), table.size()*sizeof(serialSection));
+	for (size_t i = 0; i < table.size(); i++) {
+		if (data[i].second > 0) {
+			memcpy(buffer.data() + table[i].offset, data[i].first, data[i].second);
+		}
+	}
+	writeLittleEndian(os, buffer);
+}
+
+graphView::graphView() {
+}
+
+graphView::~graphView() {
+}
+
+template <typename T>
+bool bindSection(std::span<const T> &result, const char *data, size_t size, const serialSection &s) {
+	if (s.offset > size or s.size > size - s.offset or s.size != (uint64_t)s.count*sizeof(T)
+		or (s.offset % alignof(T)) != 0) {
+		return false;
+	}
+	result = std::span<const T>((const T*)(data + s.offset), s.count);
+	return true;
+}
+
+/**
+ * @brief Point the view at a serialized graph
+ *
+ * Checks the header and the bounds of every section. The contents of the
+ * sections are checked when they are read. Sections with unknown kinds are
+ * skipped so that minor additions to the format stay readable.
+ */
+bool graphView::open(const char *data, size_t size) {
+	serialHeader header;
+	if (size < sizeof(header) or ((uintptr_t)data % 8) != 0) {
+		return false;
+	}
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != SERIAL_MAGIC or header.version != SERIAL_VERSION
+		or header.sections > (size - sizeof(header))/sizeof(serialSection)) {
+		return false;
+	}
+
+	const serialSection *table = (const serialSection*)(data + sizeof(header));
+	bool ok = true;
+	for (uint32_t i = 0; i < header.sections and ok; i++) {
+		const serialSection &s = table[i];
+		switch (s.kind) {
+		case serialSection::STRINGS: ok = bindSection(strings, data, size, s); break;
+		case serialSection::NAME: ok = bindSection(name, data, size, s); break;
+		case serialSection::VARS: ok = bindSection(vars, data, size, s); break;
+		case serialSection::REMOTE: ok = bindSection(remote, data, size, s); break;
+		case serialSection::PLACES: ok = bindSection(places, data, size, s); break;
+		case serialSection::TRANSITIONS: ok = bindSection(transitions, data, size, s); break;
+		case serialSection::TERMS: ok = bindSection(terms, data, size, s); break;
+		case serialSection::ACTIONS: ok = bindSection(actions, data, size, s); break;
+		case serialSection::PLACE_ARCS: ok = bindSection(arcs[place::type], data, size, s); break;
+		case serialSection::TRANS_ARCS: ok = bindSection(arcs[transition::type], data, size, s); break;
+		case serialSection::RESET: ok = bindSection(reset, data, size, s); break;
+		case serialSection::TOKENS: ok = bindSection(tokens, data, size, s); break;
+		case serialSection::VALUES: ok = bindSection(values, data, size, s); break;
+		case serialSection::OPERATIONS: ok = bindSection(operations, data, size, s); break;
+		case serialSection::OPERANDS: ok = bindSection(operands, data, size, s); break;
+		default: break;
+		}
+	}
+	return ok;
+}
+
+std::string_view graphView::str(serialString s) const {
+	if (s.offset > strings.size() or s.length > strings.size() - s.offset) {
+		return std::string_view();
+	}
+	return std::string_view(strings.data() + s.offset, s.length);
+}
+
+// Rebuilds expressions from the OPERATIONS and OPERANDS sections. An
+// operation may only refer to operations before it, so the recursion always
+// ends, even on a corrupt file.
+struct expressionReader {
+	expressionReader(const graphView &view) : view(view), built(view.operations.size()), done(view.operations.size(), false) {
+	}
+
+	const graphView &view;
+	vector<arithmetic::Expression> built;
+	vector<bool> done;
+
+	bool root(serialOperand op, arithmetic::Expression &result) {
+		return operand(op, view.operations.size(), result);
+	}
+
+	bool operand(serialOperand op, size_t bound, arithmetic::Expression &result) {
+		switch (op.type) {
+		case arithmetic::Operand::UNDEF:
+			result = arithmetic::Expression();
+			return true;
+		case arithmetic::Operand::CONST:
+		case arithmetic::Operand::TYPE: {
+			if (op.index > view.values.size() or op.length > view.values.size() - op.index) {
+				return false;
+			}
+			std::string_view in(view.values.data() + op.index, op.length);
+			arithmetic::Operand leaf;
+			leaf.type = (arithmetic::Operand::Type)op.type;
+			if (not readValue(in, leaf.cnst)) {
+				return false;
+			}
+			result = arithmetic::Expression(leaf);
+			return true;
+		}
+		case arithmetic::Operand::VAR:
+			if (op.index >= view.vars.size()) {
+				return false;
+			}
+			result = arithmetic::Expression(arithmetic::Operand::varOf(op.index));
+			return true;
+		case arithmetic::Operand::EXPR:
+			if (op.index >= bound) {
+				return false;
+			}
+			if (not done[op.index]) {
+				const serialOperation &operation = view.operations[op.index];
+				if (operation.operands.begin > operation.operands.end or operation.operands.end > view.operands.size()) {
+					return false;
+				}
+
+				vector<arithmetic::Expression> args(operation.operands.end - operation.operands.begin);
+				for (uint32_t i = operation.operands.begin; i < operation.operands.end; i++) {
+					if (not operand(view.operands[i], op.index, args[i - operation.operands.begin])) {
+						return false;
+					}
+				}
+				built[op.index] = arithmetic::Expression(operation.func, args);
+				done[op.index] = true;
+			}
+			result = built[op.index];
+			return true;
+		default:
+			return false;
+		}
+	}
+};
+
+bool read(const graphView &view, graph &g) {
+	g = graph();
+	if (not view.name.empty()) {
+		g.name = string(view.str(view.name[0]));
+	}
+
+	for (const serialVar &sv : view.vars) {
+		if (sv.remote.begin > sv.remote.end or sv.remote.end > view.remote.size()) {
+			return false;
+		}
+		variable v(string(view.str(sv.name)), sv.region);
+		v.remote.assign(view.remote.begin() + sv.remote.begin, view.remote.begin() + sv.remote.end);
+		g.vars.push_back(v);
+	}
+
+	for (const serialPlace &sp : view.places) {
+		place p;
+		p.arbiter = sp.arbiter != 0;
+		g.create(p);
+	}
+
+	expressionReader expr(view);
+	for (const serialTransition &st : view.transitions) {
+		if (st.terms.begin > st.terms.end or st.terms.end > view.terms.size()) {
+			return false;
+		}
+
+		arithmetic::Choice action;
+		action.terms.clear();
+		for (uint32_t i = st.terms.begin; i < st.terms.end; i++) {
+			const serialRange &r = view.terms[i];
+			if (r.begin > r.end or r.end > view.actions.size()) {
+				return false;
+			}
+
+			action.terms.push_back(arithmetic::Parallel());
+			for (uint32_t j = r.begin; j < r.end; j++) {
+				arithmetic::Action a;
+				if (not expr.root(view.actions[j].lvalue, a.lvalue)
+					or not expr.root(view.actions[j].rvalue, a.rvalue)) {
+					return false;
+				}
+				action.terms.back().actions.push_back(a);
+			}
+		}
+		arithmetic::Expression guard;
+		if (not expr.root(st.guard, guard)) {
+			return false;
+		}
+		g.create(transition(guard, action));
+	}
+
+	for (int type = 0; type < 2; type++) {
+		int other = 1-type;
+		size_t fromCount = type == place::type ? view.places.size() : view.transitions.size();
+		size_t toCount = type == place::type ? view.transitions.size() : view.places.size();
+		for (const serialArc &a : view.arcs[type]) {
+			if (a.from < 0 or (size_t)a.from >= fromCount or a.to < 0 or (size_t)a.to >= toCount) {
+				return false;
+			}
+			g.connect(petri::iterator(type, a.from), petri::iterator(other, a.to));
+		}
+	}
+
+	for (const serialReset &sr : view.reset) {
+		if (sr.tokens.begin > sr.tokens.end or sr.tokens.end > view.tokens.size()
+			or sr.values.offset > view.values.size() or sr.values.length > view.values.size() - sr.values.offset) {
+			return false;
+		}
+
+		state s;
+		for (uint32_t i = sr.tokens.begin; i < sr.tokens.end; i++) {
+			if (view.tokens[i] < 0 or (size_t)view.tokens[i] >= view.places.size()) {
+				return false;
+			}
+			s.tokens.push_back(petri::token(view.tokens[i]));
+		}
+
+		std::string_view values(view.values.data() + sr.values.offset, sr.values.length);
+		for (uint32_t i = 0; i < sr.count; i++) {
+			s.encodings.values.push_back(arithmetic::Value());
+			if (not readValue(values, s.encodings.values.back())) {
+				return false;
+			}
+		}
+		g.reset.push_back(s);
+	}
+
+	return true;
+}
+
+bool read(istream &is, graph &g) {
+	ostringstream contents;
+	contents << is.rdbuf();
+	string data = contents.str();
+
+	// Copy into 8-byte aligned storage so the sections can be viewed in place
+	vector<uint64_t> buffer((data.size()+7)/8);
+	memcpy(buffer.data(), data.data(), data.size());
+
+	if (not hostIsLittleEndian and not swapSerialized((char*)buffer.data(), data.size(), true)) {
+		return false;
+	}
+
+	graphView view;
+	return view.open((const char*)buffer.data(), data.size()) and read(view, g);
+}
+
+bool load(const string &path, graph &g) {
+#ifdef WIN32
+	ifstream in(path, ios::in | ios::binary);
+	return in and read(in, g);
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 or info.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+
+	// A big-endian host swaps the records in place. The mapping is private,
+	// so that never touches the file.
+	int prot = hostIsLittleEndian ? PROT_READ : PROT_READ | PROT_WRITE;
+	void *data = mmap(nullptr, info.st_size, prot, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	graphView view;
+	bool result = (hostIsLittleEndian or swapSerialized((char*)data, info.st_size, true))
+		and view.open((const char*)data, info.st_size) and read(view, g);
+	munmap(data, info.st_size);
+	return result;
+#endif
+}
+
+bool save(const string &path, const graph &g) {
+	ofstream out(path, ios::out | ios::binary | ios::trunc);
+	if (not out) {
+		return false;
+	}
+	write(out, g);
+	return (bool)out;
+}
+
+}
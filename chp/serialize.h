@@ -0,0 +1,174 @@
+#pragma once
+
+#include <span>
+#include <string_view>
+
+#include <common/standard.h>
+
+#include "graph.h"
+
+namespace chp
+{
+
+// Binary graph format
+//
+// A file starts with a fixed header followed by a table of sections. Every
+// section is an array of fixed-width little-endian records aligned to 8
+// bytes, so a mapped file can be read in place without parsing. Strings live
+// in one string pool and are referenced by offset and length.
+//
+// Expressions are stored as their syntax trees. Every operation is a record
+// in OPERATIONS with a range of records in OPERANDS. An operand is either a
+// variable index, a constant encoded in VALUES, or the index of another
+// operation. Operations only refer to operations written before them, and
+// the root of an expression is an operand stored in its transition or action.
+//
+// Records are made of 32-bit fields, and values are encoded as 64-bit words.
+// Big-endian hosts swap them when writing, and swap a private copy of the
+// mapping when loading, so files move between machines unchanged. Only
+// little-endian hosts read a mapped file fully in place. graphView itself
+// expects host order.
+//
+// Only valid places and transitions are written and they are renumbered
+// densely in their original order. Arcs and reset tokens are sorted, so two
+// graphs that differ only in erased slots or in the order of their arcs are
+// written identically.
+//
+// Readers reject files whose major version differs from SERIAL_VERSION.
+
+const uint32_t SERIAL_MAGIC = 0x47504843; // "CHPG"
+const uint32_t SERIAL_VERSION = 3;
+
+struct serialHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sections;
+	uint32_t reserved;
+};
+
+struct serialSection {
+	enum {
+		STRINGS = 0,      // char
+		NAME = 1,         // serialString, the graph name
+		VARS = 2,         // serialVar
+		REMOTE = 3,       // int32_t
+		PLACES = 4,       // serialPlace
+		TRANSITIONS = 5,  // serialTransition
+		TERMS = 6,        // serialRange into ACTIONS
+		ACTIONS = 7,      // serialAction
+		PLACE_ARCS = 8,   // serialArc, place -> transition
+		TRANS_ARCS = 9,   // serialArc, transition -> place
+		RESET = 10,       // serialReset
+		TOKENS = 11,      // int32_t
+		VALUES = 12,      // char, encoded arithmetic::Value
+		OPERATIONS = 13,  // serialOperation
+		OPERANDS = 14,    // serialOperand
+		COUNT = 15
+	};
+
+	uint32_t kind;
+	uint32_t count;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct serialString {
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct serialRange {
+	uint32_t begin;
+	uint32_t end;
+};
+
+struct serialVar {
+	serialString name;
+	int32_t region;
+	serialRange remote;
+};
+
+struct serialPlace {
+	uint32_t arbiter;
+};
+
+// The type is an arithmetic::Operand::Type. CONST and TYPE operands point
+// into VALUES, VAR operands hold the variable index, and EXPR operands hold
+// the index of an operation. UNDEF is an empty expression.
+struct serialOperand {
+	int32_t type;
+	uint32_t index;
+	uint32_t length;
+};
+
+struct serialOperation {
+	int32_t func;
+	serialRange operands;
+};
+
+struct serialTransition {
+	serialOperand guard;
+	serialRange terms;
+};
+
+struct serialAction {
+	serialOperand lvalue;
+	serialOperand rvalue;
+};
+
+struct serialArc {
+	int32_t from;
+	int32_t to;
+};
+
+struct serialReset {
+	serialRange tokens;
+	serialString values;
+	uint32_t count;
+};
+
+// A read-only view of a serialized graph in memory, usually a mapped file.
+// The spans point directly into the buffer, which must outlive the view.
+struct graphView {
+	graphView();
+	~graphView();
+
+	std::span<const char> strings;
+	std::span<const serialString> name;
+	std::span<const serialVar> vars;
+	std::span<const int32_t> remote;
+	std::span<const serialPlace> places;
+	std::span<const serialTransition> transitions;
+	std::span<const serialRange> terms;
+	std::span<const serialAction> actions;
+	std::span<const serialArc> arcs[2];
+	std::span<const serialReset> reset;
+	std::span<const int32_t> tokens;
+	std::span<const char> values;
+	std::span<const serialOperation> operations;
+	std::span<const serialOperand> operands;
+
+	// Returns false if the buffer isn't a well-formed graph of this version.
+	bool open(const char *data, size_t size);
+	std::string_view str(serialString s) const;
+};
+
+// Variable length encoding of an arithmetic::Value as stored in the VALUES
+// section. This is shared with the simulation trace format.
+void writeValue(string &out, const arithmetic::Value &value);
+bool readValue(std::string_view &in, arithmetic::Value &value);
+
+// Without name, the graph is written with an empty NAME section, so graphs
+// that differ only in their names are written identically.
+void write(ostream &os, const graph &g, bool name=true);
+bool read(istream &is, graph &g);
+
+// Build a graph from a view. Expressions are rebuilt from their operation
+// records without going through the parser.
+bool read(const graphView &view, graph &g);
+
+// Read a graph from a file, mapping it into memory where supported.
+bool load(const string &path, graph &g);
+bool save(const string &path, const graph &g);
+
+}
@@ -1,9 +1,11 @@
 #include "simulator.h"
 #include "graph.h"
 #include "expression.h"
+#include "instrument.h"
 #include <common/text.h>
 #include <common/message.h>
 #include <common/math.h>
+#include <sstream>
 
 namespace chp
 {
@@ -21,22 +23,28 @@ instability::~instability()
 
 }
 
-string instability::to_string(const chp::graph &g)
+void instability::print(ostream &os, const chp::graph &g) const
 {
-	string result;
-	result = "unstable rule " + enabled_transition::to_string(g);
+	os << "unstable rule ";
+	enabled_transition::print(os, g);
 
-	result += " cause: {";
+	os << " cause: {";
 
 	for (int j = 0; j < (int)history.size(); j++)
 	{
 		if (j != 0)
-			result += "; ";
+			os << "; ";
 
-		result += history[j].to_string(g);
+		history[j].print(os, g);
 	}
-	result += "}";
-	return result;
+	os << "}";
+}
+
+string instability::to_string(const chp::graph &g)
+{
+	ostringstream os;
+	print(os, g);
+	return os.str();
 }
 
 interference::interference()
@@ -63,9 +71,19 @@ interference::~interference()
 
 }
 
+void interference::print(ostream &os, const chp::graph &g) const
+{
+	os << "interfering assignments ";
+	first.print(os, g);
+	os << " and ";
+	second.print(os, g);
+}
+
 string interference::to_string(const chp::graph &g)
 {
-	return "interfering assignments " + first.to_string(g) + " and " + second.to_string(g);
+	ostringstream os;
+	print(os, g);
+	return os.str();
 }
 
 mutex::mutex()
@@ -92,9 +110,67 @@ mutex::~mutex()
 
 }
 
+void mutex::print(ostream &os, const chp::graph &g) const
+{
+	os << "non-exclusive guards in deterministic selection for assignments ";
+	first.print(os, g);
+	os << " and ";
+	second.print(os, g);
+}
+
 string mutex::to_string(const chp::graph &g)
 {
-	return "non-exclusive guards in deterministic selection for assignments " + first.to_string(g) + " and " + second.to_string(g);
+	ostringstream os;
+	print(os, g);
+	return os.str();
+}
+
+// The ways another loaded transition can overlap with the one that fires,
+// stored in simulator::conflicts.
+static const int OVERLAPS = 1<<0;
+static const int ARBITRATED = 1<<1;
+
+// Mix v into the hash h
+static size_t mixHash(size_t h, size_t v)
+{
+	return h ^ (v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2));
+}
+
+size_t errorHash::operator()(const term_index &t) const
+{
+	return mixHash(std::hash<int>()(t.index), std::hash<int>()(t.term));
+}
+
+size_t errorHash::operator()(const enabled_transition &t) const
+{
+	size_t h = std::hash<int>()(t.index);
+	for (const term_index &i : t.history) {
+		h = mixHash(h, (*this)(i));
+	}
+	return h;
+}
+
+size_t errorHash::operator()(const instability &e) const
+{
+	return (*this)((const enabled_transition &)e);
+}
+
+size_t errorHash::operator()(const interference &e) const
+{
+	return mixHash((*this)(e.first), (*this)(e.second));
+}
+
+size_t errorHash::operator()(const mutex &e) const
+{
+	return mixHash((*this)(e.first), (*this)(e.second));
+}
+
+errorSink::errorSink()
+{
+}
+
+errorSink::~errorSink()
+{
 }
 
 deadlock::deadlock()
@@ -117,20 +193,55 @@ deadlock::~deadlock()
 
 }
 
+void deadlock::print(ostream &os, const graph &g) const
+{
+	os << "deadlock detected at state ";
+	state::print(os, g);
+}
+
 string deadlock::to_string(const graph &g)
 {
-	return "deadlock detected at state " + state::to_string(g);
+	ostringstream os;
+	print(os, g);
+	return os.str();
+}
+
+observer::observer()
+{
+}
+
+observer::~observer()
+{
+}
+
+void observer::enabled(const simulator &sim)
+{
+}
+
+snapshot::snapshot()
+{
+	now = 0;
+}
+
+snapshot::~snapshot()
+{
 }
 
 simulator::simulator()
 {
 	base = NULL;
+	sink = NULL;
 	now = 0;
+	closed = 0;
+	dirty = ALL;
 }
 
 simulator::simulator(graph *base, state initial) {
 	this->base = base;
+	this->sink = NULL;
 	this->now = 0;
+	this->closed = 0;
+	this->dirty = ALL;
 	if (base != NULL) {
 		encoding = base->U();
 		global = base->U();
@@ -158,34 +269,77 @@ int simulator::enabled(bool sorted) {
 		internal("", "NULL pointer to simulator::base", __FILE__, __LINE__);
 		return 0;
 	}
+	CHP_TIME(PHASE_ENABLED);
 
 	//cout << endl << endl;
 	//for (int i = 0; i < base->vars.size(); i++) {
 	//	cout << "v" << i << ": " << base->vars[i].name << endl;
 	//}
 
-	// Do a pre-screen
-	for (int i = (int)tokens.size()-1; i >= 0; i--)
-		if (tokens[i].cause >= 0)
-			tokens.erase(tokens.begin() + i);
+	dirty |= READY;
+
+	if (outputBegin.size() != base->transitions.size()+1) {
+		indexGraph();
+	}
+
+	// Do a pre-screen. tokens is chunked, so this only writes to the chunks
+	// from the first removed token on.
+	int kept = 0;
+	for (int i = 0; i < (int)tokens.size(); i++) {
+		if (tokens[i].cause < 0) {
+			if (kept != i) {
+				tokens.write(kept) = std::move(tokens.write(i));
+			}
+			kept++;
+		}
+	}
+	tokens.resize(kept);
 
 	if (tokens.size() == 0)
 		return 0;
 
-	if (!sorted)
-		sort(tokens.begin(), tokens.end());
+	// Sort a permutation and only write the tokens that move.
+	if (!sorted and not is_sorted(tokens.begin(), tokens.end())) {
+		order.resize(tokens.size());
+		for (int i = 0; i < (int)order.size(); i++) {
+			order[i] = i;
+		}
+		stable_sort(order.begin(), order.end(), [this](int a, int b) {
+			return tokens[a] < tokens[b];
+		});
+
+		moved.clear();
+		for (int i = 0; i < (int)order.size(); i++) {
+			if (order[i] != i) {
+				moved.push_back(tokens[order[i]]);
+			}
+		}
+		for (int i = 0, m = 0; i < (int)order.size(); i++) {
+			if (order[i] != i) {
+				tokens.write(i) = std::move(moved[m++]);
+			}
+		}
+	}
 
-	// Get the list of transitions that have a sufficient number of tokens at the input places
-	vector<enabled_transition> preload;
-	vector<enabled_transition> potential;
-	vector<int> global_disabled;
-	vector<int> disabled;
+	// Get the list of transitions that have a sufficient number of tokens at
+	// the input places. These buffers are members so that their memory is
+	// reused from one call to the next.
+	preload.clear();
+	potential.clear();
+	global_disabled.clear();
+	disabled.clear();
 	disabled.reserve(base->transitions.size());
 	
 	int preload_size = 0;
+	closed = 0;
 	do {
+		CHP_COUNT(PRELOAD_ITERATIONS, 1);
 		disabled = global_disabled;
 		preload_size = preload.size();
+
+		// The transitions from previous iterations won't change anymore, so
+		// their token closures can be computed once and reused.
+		closeTokens(preload);
 		for (auto a = base->arcs[place::type].begin(); a != base->arcs[place::type].end(); a++) {
 			// A transition will only be in disabled if we've already determined that it can't be enabled.
 			auto d = lower_bound(disabled.begin(), disabled.end(), a->to.index);
@@ -200,19 +354,16 @@ int simulator::enabled(bool sorted) {
 						if (i >= preload_size) {
 							// Check to see if there is any token at the input place of this arc and make sure that
 							// this token has not already been consumed by this particular transition
-							vector<int> matching_tokens;
+							// or any of the transitions in the chain that caused its tokens. The
+							// transitions in the chain are all from previous iterations, so their
+							// closures are already computed.
+							matching_tokens.clear();
 							for (int j = 0; j < (int)tokens.size(); j++) {
 								if (a->from.index == tokens[j].index) {
-									// We have to implement a recursive...ish algorithm here
-									// to check to see if this token has already been used by
-									// any of the transitions in the chain
 									bool used = false;
-									vector<int> test = preload[i].tokens;
-									for (int k = 0; k < (int)test.size() and not used; k++) {
-										used = (test[k] == j);
-										if (tokens[test[k]].cause >= 0) {
-											test.insert(test.end(), preload[tokens[test[k]].cause].tokens.begin(), preload[tokens[test[k]].cause].tokens.end());
-										}
+									for (int k = 0; k < (int)preload[i].tokens.size() and not used; k++) {
+										int c = tokens[preload[i].tokens[k]].cause;
+										used = preload[i].tokens[k] == j or (c >= 0 and closure[c].test(j));
 									}
 
 									if (not used) {
@@ -259,7 +410,10 @@ int simulator::enabled(bool sorted) {
 			}
 		}
 
-		// Now we need to check the guards of all of the loaded transitions against the state
+		// Now we need to check the guards of all of the loaded transitions
+		// against the state. Transitions that are done with are marked in
+		// erased and removed all at once after the loop.
+		erased.assign(preload.size(), 0);
 		for (int i = (int)preload.size()-1; i >= preload_size; i--) {
 			// To ensure that a transition is actually enabled, we need to check its
 			// guard. We also need to implement an instability check. Unfortunately,
@@ -326,14 +480,20 @@ int simulator::enabled(bool sorted) {
 			//cout << endl;
 			//cout << "checking " << base->transitions[preload[i].index].guard << "->" << base->transitions[preload[i].index].action << endl;
 			//cout << "building guard depend=[";
-			preload[i].depend = arithmetic::Expression::vdd();
-			for (int j = 0; j < (int)preload[i].tokens.size(); j++) {
-				preload[i].depend = preload[i].depend & tokens[preload[i].tokens[j]].guard;
-				//cout << tokens[preload[i].tokens[j]].guard << " ";
+			// Token guards are minimized when the tokens are made, so the guard
+			// of a single token is used as it is.
+			if (preload[i].tokens.size() == 1) {
+				preload[i].depend = tokens[preload[i].tokens[0]].guard;
+			} else {
+				preload[i].depend = arithmetic::Expression::vdd();
+				for (int j = 0; j < (int)preload[i].tokens.size(); j++) {
+					preload[i].depend = preload[i].depend & tokens[preload[i].tokens[j]].guard;
+					//cout << tokens[preload[i].tokens[j]].guard << " ";
+				}
+				preload[i].depend.minimize();
+				CHP_COUNT(MINIMIZE_CALLS, 1);
 			}
-			preload[i].guard = base->transitions[preload[i].index].guard & base->transitions[preload[i].index].action.guard();
-			preload[i].depend.minimize();
-			preload[i].guard.minimize();
+			preload[i].guard = guards[preload[i].index];
 			//cout << "] " << base->transitions[preload[i].index].guard << " " << base->transitions[preload[i].index].action.guard() << endl;
 
 			//preload[i].depend.hide(base->transitions[preload[i].index].local_action.vars());
@@ -354,17 +514,19 @@ int simulator::enabled(bool sorted) {
 			bool previously_enabled = false;
 			for (int j = 0; j < (int)loaded.size() and not previously_enabled; j++) {
 				if (loaded[j].index == preload[i].index and not loaded[j].vacuous) {
-					preload[i].history = loaded[j].history;
 					preload[i].fire_at = loaded[j].fire_at;
+					preload[i].since = loaded[j].since;
 					previously_enabled = true;
 				}
 			}
 			if (!previously_enabled) {
 				preload[i].fire_at = now + pareto(10000, 5.0);
+				preload[i].since = history.next;
 			}
 
 			//cout << "evaluating guard " << encoding << " " << global << " " << guard << endl;
 			// Now we check to see if the current state passes the guard
+			CHP_COUNT(GUARDS_EVALUATED, 1);
 			int isReady = arithmetic::passesGuard(encoding, global, guard, &preload[i].guard_action);
 			//cout << "found " << isReady << " " << preload[i].guard_action << endl;
 
@@ -387,7 +549,7 @@ int simulator::enabled(bool sorted) {
 			// if the transition is vacuous, then we've already passed the guard even
 			// if the guard is not satisfied by the current state
 			if (preload[i].vacuous) {
-				vector<int> output = base->next(transition::type, preload[i].index);
+				std::span<const int> output = outputsOf(preload[i].index);
 				bool loop = true;
 				for (int j = 0; j < (int)output.size() and loop; j++) {
 					loop = false;
@@ -397,17 +559,11 @@ int simulator::enabled(bool sorted) {
 				}
 
 				if (loop) {
-					for (int j = 0; j < (int)tokens.size(); j++) {
-						if (tokens[j].cause > i) {
-							tokens[j].cause--;
-						}
-					}
-
 					auto d = lower_bound(global_disabled.begin(), global_disabled.end(), preload[i].index);
 					if (d == global_disabled.end() or *d != preload[i].index) {
 						global_disabled.insert(d, preload[i].index);
 					}
-					preload.erase(preload.begin() + i);
+					erased[i] = 1;
 				} else {
 					arithmetic::Expression guard = preload[i].depend;
 					if (preload[i].local_action.isTautology()) {
@@ -425,6 +581,7 @@ int simulator::enabled(bool sorted) {
 					}
 
 					guard.minimize();
+					CHP_COUNT(MINIMIZE_CALLS, 1);
 
 					for (int j = 0; j < (int)output.size(); j++)
 					{
@@ -433,36 +590,57 @@ int simulator::enabled(bool sorted) {
 					}
 				}
 			} else {
-				if (isReady >= 0) {
-					potential.push_back(preload[i]);
+				auto d = lower_bound(global_disabled.begin(), global_disabled.end(), preload[i].index);
+				if (d == global_disabled.end() or *d != preload[i].index) {
+					global_disabled.insert(d, preload[i].index);
 				}
 
-				for (int j = 0; j < (int)tokens.size(); j++) {
-					if (tokens[j].cause > i) {
-						tokens[j].cause--;
-					}
+				if (isReady >= 0) {
+					potential.push_back(std::move(preload[i]));
 				}
+				erased[i] = 1;
+			}
+		}
 
-				auto d = lower_bound(global_disabled.begin(), global_disabled.end(), preload[i].index);
-				if (d == global_disabled.end() or *d != preload[i].index) {
-					global_disabled.insert(d, preload[i].index);
+		// Remove the erased transitions in one pass. A token caused by
+		// preload[c] moves down by the number of transitions erased before c.
+		int removed = 0;
+		for (int i = 0; i < (int)preload.size(); i++) {
+			int shift = removed;
+			removed += erased[i];
+			erased[i] = shift;
+			if (removed == shift and shift > 0) {
+				preload[i-shift] = std::move(preload[i]);
+			}
+		}
+		if (removed > 0) {
+			for (int j = 0; j < (int)tokens.size(); j++) {
+				if (tokens[j].cause >= 0) {
+					tokens.write(j).cause -= erased[tokens[j].cause];
 				}
-				preload.erase(preload.begin() + i);
 			}
+			preload.resize(preload.size() - removed);
 		}
 	} while ((int)preload.size() != preload_size);
 
 	for (int i = 0; i < (int)potential.size(); i++) {
-		vector<int> output = base->next(transition::type, potential[i].index);
+		std::span<const int> output = outputsOf(potential[i].index);
 		for (int j = 0; j < (int)output.size(); j++) {
 			potential[i].output_marking.push_back((int)tokens.size());
 			tokens.push_back(token(output[j], arithmetic::Expression::vdd(), preload.size()));
 		}
 
-		preload.push_back(potential[i]);
+		preload.push_back(std::move(potential[i]));
 	}
 
-	loaded = preload;
+	// The transitions are all evaluated again, so every chunk of loaded is
+	// written. The chunks are reused unless a snapshot still holds them.
+	loaded.clear();
+	for (int i = 0; i < (int)preload.size(); i++) {
+		loaded.push_back(std::move(preload[i]));
+	}
+	preload.clear();
+	closeTokens(loaded);
 	ready.clear();
 
 	for (int i = 0; i < (int)loaded.size(); i++) {
@@ -473,9 +651,115 @@ int simulator::enabled(bool sorted) {
 		}
 	}
 
+	if (not observers.empty()) {
+		for (observer *o : observers) {
+			o->enabled(*this);
+		}
+	}
+
 	return ready.size();
 }
 
+/**
+ * @brief Cache what enabled() reads from the graph
+ *
+ * The places after each transition are stored as one flat list, because
+ * graph::next() returns a new vector on every call. The guard of each
+ * transition is ANDed with the guard of its action and minimized once here
+ * instead of every time the transition is loaded. The graph must not change
+ * while it is being simulated.
+ */
+void simulator::indexGraph()
+{
+	int n = (int)base->transitions.size();
+	outputBegin.assign(n+1, 0);
+	for (const petri::arc &a : base->arcs[transition::type]) {
+		outputBegin[a.from.index+1]++;
+	}
+	for (int i = 0; i < n; i++) {
+		outputBegin[i+1] += outputBegin[i];
+	}
+
+	outputList.resize(outputBegin[n]);
+	vector<int> fill(outputBegin.begin(), outputBegin.end()-1);
+	for (const petri::arc &a : base->arcs[transition::type]) {
+		outputList[fill[a.from.index]++] = a.to.index;
+	}
+
+	guards.assign(n, arithmetic::Expression());
+	for (int i = 0; i < n; i++) {
+		if (base->transitions.is_valid(i)) {
+			guards[i] = base->transitions[i].guard & base->transitions[i].action.guard();
+			guards[i].minimize();
+			CHP_COUNT(MINIMIZE_CALLS, 1);
+		}
+	}
+}
+
+std::span<const int> simulator::outputsOf(int t) const
+{
+	return std::span<const int>(outputList.data()+outputBegin[t], outputBegin[t+1]-outputBegin[t]);
+}
+
+/**
+ * @brief Extend the token closures and the cause DAG to the whole pool
+ *
+ * The transitions before 'closed' are unchanged and keep their closures. A
+ * cause always comes before the transitions it causes, so the closure of
+ * each new transition is the union of its own tokens and the closures of
+ * its causes. The direct token sets and the sets of transitions on each
+ * path are built here too, once per transition, so fire() and
+ * get_choices() don't rebuild them.
+ */
+template <typename Pool>
+void simulator::closeTokens(const Pool &pool)
+{
+	if (closed == 0) {
+		causeBegin.assign(1, 0);
+	} else {
+		causeBegin.resize(closed+1);
+	}
+	causeList.resize(causeBegin.back());
+	if (closure.size() < pool.size()) {
+		closure.resize(pool.size());
+	}
+
+	if (tokenSets.size() < pool.size()) {
+		tokenSets.resize(pool.size());
+		visitedSets.resize(pool.size());
+	}
+
+	for (int x = closed; x < (int)pool.size(); x++) {
+		closure[x].resize(tokens.size());
+		closure[x].clear();
+		tokenSets[x].resize(tokens.size());
+		tokenSets[x].clear();
+		visitedSets[x].resize(x+1);
+		visitedSets[x].clear();
+		visitedSets[x].set(x);
+		int begin = causeList.size();
+		for (int k : pool[x].tokens) {
+			closure[x].set(k);
+			tokenSets[x].set(k);
+			int c = tokens[k].cause;
+			if (c >= 0 and c < x) {
+				closure[x] |= closure[c];
+				if (find(causeList.begin()+begin, causeList.end(), c) == causeList.end()) {
+					causeList.push_back(c);
+					visitedSets[x] |= visitedSets[c];
+				}
+			}
+		}
+		causeBegin.push_back(causeList.size());
+	}
+	closed = pool.size();
+}
+
+std::span<const int> simulator::causesOf(int i) const
+{
+	return std::span<const int>(causeList.data()+causeBegin[i], causeBegin[i+1]-causeBegin[i]);
+}
+
 enabled_transition simulator::fire(int index)
 {
 	if (base == NULL)
@@ -483,129 +767,182 @@ enabled_transition simulator::fire(int index)
 		internal("", "NULL pointer to simulator::base", __FILE__, __LINE__);
 		return enabled_transition();
 	}
+	CHP_TIME(PHASE_FIRE);
+	CHP_COUNT(HISTORY_LENGTH, history.size());
+
+	dirty |= ENCODING | READY;
+
+	// The closures are missing after a restore. They have to be rebuilt
+	// before the fired transition is moved out, or its closure would be
+	// built from an empty token list.
+	if (closed != (int)loaded.size()) {
+		closed = 0;
+		closeTokens(loaded);
+	}
 
-	enabled_transition t = loaded[ready[index].first];
+	// The fired transition is moved out of loaded. Its slot is removed along
+	// with the other transitions that shared its tokens below.
+	int fired = ready[index].first;
+	enabled_transition t = std::move(loaded.write(fired));
 	int term = ready[index].second;
 	if (t.fire_at > now) {
 		now = t.fire_at;
 	}
 
+	// The ring still holds every firing since t was enabled, because it was
+	// trimmed to the oldest 'since' of the loaded transitions
+	history.firings(t.since, t.history);
+
 	// We need to go through the potential list of transitions and flatten their input and output tokens.
 	// Since we know that no transition can use the same token twice, we can simply mush them all
 	// into one big list and then remove duplicates.
 	// assumes that a transition in the loaded array only depends upon transitions before it in the array
-	vector<int> visited(1, ready[index].first);
-	for (int i = 0; i < (int)t.tokens.size(); i++) {
-		if (tokens[t.tokens[i]].cause >= 0 and tokens[t.tokens[i]].cause < ready[index].first)
-		{
-			t.tokens.insert(t.tokens.end(), loaded[tokens[t.tokens[i]].cause].tokens.begin(), loaded[tokens[t.tokens[i]].cause].tokens.end());
-			t.output_marking.insert(t.output_marking.end(), loaded[tokens[t.tokens[i]].cause].output_marking.begin(), loaded[tokens[t.tokens[i]].cause].output_marking.end());
-			visited.push_back(tokens[t.tokens[i]].cause);
+	// The transitions in the fired transition's chain are found by walking the
+	// cause DAG, and the tokens they consume are its closure.
+	visited.assign(1, fired);
+	reached.resize(loaded.size());
+	reached.clear();
+	reached.set(fired);
+	for (int v = 0; v < (int)visited.size(); v++) {
+		for (int c : causesOf(visited[v])) {
+			if (c < fired and not reached.test(c)) {
+				reached.set(c);
+				visited.push_back(c);
+				t.output_marking.insert(t.output_marking.end(), loaded[c].output_marking.begin(), loaded[c].output_marking.end());
+			}
 		}
 	}
 
-	sort(t.tokens.begin(), t.tokens.end());
-	t.tokens.resize(unique(t.tokens.begin(), t.tokens.end()) - t.tokens.begin());
+	t.tokens.clear();
+	for (size_t k = closure[fired].next(0); k < closure[fired].bits; k = closure[fired].next(k+1)) {
+		t.tokens.push_back((int)k);
+	}
 	sort(t.output_marking.begin(), t.output_marking.end());
 	t.output_marking.resize(unique(t.output_marking.begin(), t.output_marking.end()) - t.output_marking.begin());
-	sort(visited.begin(), visited.end());
 
+	// disable any transitions that were dependent on at least one of the same tokens
+	// This is only necessary to check for unstable transitions in the enabled() function
+	// Only the bits of the fired transition's tokens are set, and they're
+	// reset again once the overlaps are found, so these sets are never
+	// cleared or rebuilt in full.
+	firedSet.resize(tokens.size());
+	arbiterSet.resize(tokens.size());
+	for (int k : t.tokens) {
+		firedSet.set(k);
+		if (base->places[tokens[k].index].arbiter) {
+			arbiterSet.set(k);
+		}
+	}
+
+	// Another transition overlaps with t if it consumes one of t's tokens,
+	// itself or through a cause that isn't in t's chain. Causes come before
+	// the transitions they cause, so this is settled in one pass that only
+	// looks at the tokens each transition consumes directly.
+	conflicts.assign(loaded.size(), 0);
 	for (int i = 0; i < (int)loaded.size(); i++) {
-		if (find(visited.begin(), visited.end(), i) == visited.end()) {
-			for (int j = 0; j < (int)loaded[i].tokens.size(); j++) {
-				if (tokens[loaded[i].tokens[j]].cause >= 0
-				  and tokens[loaded[i].tokens[j]].cause < i
-				  and find(visited.begin(), visited.end(), tokens[loaded[i].tokens[j]].cause) == visited.end()) {
-					loaded[i].tokens.insert(loaded[i].tokens.end(), loaded[tokens[loaded[i].tokens[j]].cause].tokens.begin(), loaded[tokens[loaded[i].tokens[j]].cause].tokens.end());
-				}
-			}
+		if (i == fired) {
+			continue;
+		}
 
-			sort(loaded[i].tokens.begin(), loaded[i].tokens.end());
-			loaded[i].tokens.resize(unique(loaded[i].tokens.begin(), loaded[i].tokens.end()) - loaded[i].tokens.begin());
+		int found = 0;
+		for (int k : loaded[i].tokens) {
+			if (firedSet.test(k)) {
+				found |= arbiterSet.test(k) ? (OVERLAPS | ARBITRATED) : OVERLAPS;
+			}
+		}
+		for (int c : causesOf(i)) {
+			if (not reached.test(c)) {
+				found |= conflicts[c];
+			}
 		}
+		conflicts[i] = found;
 	}
 
-	// disable any transitions that were dependent on at least one of the same tokens
-	// This is only necessary to check for unstable transitions in the enabled() function
+	for (int k : t.tokens) {
+		firedSet.reset(k);
+		arbiterSet.reset(k);
+	}
+
+	erased.assign(loaded.size(), 0);
+	erased[fired] = 1;
 	for (int i = (int)loaded.size()-1, j = ready.size()-1; i >= 0; i--)
 	{
-		vector<int> intersect = vector_intersection(loaded[i].tokens, t.tokens);
-		if (intersect.size() > 0)
+		if (i == fired) {
+			continue;
+		}
+
+		bool is_deterministic = (conflicts[i] & ARBITRATED) == 0;
+		if (conflicts[i] & OVERLAPS)
 		{
 			// ASSUME ready array is sorted in ascending order
 			bool is_effective = false;
 			for (; j >= 0 and not is_effective; j--)
 				is_effective = (ready[j].first == i);
 
-			bool is_deterministic = true;
-			for (int k = 0; k < (int)intersect.size() and is_deterministic; k++)
-				is_deterministic = not base->places[tokens[intersect[k]].index].arbiter;
-
 			if (is_effective and is_deterministic and loaded[i].index != t.index)
 			{
-				cout << "Intersect: (";
-				for (int l = 0; l < (int)intersect.size(); l++)
-					cout << tokens[intersect[l]].index << " ";
-				cout << ")";
-				cout << "Arbiters: (";
-				for (int l = 0; l < (int)intersect.size(); l++) {
-					if (base->places[tokens[intersect[l]].index].arbiter) {
-						cout << tokens[intersect[l]].index << " ";
-					}
-				}
-				cout << ")";
-				mutex err = mutex(t, loaded[i]);
-				vector<mutex>::iterator loc = lower_bound(mutex_errors.begin(), mutex_errors.end(), err);
-				if (loc == mutex_errors.end() or *loc != err)
-				{
-					mutex_errors.insert(loc, err);
-					error("", err.to_string(*base), __FILE__, __LINE__);
-				}
+				enabled_transition other = loaded[i];
+				history.firings(other.since, other.history);
+				report(mutex(t, other));
 			}
 
-			loaded.erase(loaded.begin() + i);
+			erased[i] = 1;
+		}
+	}
+
+	int kept = 0;
+	for (int i = 0; i < (int)loaded.size(); i++) {
+		if (not erased[i]) {
+			if (kept != i) {
+				loaded.write(kept) = std::move(loaded.write(i));
+			}
+			kept++;
 		}
 	}
+	loaded.resize(kept);
+	closed = 0;
 
 	ready.clear();
 
 	// take the set symmetric difference, but leave the two sets separate.
-	for (int j = 0, k = 0; j < (int)t.tokens.size() and k < (int)t.output_marking.size(); ) {
-		if (t.tokens[j] == t.output_marking[k]) {
-			t.tokens.erase(t.tokens.begin() + j);
-			t.output_marking.erase(t.output_marking.begin() + k);
-		} else if (t.tokens[j] > t.output_marking[k]) {
-			k++;
-		} else if (t.tokens[j] < t.output_marking[k]) {
+	// Both are sorted, so this is a single merge that compacts each in place.
+	int nt = 0, no = 0;
+	for (int j = 0, k = 0; j < (int)t.tokens.size() or k < (int)t.output_marking.size(); ) {
+		if (k >= (int)t.output_marking.size() or (j < (int)t.tokens.size() and t.tokens[j] < t.output_marking[k])) {
+			t.tokens[nt++] = t.tokens[j++];
+		} else if (j >= (int)t.tokens.size() or t.tokens[j] > t.output_marking[k]) {
+			t.output_marking[no++] = t.output_marking[k++];
+		} else {
 			j++;
+			k++;
 		}
 	}
+	t.tokens.resize(nt);
+	t.output_marking.resize(no);
 
 	// Check to see if this transition is unstable
 	if (not t.stable and not t.vacuous) {
-		instability err = instability(t);
-		vector<instability>::iterator loc = lower_bound(instability_errors.begin(), instability_errors.end(), err);
-		if (loc == instability_errors.end() or *loc != err) {
-			instability_errors.insert(loc, err);
-			error("", err.to_string(*base), __FILE__, __LINE__);
-		}
+		report(instability(t));
 	}
 
-	// Update the tokens
+	// Update the tokens. The consumed tokens and the tokens of transitions
+	// that didn't fire are removed in a single pass. t.tokens is sorted.
 	for (int i = 0; i < (int)t.output_marking.size(); i++) {
-		tokens[t.output_marking[i]].cause = -1;
-	}
-
-	sort(t.tokens.begin(), t.tokens.end());
-	for (int i = t.tokens.size()-1; i >= 0; i--) {
-		tokens.erase(tokens.begin() + t.tokens[i]);
+		tokens.write(t.output_marking[i]).cause = -1;
 	}
 
-	for (int i = tokens.size()-1; i >= 0; i--) {
-		if (tokens[i].cause >= 0) {
-			tokens.erase(tokens.begin() + i);
+	kept = 0;
+	for (int i = 0, r = 0; i < (int)tokens.size(); i++) {
+		if (r < (int)t.tokens.size() and t.tokens[r] == i) {
+			r++;
+		} else if (tokens[i].cause < 0) {
+			if (kept != i) {
+				tokens.write(kept) = std::move(tokens.write(i));
+			}
+			kept++;
 		}
 	}
+	tokens.resize(kept);
 
 	// Restrict the state with the guard
 	if (t.stable and not t.vacuous) {
@@ -615,85 +952,213 @@ enabled_transition simulator::fire(int index)
 
 	// Check for interfering transitions. Interfering transitions are the active
 	// transitions that have fired since this active transition was enabled.
-	for (int j = 0; j < (int)t.history.size(); j++) {
-		arithmetic::State historical_action = base->term(t.history[j]).evaluate(encoding).remote(base->remote_groups());
-		if (arithmetic::areInterfering(t.remote_action[term], historical_action))
+	// Only the ones that assigned a variable this transition assigns can
+	// interfere with it, so we follow the history's chains of writers for just
+	// those variables. Firings that assigned none of them are skipped, which
+	// doesn't change the result since neither areInterfering() nor interfere()
+	// has anything to do for them.
+	//
+	// Their remote actions were cached when they fired. This does differ from
+	// evaluating each term again against the current encoding: a firing is
+	// compared by the values it actually wrote, not by what its expressions
+	// would produce now.
+	history.writers(t.remote_action[term], t.since, writers);
+	CHP_COUNT(INTERFERENCE_CHECKS, writers.size());
+	for (int slot : writers) {
+		const firing &h = history[slot];
+		if (arithmetic::areInterfering(t.remote_action[term], h.remote_action))
 		{
-			interference err(term_index(t.index, term), t.history[j]);
-			vector<interference>::iterator loc = lower_bound(interference_errors.begin(), interference_errors.end(), err);
-			if (loc == interference_errors.end() or *loc != err)
-			{
-				interference_errors.insert(loc, err);
-				error("", err.to_string(*base), __FILE__, __LINE__);
-			}
+			report(interference(term_index(t.index, term), h.index));
 		}
 
-		t.local_action[term] = arithmetic::interfere(t.local_action[term], historical_action);
-		t.remote_action[term] = arithmetic::interfere(t.remote_action[term], historical_action);
+		t.local_action[term] = arithmetic::interfere(t.local_action[term], h.remote_action);
+		t.remote_action[term] = arithmetic::interfere(t.remote_action[term], h.remote_action);
 	}
 
 	// Update the state
 	global = localAssign(global, t.remote_action[term], t.stable);
 	encoding = remoteAssign(localAssign(encoding, t.local_action[term], t.stable), global, true);
 
-	// Update the history. The first thing we need to do is remove any assignments that no longer
-	// have any effect on the global state. So we remove history items where all of the terms
-	// in their assignments are conflicting with terms in more recent assignments.
-	arithmetic::State m = t.local_action[term].mask();
-	for (list<firing>::reverse_iterator i = history.rbegin(); i != history.rend();) {
-		if (i->local_action.mask(m).isTautology()) {
-			i++;
-			i = list<firing>::reverse_iterator(history.erase(i.base()));
+	// Add the latest firing to the history. Any earlier firing whose
+	// assignments have all been overwritten no longer has any effect on the
+	// global state, and is released once no enabled transition could still
+	// interfere with it.
+	history.push(firing(t, term));
+
+	// Every firing since the oldest loaded transition was enabled is kept, so
+	// that its history can be rebuilt in full if it turns out to be unstable.
+	uint64_t keep = history.next;
+	for (int i = 0; i < (int)loaded.size(); i++) {
+		keep = std::min(keep, loaded[i].since);
+	}
+	history.trim(keep);
+
+	if (not observers.empty()) {
+		for (observer *o : observers) {
+			o->fired(*this, index, term_index(t.index, term));
+		}
+	}
+
+	return t;
+}
+
+/**
+ * @brief Record an error the first time it is found
+ *
+ * The error is passed to the sink if there is one. Otherwise it is formatted
+ * and reported with error(). Errors that were already recorded cost a hash
+ * lookup and nothing else.
+ */
+void simulator::report(const instability &err)
+{
+	if (instability_seen.insert(err).second) {
+		instability_errors.push_back(err);
+		dirty |= ERRORS;
+		if (sink != NULL) {
+			sink->unstable(*this, instability_errors.back());
 		} else {
-			m = m.combineMask(i->local_action.mask());
-			i++;
+			error("", instability_errors.back().to_string(*base), __FILE__, __LINE__);
 		}
 	}
+}
 
-	// Add the latest firing to the history.
-	history.push_back(firing(t, term));
-	
-	for (int i = 0; i < (int)loaded.size(); i++) {
-		loaded[i].history.push_back(term_index(t.index, term));
+void simulator::report(const interference &err)
+{
+	if (interference_seen.insert(err).second) {
+		interference_errors.push_back(err);
+		dirty |= ERRORS;
+		if (sink != NULL) {
+			sink->interfering(*this, interference_errors.back());
+		} else {
+			error("", interference_errors.back().to_string(*base), __FILE__, __LINE__);
+		}
 	}
+}
 
-	return t;
+void simulator::report(const mutex &err)
+{
+	if (mutex_seen.insert(err).second) {
+		mutex_errors.push_back(err);
+		dirty |= ERRORS;
+		if (sink != NULL) {
+			sink->nonexclusive(*this, mutex_errors.back());
+		} else {
+			error("", mutex_errors.back().to_string(*base), __FILE__, __LINE__);
+		}
+	}
 }
 
+/**
+ * @brief Add the errors found by another simulator to this one
+ *
+ * The errors are appended in the order sim found them, skipping the ones
+ * this simulator already has. They aren't reported again.
+ */
 void simulator::merge_errors(const simulator &sim)
 {
-	if (instability_errors.size() > 0)
-	{
-		vector<instability> old_instability_errors;
-		swap(instability_errors, old_instability_errors);
-		instability_errors.resize(old_instability_errors.size() + sim.instability_errors.size());
-		merge(sim.instability_errors.begin(), sim.instability_errors.end(), old_instability_errors.begin(), old_instability_errors.end(), instability_errors.begin());
-		instability_errors.resize(unique(instability_errors.begin(), instability_errors.end()) - instability_errors.begin());
+	for (const instability &err : sim.instability_errors) {
+		if (instability_seen.insert(err).second) {
+			instability_errors.push_back(err);
+			dirty |= ERRORS;
+		}
 	}
-	else
-		instability_errors = sim.instability_errors;
 
-	if (interference_errors.size() > 0)
-	{
-		vector<interference> old_interference_errors;
-		swap(interference_errors, old_interference_errors);
-		interference_errors.resize(sim.interference_errors.size() + old_interference_errors.size());
-		merge(sim.interference_errors.begin(), sim.interference_errors.end(), old_interference_errors.begin(), old_interference_errors.end(), interference_errors.begin());
-		interference_errors.resize(unique(interference_errors.begin(), interference_errors.end()) - interference_errors.begin());
+	for (const interference &err : sim.interference_errors) {
+		if (interference_seen.insert(err).second) {
+			interference_errors.push_back(err);
+			dirty |= ERRORS;
+		}
 	}
-	else
-		interference_errors = sim.interference_errors;
 
-	if (mutex_errors.size() > 0)
-	{
-		vector<mutex> old_mutex_errors;
-		swap(mutex_errors, old_mutex_errors);
-		mutex_errors.resize(sim.mutex_errors.size() + old_mutex_errors.size());
-		merge(sim.mutex_errors.begin(), sim.mutex_errors.end(), old_mutex_errors.begin(), old_mutex_errors.end(), mutex_errors.begin());
-		mutex_errors.resize(unique(mutex_errors.begin(), mutex_errors.end()) - mutex_errors.begin());
+	for (const mutex &err : sim.mutex_errors) {
+		if (mutex_seen.insert(err).second) {
+			mutex_errors.push_back(err);
+			dirty |= ERRORS;
+		}
 	}
-	else
-		mutex_errors = sim.mutex_errors;
+}
+
+/**
+ * @brief Sort the error lists
+ *
+ * Errors are recorded in the order they are found, which depends on the
+ * order of the firings. Sorted lists can be compared across runs and are
+ * in the order they used to be kept in.
+ */
+void simulator::sort_errors()
+{
+	sort(instability_errors.begin(), instability_errors.end());
+	sort(interference_errors.begin(), interference_errors.end());
+	sort(mutex_errors.begin(), mutex_errors.end());
+	dirty |= ERRORS;
+}
+
+/**
+ * @brief Save the current state
+ *
+ * Only the parts that changed since the last snapshot or restore are copied,
+ * everything else is shared with the previous snapshot. The chunked parts
+ * only copy their chunk pointers.
+ */
+snapshot simulator::snapshot()
+{
+	if (dirty & ERRORS or saved.instability_errors == nullptr) {
+		saved.instability_errors = std::make_shared<const vector<instability> >(instability_errors);
+		saved.interference_errors = std::make_shared<const vector<interference> >(interference_errors);
+		saved.mutex_errors = std::make_shared<const vector<mutex> >(mutex_errors);
+	}
+	saved.history = history;
+	if (dirty & ENCODING or saved.encoding == nullptr) {
+		saved.encoding = std::make_shared<const arithmetic::State>(encoding);
+		saved.global = std::make_shared<const arithmetic::State>(global);
+	}
+	saved.tokens = tokens;
+	saved.loaded = loaded;
+	if (dirty & READY or saved.ready == nullptr) {
+		saved.ready = std::make_shared<const vector<pair<int, int> > >(ready);
+	}
+	saved.now = now;
+	dirty = 0;
+	return saved;
+}
+
+/**
+ * @brief Return to a saved state
+ *
+ * Parts that are unchanged and shared with s aren't copied, and the chunked
+ * parts only copy their chunk pointers. The snapshot must have been taken
+ * from a simulator of the same graph.
+ */
+void simulator::restore(const chp::snapshot &s)
+{
+	if (s.instability_errors == nullptr) {
+		return;
+	}
+
+	if (dirty & ERRORS or s.instability_errors != saved.instability_errors
+	  or s.interference_errors != saved.interference_errors
+	  or s.mutex_errors != saved.mutex_errors) {
+		instability_errors = *s.instability_errors;
+		interference_errors = *s.interference_errors;
+		mutex_errors = *s.mutex_errors;
+		instability_seen = std::unordered_set<instability, errorHash>(instability_errors.begin(), instability_errors.end());
+		interference_seen = std::unordered_set<interference, errorHash>(interference_errors.begin(), interference_errors.end());
+		mutex_seen = std::unordered_set<mutex, errorHash>(mutex_errors.begin(), mutex_errors.end());
+	}
+	history = s.history;
+	if (dirty & ENCODING or s.encoding != saved.encoding or s.global != saved.global) {
+		encoding = *s.encoding;
+		global = *s.global;
+	}
+	tokens = s.tokens;
+	loaded = s.loaded;
+	if (dirty & READY or s.ready != saved.ready) {
+		ready = *s.ready;
+	}
+	now = s.now;
+	saved = s;
+	closed = 0;
+	dirty = 0;
 }
 
 state simulator::get_state()
@@ -721,32 +1186,23 @@ state simulator::get_key()
 	return result;
 }
 
+/**
+ * @brief Find the pairs of ready transitions that compete for a token
+ *
+ * Each loaded transition's transitive token set, the tokens it consumes
+ * directly and through the vacuous transitions that caused them, is its
+ * closure from closeTokens(). The set of loaded transitions on its path is a
+ * bitvector built there the same way over the cause DAG. Comparing two
+ * transitions is then a word-parallel intersection.
+ */
 vector<pair<int, int> > simulator::get_choices()
 {
 	vector<pair<int, int> > result;
-	vector<vector<int> > tree;
-	vector<vector<int> > visited;
 
-	for (int i = 0; i < (int)loaded.size(); i++)
-	{
-		tree.push_back(loaded[i].tokens);
-		visited.push_back(vector<int>(1, i));
-	}
-
-	for (int i = 0; i < (int)tree.size(); i++)
-	{
-		int tsize = (int)tree[i].size();
-		for (int j = 0; j < tsize; j++) {
-			if (tokens[tree[i][j]].cause >= 0 and tokens[tree[i][j]].cause < i) {
-				tree[i].insert(tree[i].end(), tree[tokens[tree[i][j]].cause].begin(), tree[tokens[tree[i][j]].cause].end());
-				visited[i].insert(visited[i].end(), visited[tokens[tree[i][j]].cause].begin(), visited[tokens[tree[i][j]].cause].end());
-			}
-		}
-
-		sort(tree[i].begin(), tree[i].end());
-		tree[i].resize(unique(tree[i].begin(), tree[i].end()) - tree[i].begin());
-		sort(visited[i].begin(), visited[i].end());
-		visited[i].resize(unique(visited[i].begin(), visited[i].end()) - visited[i].begin());
+	size_t n = loaded.size();
+	if (closed != (int)n) {
+		closed = 0;
+		closeTokens(loaded);
 	}
 
 	vector<int> lindices;
@@ -755,22 +1211,30 @@ vector<pair<int, int> > simulator::get_choices()
 	sort(lindices.begin(), lindices.end());
 	lindices.resize(unique(lindices.begin(), lindices.end()) - lindices.begin());
 
+	bitvector expanded(n);
+	vector<int> stack;
 	for (int i = 0; i < (int)lindices.size(); i++)
 		for (int j = i+1; j < (int)lindices.size(); j++)
 		{
-			vector<int> temp = loaded[lindices[j]].tokens;
-			for (int k = 0; k < (int)temp.size(); k++) {
-				if (tokens[temp[k]].cause >= 0
-				  and tokens[temp[k]].cause < lindices[j]
-				  and find(visited[i].begin(), visited[i].end(), tokens[temp[k]].cause) == visited[i].end()) {
-					temp.insert(temp.end(), loaded[tokens[temp[k]].cause].tokens.begin(), loaded[tokens[temp[k]].cause].tokens.end());
+			// Follow the causes of j's tokens, skipping the transitions on i's path
+			intersect = tokenSets[lindices[j]];
+			expanded.clear();
+			stack.assign(1, lindices[j]);
+			while (not stack.empty()) {
+				int x = stack.back();
+				stack.pop_back();
+				for (int c : causesOf(x)) {
+					if (c < lindices[j]
+					  and not visitedSets[lindices[i]].test(c)
+					  and not expanded.test(c)) {
+						expanded.set(c);
+						intersect |= tokenSets[c];
+						stack.push_back(c);
+					}
 				}
 			}
 
-			sort(temp.begin(), temp.end());
-			temp.resize(unique(temp.begin(), temp.end()) - temp.begin());
-
-			if (vector_intersects(tree[lindices[i]], temp))
+			if (closure[lindices[i]].intersects(intersect))
 				result.push_back(pair<int, int>(lindices[i], lindices[j]));
 		}
 
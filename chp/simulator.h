@@ -1,8 +1,14 @@
 #pragma once
 
+#include <memory>
+#include <span>
+#include <unordered_set>
+
 #include <common/standard.h>
 #include <petri/state.h>
 #include <petri/simulator.h>
+#include "bitvector.h"
+#include "chunked.h"
 #include "graph.h"
 #include "state.h"
 
@@ -19,6 +25,7 @@ struct instability : enabled_transition
 	instability(const enabled_transition &cause);
 	~instability();
 
+	void print(ostream &os, const chp::graph &g) const;
 	string to_string(const chp::graph &g);
 };
 
@@ -32,6 +39,7 @@ struct interference : pair<term_index, term_index>
 	interference(const term_index &first, const term_index &second);
 	~interference();
 
+	void print(ostream &os, const chp::graph &g) const;
 	string to_string(const chp::graph &g);
 };
 
@@ -47,9 +55,21 @@ struct mutex : pair<enabled_transition, enabled_transition>
 	mutex(const enabled_transition &first, const enabled_transition &second);
 	~mutex();
 
+	void print(ostream &os, const chp::graph &g) const;
 	string to_string(const chp::graph &g);
 };
 
+// Hashes the error types consistently with their operator==, so that the
+// simulator can deduplicate errors with a hash set.
+struct errorHash
+{
+	size_t operator()(const term_index &t) const;
+	size_t operator()(const enabled_transition &t) const;
+	size_t operator()(const instability &e) const;
+	size_t operator()(const interference &e) const;
+	size_t operator()(const mutex &e) const;
+};
+
 // A deadlock occurs when we reach a state with no enabled transitions. This
 // means that the simulator has no way of making forward progress. Given a
 // latency of picoseconds on most of these transitions, a circuit specification
@@ -62,9 +82,72 @@ struct deadlock : state
 	deadlock(vector<token> tokens, arithmetic::State encodings);
 	~deadlock();
 
+	void print(ostream &os, const chp::graph &g) const;
 	string to_string(const chp::graph &g);
 };
 
+struct simulator;
+
+// An observer is notified at the end of every call to simulator::fire(),
+// once the state has been updated. choice is the index into
+// simulator::ready that was fired and t is the term that it selected.
+// Observers that override enabled() are also notified at the end of every
+// call to simulator::enabled(), once simulator::ready has been filled in.
+// Observers aren't owned by the simulator. When there aren't any, the only
+// cost to fire() is checking that the list is empty.
+struct observer
+{
+	observer();
+	virtual ~observer();
+
+	virtual void enabled(const simulator &sim);
+	virtual void fired(const simulator &sim, int choice, term_index t) = 0;
+};
+
+// An error sink receives each distinct error the first time the simulator
+// finds it. The error is passed as is, so a sink that only counts or collects
+// errors never pays to format them. Without a sink, the simulator formats the
+// error and reports it with error().
+struct errorSink
+{
+	errorSink();
+	virtual ~errorSink();
+
+	virtual void unstable(const simulator &sim, const instability &err) = 0;
+	virtual void interfering(const simulator &sim, const interference &err) = 0;
+	virtual void nonexclusive(const simulator &sim, const mutex &err) = 0;
+};
+
+// A saved simulator state. Every part is shared with the simulator that made
+// it, and with every other snapshot, until one of them changes that part.
+//
+// The tokens, the loaded transitions, and the arena and variable index of
+// the history are chunked, so they are shared chunk by chunk. Taking or
+// restoring a snapshot copies one pointer per chunk, and a step after that
+// only copies the chunks it writes. fire() writes the chunks from the first
+// transition or token it removes on, and the chunks of the history slots it
+// fills. enabled() evaluates every transition again, so it writes all of
+// loaded.
+//
+// The error lists, the encodings, and the ready transitions are shared as a
+// whole. They are copied only when they changed since the last snapshot.
+struct snapshot
+{
+	snapshot();
+	~snapshot();
+
+	std::shared_ptr<const vector<instability> > instability_errors;
+	std::shared_ptr<const vector<interference> > interference_errors;
+	std::shared_ptr<const vector<mutex> > mutex_errors;
+	history_ring history;
+	std::shared_ptr<const arithmetic::State> encoding;
+	std::shared_ptr<const arithmetic::State> global;
+	chunked<token> tokens;
+	chunked<enabled_transition> loaded;
+	std::shared_ptr<const vector<pair<int, int> > > ready;
+	uint64_t now;
+};
+
 // This keeps track of a single simulation of a set of HSE and makes it easy to
 // control that simulation either through an interactive interface or
 // programmatically.
@@ -80,14 +163,26 @@ struct simulator
 	// This simulator is also used for elaboration, so a lot of the errors we
 	// encounter may be encountered multiple times as the elaborator visits
 	// different versions of the same state. This record errors of different
-	// types to be deduplicated and displayed at the end of elaboration.
+	// types to be deduplicated and displayed at the end of elaboration. The
+	// errors are kept in the order they were found, not sorted, and the hash
+	// sets are used to check whether an error was already found. Call
+	// sort_errors() before reading them if the order matters, for example to
+	// compare the errors of two runs.
 	vector<instability> instability_errors;
 	vector<interference> interference_errors;
 	vector<mutex> mutex_errors;
+	std::unordered_set<instability, errorHash> instability_seen;
+	std::unordered_set<interference, errorHash> interference_seen;
+	std::unordered_set<mutex, errorHash> mutex_seen;
+
+	// Receives new errors as they are found. See errorSink. Not owned by the
+	// simulator.
+	errorSink *sink;
 
 	// This records the set of transitions in the order they were fired.
 	// Currently it is used to help with debugging (an instability happened and
-	// here is the list of transitions leading up to it).
+	// here is the list of transitions leading up to it), and to find the
+	// firings that may interfere with an enabled transition. See history_ring.
 
 	// However, there is also a question about the definition of instability.
 	// Technically, instability is defined with respect to the production rules,
@@ -101,7 +196,7 @@ struct simulator
 	// incorrect.
 
 	// See todo in simulator.cpp
-	list<firing> history;
+	history_ring history;
 
 	// Remember these pointers so that we do not have to include them as inputs
 	// to every simulation step. graph is the HSE we are simulating, and
@@ -148,8 +243,9 @@ struct simulator
 	// the program counters. While Petri Nets technically allow more than one
 	// token on a single place, our constrained adaptation of Petri Nets as a
 	// representation of HSE does not.
-	// See haystack/lib/chp/chp/state.h for the definition of token.
-	vector<token> tokens;
+	// See haystack/lib/chp/chp/state.h for the definition of token. This and
+	// loaded are chunked so that snapshots can share them, see chunked.
+	chunked<token> tokens;
 
 	// These transitions could be selected to fire next. An enabled transition is
 	// one in which all of the gates on the pull up or pull down network are
@@ -157,7 +253,7 @@ struct simulator
 	// the network of transistors. Because it has not yet fired, the output
 	// hasn't passed the threshold voltage yet, signalling its complete
 	// transition to the new value.
-	vector<enabled_transition> loaded;
+	chunked<enabled_transition> loaded;
 
 	// The ready array makes it easy to tell the elaborator and the user exactly
 	// how many enabled transitions there are and makes it easy to select them
@@ -168,10 +264,86 @@ struct simulator
 
 	uint64_t now;
 
+	// Scratch space for enabled() and fire(). These are members so that
+	// their memory is reused from one step to the next instead of being
+	// allocated again.
+	vector<enabled_transition> preload;
+	vector<enabled_transition> potential;
+	vector<int> disabled;
+	vector<int> global_disabled;
+	vector<int> erased;
+	vector<int> visited;
+	vector<int> writers;
+	vector<int> conflicts;
+	bitvector firedSet;
+	bitvector arbiterSet;
+	bitvector intersect;
+	bitvector reached;
+	vector<int> matching_tokens;
+	vector<int> order;
+	vector<token> moved;
+
+	// Vacuous transitions produce tokens that are consumed by the transitions
+	// after them, so the transitions in the pool form a DAG where every cause
+	// comes before the transitions it causes. For the first 'closed'
+	// transitions, closure[i] is the set of tokens consumed by transition i
+	// and all of its causes, and causesOf(i) lists its direct causes. Each
+	// closure is computed once from the closures of its causes instead of
+	// walking the chain again every time it's needed. tokenSets[i] holds the
+	// tokens that i consumes directly and visitedSets[i] the transitions on
+	// its path, which are kept alongside the closures in the same way.
+	vector<bitvector> closure;
+	vector<bitvector> tokenSets;
+	vector<bitvector> visitedSets;
+	vector<int> causeBegin;
+	vector<int> causeList;
+	int closed;
+
+	// The places after each transition, with those of transition t at
+	// outputList[outputBegin[t]] up to outputBegin[t+1], and the guard of
+	// each transition ANDed with the guard of its action. These only depend
+	// on the graph, so enabled() builds them once. See indexGraph().
+	vector<int> outputBegin;
+	vector<int> outputList;
+	vector<arithmetic::Expression> guards;
+
+	// Trace recorders, waveform writers, and the like. See observer.
+	vector<observer*> observers;
+
+	// The parts of the state that have changed since the last snapshot or
+	// restore. enabled() and fire() keep this up to date. Anything else that
+	// writes to the members above must set the matching bits. The chunked
+	// parts don't need a bit since their chunks are shared either way.
+	enum {
+		ERRORS = 1<<0,
+		ENCODING = 1<<1,
+		READY = 1<<2,
+		ALL = (1<<3)-1
+	};
+	uint32_t dirty;
+
+	// The snapshot that the unchanged parts are shared with.
+	chp::snapshot saved;
+
 	int enabled(bool sorted = false);
 	enabled_transition fire(int index);
 
+	void indexGraph();
+	std::span<const int> outputsOf(int t) const;
+	// The pool is either preload or loaded. This is only used in
+	// simulator.cpp, where it is defined.
+	template <typename Pool>
+	void closeTokens(const Pool &pool);
+	std::span<const int> causesOf(int i) const;
+
+	chp::snapshot snapshot();
+	void restore(const chp::snapshot &s);
+
+	void report(const instability &err);
+	void report(const interference &err);
+	void report(const mutex &err);
 	void merge_errors(const simulator &sim);
+	void sort_errors();
 	state get_state();
 	state get_key();
 	vector<pair<int, int> > get_choices();
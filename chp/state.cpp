@@ -5,6 +5,8 @@
  *      Author: nbingham
  */
 
+#include <sstream>
+
 #include <common/text.h>
 #include "state.h"
 #include "graph.h"
@@ -42,9 +44,19 @@ void term_index::hash(hasher &hash) const
 	hash.put(&term);
 }
 
+void term_index::print(ostream &os, const graph &g) const
+{
+	os << "T" << index << "." << term << ":";
+	emit_expression(os, g.transitions[index].guard, g);
+	os << " -> ";
+	emit_composition(os, g.transitions[index].action[term], g);
+}
+
 string term_index::to_string(const graph &g)
 {
-	return "T" + ::to_string(index) + "." + ::to_string(term) + ":" + emit_expression(g.transitions[index].guard, g) + " -> " + emit_composition(g.transitions[index].action[term], g);
+	ostringstream os;
+	print(os, g);
+	return os.str();
 }
 
 bool operator<(term_index i, term_index j)
@@ -89,6 +101,7 @@ enabled_transition::enabled_transition()
 	guard = arithmetic::Expression::vdd();
 	depend = arithmetic::Expression::vdd();
 	fire_at = 0;
+	since = 0;
 }
 
 enabled_transition::enabled_transition(int index)
@@ -99,6 +112,7 @@ enabled_transition::enabled_transition(int index)
 	guard = arithmetic::Expression::vdd();
 	depend = arithmetic::Expression::vdd();
 	fire_at = 0;
+	since = 0;
 }
 
 enabled_transition::enabled_transition(int index, int term)
@@ -109,6 +123,7 @@ enabled_transition::enabled_transition(int index, int term)
 	guard = arithmetic::Expression::vdd();
 	depend = arithmetic::Expression::vdd();
 	fire_at = 0;
+	since = 0;
 }
 
 enabled_transition::~enabled_transition()
@@ -116,56 +131,198 @@ enabled_transition::~enabled_transition()
 
 }
 
+void enabled_transition::print(ostream &os, const graph &g) const
+{
+	os << "T" << index << ":";
+	emit_expression(os, g.transitions[index].guard, g);
+	os << " -> ";
+	emit_composition(os, g.transitions[index].action, g);
+}
+
 string enabled_transition::to_string(const graph &g)
 {
-	return "T" + ::to_string(index) + ":" + emit_expression(g.transitions[index].guard, g) + " -> " + emit_composition(g.transitions[index].action, g);
+	ostringstream os;
+	print(os, g);
+	return os.str();
 }
 
-bool operator<(enabled_transition i, enabled_transition j)
+bool operator<(const enabled_transition &i, const enabled_transition &j)
 {
 	return (i.index < j.index) or
 		   (i.index == j.index and i.history < j.history);
 }
 
-bool operator>(enabled_transition i, enabled_transition j)
+bool operator>(const enabled_transition &i, const enabled_transition &j)
 {
 	return (i.index > j.index) or
 		   (i.index == j.index and i.history > j.history);
 }
 
-bool operator<=(enabled_transition i, enabled_transition j)
+bool operator<=(const enabled_transition &i, const enabled_transition &j)
 {
 	return (i.index < j.index) or
 		   (i.index == j.index and i.history <= j.history);
 }
 
-bool operator>=(enabled_transition i, enabled_transition j)
+bool operator>=(const enabled_transition &i, const enabled_transition &j)
 {
 	return (i.index > j.index) or
 		   (i.index == j.index and i.history >= j.history);
 }
 
-bool operator==(enabled_transition i, enabled_transition j)
+bool operator==(const enabled_transition &i, const enabled_transition &j)
 {
 	return (i.index == j.index and i.history == j.history);
 }
 
-bool operator!=(enabled_transition i, enabled_transition j)
+bool operator!=(const enabled_transition &i, const enabled_transition &j)
 {
 	return (i.index != j.index or i.history != j.history);
 }
 
+firing::firing() {
+	seq = history_ring::NONE;
+	live = 0;
+}
+
 firing::firing(const enabled_transition &t, int i) {
 	this->guard_action = t.guard_action;
 	this->local_action = t.local_action[i];
 	this->remote_action = t.remote_action[i];
 	this->index.index = t.index;
 	this->index.term = i;
+	this->seq = history_ring::NONE;
+	this->live = 0;
 }
 
 firing::~firing() {
 }
 
+history_ring::history_ring() {
+	next = 0;
+	window = 0;
+}
+
+history_ring::~history_ring() {
+}
+
+const firing &history_ring::operator[](int slot) const {
+	return arena[slot];
+}
+
+bool history_ring::contains(history_ref ref) const {
+	return ref.slot >= 0 and ref.slot < (int)arena.size() and arena[ref.slot].seq == ref.seq;
+}
+
+size_t history_ring::size() const {
+	return arena.size() - freed.size();
+}
+
+/**
+ * @brief Add a firing to the history
+ *
+ * Each variable assigned by the firing's remote action is linked to its
+ * previous writer, which loses one live variable. A previous writer that
+ * is left with none is released if it is outside the window.
+ */
+uint64_t history_ring::push(const firing &f) {
+	int slot;
+	if (not freed.empty()) {
+		slot = freed.back();
+		freed.pop_back();
+	} else {
+		slot = arena.size();
+		arena.push_back(firing());
+	}
+
+	firing &r = arena.write(slot);
+	r = f;
+	r.seq = next++;
+	r.vars.clear();
+	r.prev.clear();
+	r.live = 0;
+
+	const vector<arithmetic::Value> &values = r.remote_action.values;
+	for (int v = 0; v < (int)values.size(); v++) {
+		if (values[v].isUnknown()) {
+			continue;
+		}
+
+		if (v >= (int)last.size()) {
+			last.resize(v+1, history_ref{-1, NONE});
+		}
+		history_ref p = last[v];
+		r.vars.push_back(v);
+		r.prev.push_back(p);
+		if (contains(p) and --arena.write(p.slot).live == 0 and p.seq < window) {
+			release(p.slot);
+		}
+		last.write(v) = history_ref{slot, r.seq};
+		r.live++;
+	}
+
+	recent.push_back(slot);
+	return arena[slot].seq;
+}
+
+void history_ring::trim(uint64_t keep) {
+	keep = std::min(keep, next);
+	while (not recent.empty() and arena[recent.front()].seq < keep) {
+		int slot = recent.front();
+		recent.pop_front();
+		if (arena[slot].live == 0) {
+			release(slot);
+		}
+	}
+	window = std::max(window, keep);
+}
+
+void history_ring::writers(const arithmetic::State &action, uint64_t since, vector<int> &slots) const {
+	slots.clear();
+	const vector<arithmetic::Value> &values = action.values;
+	for (int v = 0; v < (int)values.size() and v < (int)last.size(); v++) {
+		if (values[v].isUnknown()) {
+			continue;
+		}
+
+		history_ref p = last[v];
+		while (p.seq >= since and contains(p)) {
+			const firing &f = arena[p.slot];
+			slots.push_back(p.slot);
+			size_t k = find(f.vars.begin(), f.vars.end(), v) - f.vars.begin();
+			p = f.prev[k];
+		}
+	}
+
+	sort(slots.begin(), slots.end(), [this](int a, int b) {
+		return arena[a].seq < arena[b].seq;
+	});
+	slots.resize(unique(slots.begin(), slots.end()) - slots.begin());
+}
+
+void history_ring::firings(uint64_t since, vector<term_index> &result) const {
+	result.clear();
+	for (int slot : recent) {
+		if (arena[slot].seq >= since) {
+			result.push_back(arena[slot].index);
+		}
+	}
+}
+
+void history_ring::release(int slot) {
+	arena.write(slot) = firing();
+	freed.push_back(slot);
+}
+
+void history_ring::clear() {
+	arena.clear();
+	freed.clear();
+	recent.clear();
+	last.clear();
+	next = 0;
+	window = 0;
+}
+
 token::token()
 {
 	index = 0;
@@ -271,17 +428,24 @@ bool state::is_subset_of(const state &s)
 	return (tokens == s.tokens and encodings.isSubsetOf(s.encodings));
 }
 
-string state::to_string(const graph &g)
+void state::print(ostream &os, const graph &g) const
 {
-	string result = "{";
+	os << "{";
 	for (int i = 0; i < (int)tokens.size(); i++)
 	{
 		if (i != 0)
-			result += " ";
-		result += ::to_string(tokens[i].index);
+			os << " ";
+		os << tokens[i].index;
 	}
-	result += "} " + emit_composition(encodings, g);
-	return result;
+	os << "} ";
+	emit_composition(os, encodings, g);
+}
+
+string state::to_string(const graph &g)
+{
+	ostringstream os;
+	print(os, g);
+	return os.str();
 }
 
 ostream &operator<<(ostream &os, state s)
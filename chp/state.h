@@ -1,11 +1,15 @@
 #pragma once
 
+#include <deque>
+
 #include <common/standard.h>
 #include <arithmetic/action.h>
 #include <arithmetic/expression.h>
 #include <petri/state.h>
 #include <petri/graph.h>
 
+#include "chunked.h"
+
 namespace chp
 {
 
@@ -26,6 +30,7 @@ struct term_index
 
 	void hash(hasher &hash) const;
 
+	void print(ostream &os, const graph &g) const;
 	string to_string(const graph &g);
 };
 
@@ -55,10 +60,13 @@ struct enabled_transition : petri::enabled_transition
 	// of those output tokens.
 	vector<int> output_marking;
 
-	// An enabled transition's history keeps track of every transition that fired
-	// between when this transition was enabled and when it fires. This allows us
-	// to determine whether this transition was stable and non-interfering when
-	// we finally decide to let the event fire.
+	// An enabled transition's history lists the transitions that fired
+	// between when this transition was enabled and when it fires. It
+	// describes instability and mutex errors and tells them apart. The
+	// simulator doesn't keep it up to date for every loaded transition.
+	// Instead it is rebuilt in full from the history_ring, starting at
+	// 'since', for the transition that fires and for the transitions in an
+	// error.
 	vector<term_index> history;
 	
 	// The intersection of all of the terms of the guard of this transition which
@@ -85,17 +93,33 @@ struct enabled_transition : petri::enabled_transition
 
 	uint64_t fire_at;
 
+	// The sequence number in the simulator's history_ring of the first firing
+	// after this transition was enabled. The firings from here on are the
+	// ones listed in history.
+	uint64_t since;
+
+	void print(ostream &os, const graph &g) const;
 	string to_string(const graph &g);
 };
 
-bool operator<(enabled_transition i, enabled_transition j);
-bool operator>(enabled_transition i, enabled_transition j);
-bool operator<=(enabled_transition i, enabled_transition j);
-bool operator>=(enabled_transition i, enabled_transition j);
-bool operator==(enabled_transition i, enabled_transition j);
-bool operator!=(enabled_transition i, enabled_transition j);
+bool operator<(const enabled_transition &i, const enabled_transition &j);
+bool operator>(const enabled_transition &i, const enabled_transition &j);
+bool operator<=(const enabled_transition &i, const enabled_transition &j);
+bool operator>=(const enabled_transition &i, const enabled_transition &j);
+bool operator==(const enabled_transition &i, const enabled_transition &j);
+bool operator!=(const enabled_transition &i, const enabled_transition &j);
+
+// A reference to a firing in a history_ring. The slot may be reused by a
+// later firing, so the reference is only valid while the firing in the slot
+// still has the same sequence number.
+struct history_ref
+{
+	int slot;
+	uint64_t seq;
+};
 
 struct firing {
+	firing();
 	firing(const enabled_transition &t, int i);
 	~firing();
 
@@ -103,6 +127,80 @@ struct firing {
 	arithmetic::State local_action;
 	arithmetic::State remote_action;
 	term_index index;
+
+	// The sequence number of this firing. vars lists the variables assigned
+	// by remote_action and prev[k] is the firing that assigned vars[k] before
+	// this one. live counts the variables for which this is still the last
+	// firing to assign them. Once live reaches zero, this firing no longer
+	// has any effect on the global state.
+	uint64_t seq;
+	vector<int> vars;
+	vector<history_ref> prev;
+	int live;
+};
+
+// The firings of a simulation that may still matter, stored in an arena of
+// reusable slots. Every firing since 'window' is kept so that the
+// transitions that were enabled before it can check it for interference.
+// Older firings are only kept while they're live. Every variable points to
+// the last firing that assigned it, and each firing points to the previous
+// writer of each of its variables. So overwriting a variable and finding
+// the writers of a variable only touch that variable's chain.
+//
+// Variables are those of the firing's remote action, the assignments as the
+// rest of the process sees them. A firing is live while it is still the
+// last writer of one of them. This replaces pruning by the mask of the local
+// action: a firing whose remote assignments were all overwritten is dropped
+// even if its local action wasn't.
+//
+// The arena and last are chunked so that a copy of the ring, in a snapshot
+// for example, shares every chunk that a later firing doesn't touch. recent
+// and freed are bounded by the window and are copied in full.
+struct history_ring
+{
+	history_ring();
+	~history_ring();
+
+	static constexpr uint64_t NONE = ~(uint64_t)0;
+
+	chunked<firing> arena;
+	vector<int> freed;
+
+	// The slots of every firing since window, in order.
+	std::deque<int> recent;
+
+	// The sequence number of the next firing, and of the oldest firing that
+	// is kept whether or not it is live.
+	uint64_t next;
+	uint64_t window;
+
+	// last[v] is the last firing to assign variable v.
+	chunked<history_ref> last;
+
+	const firing &operator[](int slot) const;
+	bool contains(history_ref ref) const;
+
+	// The number of firings held in the arena.
+	size_t size() const;
+
+	// Add a firing and overwrite the variables it assigns. Returns its
+	// sequence number.
+	uint64_t push(const firing &f);
+
+	// Firings before keep are no longer needed for interference checks. The
+	// ones that are dead are released.
+	void trim(uint64_t keep);
+
+	// Find the slots of the firings since 'since' that assigned any variable
+	// assigned by action, in the order they fired.
+	void writers(const arithmetic::State &action, uint64_t since, vector<int> &slots) const;
+
+	// List every firing since 'since' in the order they fired. All of them
+	// are kept as long as since is at or after the window.
+	void firings(uint64_t since, vector<term_index> &result) const;
+
+	void release(int slot);
+	void clear();
 };
 
 // Tokens are like program counters, marking the position of the current state
@@ -150,6 +248,7 @@ struct state : petri::state<petri::token>
 	static state collapse(int index, const state &s);
 	state convert(map<petri::iterator, vector<petri::iterator> > translate) const;
 	bool is_subset_of(const state &s);
+	void print(ostream &os, const graph &g) const;
 	string to_string(const graph &g);
 };
 
@@ -1,15 +1,22 @@
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <queue>
 #include <ranges>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <arithmetic/algorithm.h>
+#include <chp/expression.h>
 #include <chp/graph.h>
+#include <chp/instrument.h>
 #include <chp/synthesize.h>
+#include <chp/width.h>
 #include <common/mapping.h>
+#include <common/message.h>
 #include <flow/func.h>
 
 using namespace std;
@@ -17,7 +24,7 @@ using namespace std;
 using arithmetic::Expression;
 using arithmetic::Operand;
 
-const size_t DATA_CHANNEL_WIDTH = 8;  //TODO: synthesize appropriate widths in SynthesisContext
+const size_t DATA_CHANNEL_WIDTH = 8;  // Used for channels driven by the environment, see SynthesisOptions::inferWidths
 
 namespace chp {
 
@@ -26,6 +33,14 @@ struct SynthesisContext {
 	flow::Func &func;
 	Mapping<int> &channels;  // Mapping from CHP variable indices to flow variable indices
 	bool debug;
+
+	// Inferred width of each CHP variable, or empty to use the default widths
+	vector<int> widths;
+
+	// The built-in ids of the calls in the action of each transition, in the
+	// order of Choice::terms and Parallel::actions. A transition can be on
+	// many predicated paths, so its calls are resolved once up front.
+	vector<vector<builtinTable> > calls;
 };
 
 std::ostream& operator<<(std::ostream &os, const SynthesisContext &c) {
@@ -48,8 +63,12 @@ arithmetic::Operand synthesizeChannelFromCHPVar(const string &chp_var_name, cons
 		}
 
 	} else {
-		//TODO: pipe appropriate width annotations via SynthesisContext
-		size_t channel_width = (!chp_var_name.empty() && chp_var_name.back() == 'c') ? 1 : DATA_CHANNEL_WIDTH;  // Hack for short-term testing
+		size_t channel_width = DATA_CHANNEL_WIDTH;
+		if (chp_var_idx < context.widths.size()) {
+			channel_width = context.widths[chp_var_idx];
+		} else if (!chp_var_name.empty() && chp_var_name.back() == 'c') {
+			channel_width = 1;  // Hack for short-term testing
+		}
 		flow_operand = context.func.pushNet(chp_var_name, flow::Type(flow::Type::FIXED, channel_width), purpose);
 		context.channels.set(chp_var_idx, flow_operand.index);
 
@@ -65,7 +84,9 @@ arithmetic::Operand synthesizeChannelFromCHPVar(const string &chp_var_name, cons
 
 
 // Crawl sub-expression for vars that represent Channel names, then categorize them for context.func
-void synthesizeChannelsInExpression(arithmetic::Expression &e, size_t condition_idx, SynthesisContext &context) {
+// If given, calls holds the built-in ids of e. Otherwise they are resolved
+// from the names.
+void synthesizeChannelsInExpression(arithmetic::Expression &e, ConditionBuffer &cond, const SynthesisContext &context, const builtinTable *calls=nullptr) {
 	//auto operand_is_var = [](const arithmetic::Operand& op) -> bool { return op.isVar(); };
 	//auto operand_to_net = [&g](const arithmetic::Operand& op) -> std::string { return context.g.netAt(op.index); };
 
@@ -73,38 +94,36 @@ void synthesizeChannelsInExpression(arithmetic::Expression &e, size_t condition_
 		const arithmetic::Operation &operation = *e.getExpr(operand.index);
 		if (operation.func != arithmetic::Operation::OpType::CALL) { continue; }  //TODO: other operations of interest?
 
-		std::string func_name = operation.operands[0].cnst.sval;
-		//TODO: optimize perf (don't do string comparison)
-		if (func_name == "recv") {
+		int id = calls != nullptr ? (*calls)[operand.index] : builtinOf(operation);
+		if (id == RECV) {
 			size_t channel_idx = lvalueBase(e, e.getExpr(operation.operands[1].index)->operands[0]);
 			if (channel_idx != std::numeric_limits<size_t>::max()) {
-				string channel_name = context.g.vars[channel_idx].name;
-				Operand flow_operand = synthesizeChannelFromCHPVar(channel_name, channel_idx, flow::Net::IN, context);
-
-				context.func.conds[condition_idx].ack(flow_operand);
-				if (context.debug) { cout << "* cond #" << condition_idx << " ack'd " << channel_name << endl; }
+				cond.actions.push_back(ConditionAction{ConditionAction::ACK, channel_idx, flow::Net::IN, Expression()});
+				if (context.debug) { cout << "* ack'd " << context.g.vars[channel_idx].name << endl; }
 			}
-		} else if (func_name == "send") {
+		} else if (id == SEND) {
 			size_t channel_idx = lvalueBase(e, e.getExpr(operation.operands[1].index)->operands[0]);
 			if (channel_idx != std::numeric_limits<size_t>::max()) {
 				const string &channel_name = context.g.vars[channel_idx].name;
-				Operand flow_operand = synthesizeChannelFromCHPVar(channel_name, channel_idx, flow::Net::OUT, context);
 				if (context.debug) { cout << "* send on " << channel_name << "(" << channel_idx << ")" << endl; }
 
+				// Declare the channel before anything found in the sent expression
+				cond.actions.push_back(ConditionAction{ConditionAction::NET, channel_idx, flow::Net::OUT, Expression()});
+
 				////TODO: no magic numbers (e.g. "2" representing assumption of the first 2 parameters fixed
 				const Operand &send_operand = operation.operands[2];
 				//const arithmetic::Operation &send_operation = *e.getExpr(operation.operands[2].index);
 				arithmetic::Expression send_expr = send_operand.isExpr() ? arithmetic::subExpr(e, send_operand) : Expression(send_operand);
 
-				synthesizeChannelsInExpression(send_expr, condition_idx, context);
-				context.func.conds[condition_idx].req(flow_operand, send_expr);
+				synthesizeChannelsInExpression(send_expr, cond, context);
+				cond.actions.push_back(ConditionAction{ConditionAction::REQ, channel_idx, flow::Net::OUT, send_expr});
 
 				if (context.debug) {
-					cout << "* cond #" << condition_idx << " req'd " << channel_name << endl
+					cout << "* req'd " << channel_name << endl
 						<< "w/ expr: " << send_expr << endl;
 				}
 			}
-		} else if (func_name == "probe") {
+		} else if (id == PROBE) {
 			if (context.debug) { cout << "<><> PROBE op <><> " << operation << endl; }
 			size_t expr_idx = operation.operands[1].index;
 
@@ -114,8 +133,7 @@ void synthesizeChannelsInExpression(arithmetic::Expression &e, size_t condition_
 
 			size_t channel_idx = lvalueBase(e, probe_var);
 			if (channel_idx != std::numeric_limits<size_t>::max()) {
-				const string &channel_name = context.g.vars[channel_idx].name;
-				Operand flow_operand = synthesizeChannelFromCHPVar(channel_name, channel_idx, flow::Net::IN, context);
+				cond.actions.push_back(ConditionAction{ConditionAction::NET, channel_idx, flow::Net::IN, Expression()});
 			}
 			//e.sub.elems.eraseExpr() // DO NOT modify while iterating over
 			//TODO: emplace_at new_probe_operation into SimpleOperationSet (or just the Operand into elems)
@@ -125,28 +143,32 @@ void synthesizeChannelsInExpression(arithmetic::Expression &e, size_t condition_
 			//TODO: preserve multiple operands, not just one
 			if (operation.operands.size() < 2) { continue; }  // only a func_name w/ no params? no subexpr to synthesize
 			arithmetic::Expression call_expr = arithmetic::subExpr(e, operation.operands[1]);
-			if (context.debug) { cout << "* calling \"" << func_name << "\"(" << call_expr << ")" << endl; }
-			synthesizeChannelsInExpression(call_expr, condition_idx, context);
+			if (context.debug) { cout << "* calling \"" << operation.operands[0].cnst.sval << "\"(" << call_expr << ")" << endl; }
+			synthesizeChannelsInExpression(call_expr, cond, context);
 		}
 	}
 }
 
 
-size_t synthesizeConditionFromTransitions(
+/**
+ * @brief Synthesize one condition into a buffer
+ *
+ * This only reads from the context, so conditions for different branches
+ * can be synthesized concurrently. The buffer is applied to the flow::Func
+ * with emitCondition().
+ */
+ConditionBuffer synthesizeConditionFromTransitions(
 		arithmetic::Expression predicate,
 		const std::set<size_t> &transitions,
-		SynthesisContext &context) {
+		const SynthesisContext &context) {
 
-	if (transitions.empty()) {
-		return -1; // No transitions to process
-	}
+	ConditionBuffer cond;
 
 	// Properly synthesize condition predicate before assigning it to the condition
-	size_t condition_idx = context.func.pushCond(Expression::undef());
-	synthesizeChannelsInExpression(predicate, condition_idx, context);
+	synthesizeChannelsInExpression(predicate, cond, context);
 
 	predicate.minimize();
-	context.func.conds[condition_idx].valid = predicate;
+	cond.valid = predicate;
 
 	for (size_t transition_idx : transitions) {
 		if (transition_idx < 0 || transition_idx >= context.g.transitions.size()) {
@@ -155,25 +177,24 @@ size_t synthesizeConditionFromTransitions(
 
 		if (context.debug) { cout << endl << "T" << transition_idx << endl; }
 		const chp::transition &transition = context.g.transitions[transition_idx];
-		flow::Condition &cond = context.func.conds[condition_idx];
 
 		// Crawl into every action
+		const vector<builtinTable> &calls = context.calls[transition_idx];
+		size_t action_idx = 0;
 		const arithmetic::Choice &action = transition.action;
 		for (const arithmetic::Parallel &term : action.terms) {
 			for (const arithmetic::Action &action : term.actions) {
 				arithmetic::Expression expr(action.rvalue);
-				synthesizeChannelsInExpression(expr, condition_idx, context);
+				synthesizeChannelsInExpression(expr, cond, context, &calls[action_idx++]);
 
 				// Are we assigning to a local variable?
 				if (not action.lvalue.isUndef()) {
 					size_t chp_var_idx = arithmetic::lvalueBase(action.lvalue, action.lvalue.top);
 					if (chp_var_idx != std::numeric_limits<size_t>::max()) {
-						std::string chp_var_name = context.g.netAt(chp_var_idx);
-						Operand flow_operand = synthesizeChannelFromCHPVar(chp_var_name, chp_var_idx, flow::Net::REG, context);
-						cond.mem(flow_operand, expr);
+						cond.actions.push_back(ConditionAction{ConditionAction::MEM, chp_var_idx, flow::Net::REG, expr});
 
 						if (context.debug) {
-							cout << "* cond #" << condition_idx << " mem'd " << chp_var_name << endl
+							cout << "* mem'd " << context.g.netAt(chp_var_idx) << endl
 								<< "in expr: " << expr.to_string() << endl;
 						}
 					}
@@ -182,10 +203,125 @@ size_t synthesizeConditionFromTransitions(
 		}
 	}
 
+	return cond;
+}
+
+
+/**
+ * @brief Append a synthesized condition to the flow::Func
+ *
+ * Channels are allocated in the order that they were found, so replaying
+ * buffers in branch order gives the same result regardless of how they were
+ * synthesized.
+ */
+size_t emitCondition(const ConditionBuffer &buffer, SynthesisContext &context) {
+	size_t condition_idx = context.func.pushCond(Expression::undef());
+	context.func.conds[condition_idx].valid = buffer.valid;
+
+	for (const ConditionAction &action : buffer.actions) {
+		const string &chp_var_name = context.g.vars[action.chp_var_idx].name;
+		Operand flow_operand = synthesizeChannelFromCHPVar(chp_var_name, action.chp_var_idx, action.purpose, context);
+
+		flow::Condition &cond = context.func.conds[condition_idx];
+		if (action.type == ConditionAction::ACK) {
+			cond.ack(flow_operand);
+		} else if (action.type == ConditionAction::REQ) {
+			cond.req(flow_operand, action.expr);
+		} else if (action.type == ConditionAction::MEM) {
+			cond.mem(flow_operand, action.expr);
+		}
+	}
+
 	return condition_idx;
 }
 
 
+// The rewrite rules applied to every synthesized expression. They don't
+// depend on the graph, so they are built once per worker rather than once
+// per expression. Each worker gets its own copy because nothing guarantees
+// that the arithmetic library's rule sets can be used from several threads
+// at once.
+arithmetic::RuleSet synthesisRules() {
+	Expression x = Expression::varOf(0);
+	return arithmetic::RuleSet({
+		//(a[b:c]) > (),
+		(arithmetic::call(builtinName(RECV), {x})) > (x),
+		(arithmetic::call(builtinName(PROBE), {x})) > (x),
+		(1 && x) > (x),
+		(0 || x) > (x),
+	});
+}
+
+
+// Whether any rule in synthesisRules() could match somewhere in e: a recv or
+// probe call, or a boolean and/or with a constant operand. Most expressions
+// have neither and can skip the rewrite pass entirely.
+bool matchesSynthesisRules(const Expression &e) {
+	for (const arithmetic::Operand &operand : e.exprIndex()) {
+		const arithmetic::Operation &operation = *e.getExpr(operand.index);
+		if (operation.func == arithmetic::Operation::OpType::CALL) {
+			int id = builtinOf(operation);
+			if (id == RECV or id == PROBE) {
+				return true;
+			}
+		} else if (operation.func == arithmetic::Operation::OpType::BOOLEAN_AND
+			or operation.func == arithmetic::Operation::OpType::BOOLEAN_OR) {
+			for (const arithmetic::Operand &arg : operation.operands) {
+				if (arg.isConst()) {
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+
+// Unwrap channel actions, simplify, and move e into flow variable space.
+void simplifyForFlow(Expression &e, const Mapping<int> &channels, const arithmetic::RuleSet &rules) {
+	if (matchesSynthesisRules(e)) {
+		e.minimize(rules);
+	}
+	e.minimize();
+	e.applyVars(channels);
+}
+
+
+// The number of workers parallelFor() uses for n tasks.
+size_t parallelWorkers(size_t n, int threads) {
+	return threads <= 1 or n <= 1 ? 1 : std::min((size_t)threads, n);
+}
+
+
+// Run task(i, worker) for every i in [0, n) on parallelWorkers(n, threads)
+// threads. Worker indices are dense, so callers can give each worker its
+// own state. Tasks must only write to state owned by their index or their
+// worker.
+template <typename Task>
+void parallelFor(size_t n, int threads, Task task) {
+	size_t count = parallelWorkers(n, threads);
+	if (count <= 1) {
+		for (size_t i = 0; i < n; i++) {
+			task(i, 0);
+		}
+		return;
+	}
+
+	std::atomic<size_t> next(0);
+	vector<std::thread> workers;
+	for (size_t w = 0; w < count; w++) {
+		workers.emplace_back([&, w]() {
+			for (size_t i = next++; i < n; i = next++) {
+				task(i, w);
+			}
+		});
+	}
+	for (std::thread &worker : workers) {
+		worker.join();
+	}
+}
+
+
 std::set<size_t> get_branch_transitions(const graph &g, const petri::iterator &dominator, const petri::iterator &branch_head, const SynthesisContext &context) {
 	std::set<size_t> branch_transition_idxs = { static_cast<size_t>(branch_head.index) };
 
@@ -224,15 +360,536 @@ std::set<size_t> get_branch_transitions(const graph &g, const petri::iterator &d
 }
 
 
+// Simplify a condition and move it into flow variable space.
+void finalizeCondition(flow::Condition &cond, const Mapping<int> &channels, const arithmetic::RuleSet &rules) {
+	simplifyForFlow(cond.valid, channels, rules);
+
+	for (auto condRegIt = cond.regs.begin(); condRegIt != cond.regs.end(); condRegIt++) {
+		simplifyForFlow(condRegIt->second, channels, rules);
+	}
+
+	for (auto condOutIt = cond.outs.begin(); condOutIt != cond.outs.end(); condOutIt++) {
+		simplifyForFlow(condOutIt->second, channels, rules);
+	}
+}
+
+
+// A condition to synthesize: its predicate and the transitions it covers.
+struct SynthesisJob {
+	Expression predicate;
+	std::set<size_t> transitions;
+};
+
+
+// The structural key of a job. Transitions are keyed on their guards and
+// actions rather than their indices so that unrelated edits to the graph
+// don't invalidate the entry.
+string jobKey(const graph &g, const SynthesisJob &job) {
+	string result = job.predicate.to_string();
+	for (size_t t : job.transitions) {
+		result += "|" + g.transitions[t].key();
+	}
+	return result;
+}
+
+
+void collectVars(const Expression &e, vector<size_t> &vars) {
+	if (e.top.isVar()) {
+		vars.push_back(e.top.index);
+	}
+	for (const arithmetic::Operand &operand : e.exprIndex()) {
+		for (const arithmetic::Operand &arg : e.getExpr(operand.index)->operands) {
+			if (arg.isVar()) {
+				vars.push_back(arg.index);
+			}
+		}
+	}
+}
+
+
+// The flow index of every CHP variable that a buffer refers to. A finished
+// condition can only be reused if all of these are unchanged.
+string channelKey(const ConditionBuffer &buffer, const Mapping<int> &channels) {
+	vector<size_t> vars;
+	collectVars(buffer.valid, vars);
+	for (const ConditionAction &action : buffer.actions) {
+		vars.push_back(action.chp_var_idx);
+		collectVars(action.expr, vars);
+	}
+	sort(vars.begin(), vars.end());
+	vars.erase(unique(vars.begin(), vars.end()), vars.end());
+
+	string result;
+	for (size_t v : vars) {
+		result += "|" + std::to_string(v) + ">" + std::to_string(channels.mapsFrom(v) ? channels.map(v) : -1);
+	}
+	return result;
+}
+
+
+/**
+ * @brief Synthesize, emit and finalize one condition per job
+ *
+ * Jobs are synthesized concurrently into buffers and emitted in order. With
+ * a cache, a job whose key was seen before reuses its buffer, and a
+ * condition whose buffer and channel mapping are both unchanged reuses its
+ * finalized flow::Condition and skips minimization.
+ */
+void synthesizeConditions(const vector<SynthesisJob> &jobs, SynthesisContext &context, SynthesisCache *cache, int threads) {
+	vector<ConditionBuffer> buffers(jobs.size());
+	vector<string> keys(jobs.size());
+	vector<size_t> todo;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		if (cache != nullptr) {
+			keys[i] = jobKey(context.g, jobs[i]);
+			ConditionBuffer *found = cache->buffers.find(keys[i]);
+			if (found != nullptr) {
+				buffers[i] = *found;
+				continue;
+			}
+		}
+		todo.push_back(i);
+	}
+
+	parallelFor(todo.size(), threads, [&](size_t j, size_t) {
+		size_t i = todo[j];
+		buffers[i] = synthesizeConditionFromTransitions(jobs[i].predicate, jobs[i].transitions, context);
+	});
+
+	if (cache != nullptr) {
+		for (size_t i : todo) {
+			cache->buffers.insert(keys[i], buffers[i]);
+		}
+	}
+
+	vector<size_t> conds;
+	for (const ConditionBuffer &buffer : buffers) {
+		conds.push_back(emitCondition(buffer, context));
+	}
+
+	flow::Func &func = context.func;
+	todo.clear();
+	for (size_t i = 0; i < jobs.size(); i++) {
+		if (cache != nullptr) {
+			keys[i] += channelKey(buffers[i], context.channels) + "@" + std::to_string(conds[i]);
+			flow::Condition *found = cache->conditions.find(keys[i]);
+			if (found != nullptr) {
+				func.conds[conds[i]] = *found;
+				cache->hits++;
+				continue;
+			}
+			cache->misses++;
+		}
+		todo.push_back(i);
+	}
+
+	// Each condition is minimized on its own copy of the expressions, and
+	// each worker builds its own copy of the rules on its own thread.
+	vector<std::unique_ptr<arithmetic::RuleSet> > rules(parallelWorkers(todo.size(), threads));
+	parallelFor(todo.size(), threads, [&](size_t j, size_t w) {
+		if (rules[w] == nullptr) {
+			rules[w] = std::make_unique<arithmetic::RuleSet>(synthesisRules());
+		}
+		finalizeCondition(func.conds[conds[todo[j]]], context.channels, *rules[w]);
+	});
+
+	if (cache != nullptr) {
+		for (size_t i : todo) {
+			cache->conditions.insert(keys[i], func.conds[conds[i]]);
+		}
+	}
+}
+
+
+// A walk through a graph with more than one selection, used by
+// get_predicated_paths(). Its predicate is base && local: base is the
+// predicate under which the innermost enclosing selection was reached, and
+// local is the guard chosen there ANDed with whatever was chosen since.
+struct PredicatedPath {
+	Expression base;
+	Expression local;
+
+	// The transitions fired since the last merge, which form one condition,
+	// and every transition fired since the root, to find loops.
+	std::set<size_t> transitions;
+	std::set<size_t> fired;
+
+	// The places that currently hold a token on this path.
+	vector<petri::iterator> frontier;
+	bool started;
+
+	// Where the path stopped at a merge, and the transitions that got there.
+	petri::iterator at;
+	std::set<size_t> arrivals;
+};
+
+
+// How walk_predicated_path() ended.
+enum {
+	PATH_FINISHED = 0,
+	PATH_PARKED = 1,
+	PATH_FAILED = 2
+};
+
+
+/**
+ * @brief Pick the split place that every predicated path starts from
+ *
+ * This is the first selection reached walking forward from the reset state,
+ * which is the head of the main loop for the usual *[...] process. Any
+ * initialization before it is left out, as it is in the flat case.
+ */
+petri::iterator get_root_split(const graph &g, const vector<petri::iterator> &splits) {
+	std::set<petri::iterator> visited;
+	std::queue<petri::iterator> q;
+	for (const state &s : g.reset) {
+		for (const petri::token &t : s.tokens) {
+			q.push(petri::iterator(place::type, t.index));
+		}
+	}
+
+	while (not q.empty()) {
+		petri::iterator curr = q.front();
+		q.pop();
+		if (not visited.insert(curr).second) {
+			continue;
+		}
+
+		if (curr.type == place::type and g.super::next(curr).size() > 1) {
+			return curr;
+		}
+		for (const petri::iterator &n : g.super::next(curr)) {
+			q.push(n);
+		}
+	}
+
+	return splits[0];
+}
+
+
+/**
+ * @brief Add the transitions of a path to the result as one condition
+ *
+ * Paths that took the same transitions are the same condition reached
+ * under different guards, so they are merged by ORing their predicates.
+ */
+void add_predicated_path(vector<SynthesisJob> &result, std::map<std::set<size_t>, size_t> &index, const PredicatedPath &path) {
+	if (path.transitions.empty()) {
+		return;
+	}
+
+	Expression predicate = path.base && path.local;
+	auto found = index.find(path.transitions);
+	if (found != index.end()) {
+		result[found->second].predicate = result[found->second].predicate || predicate;
+	} else {
+		index.insert({path.transitions, result.size()});
+		result.push_back(SynthesisJob{predicate, path.transitions});
+	}
+}
+
+
+bool predicated_enabled(const graph &g, const PredicatedPath &path, const petri::iterator &t) {
+	for (const petri::iterator &p : g.super::prev(t)) {
+		if (find(path.frontier.begin(), path.frontier.end(), p) == path.frontier.end()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**
+ * @brief Move the tokens of a path through t
+ *
+ * @return false if t was already fired since the root, which means the
+ * path loops somewhere other than back to the root.
+ */
+bool predicated_fire(const graph &g, PredicatedPath &path, const petri::iterator &t) {
+	if (not path.fired.insert(t.index).second) {
+		error("", "predicated synthesis doesn't support the loop through T" + ::to_string(t.index), __FILE__, __LINE__);
+		return false;
+	}
+	path.transitions.insert(t.index);
+
+	for (const petri::iterator &p : g.super::prev(t)) {
+		path.frontier.erase(find(path.frontier.begin(), path.frontier.end(), p));
+	}
+	vector<petri::iterator> n = g.super::next(t);
+	path.frontier.insert(path.frontier.end(), n.begin(), n.end());
+	path.started = true;
+	return true;
+}
+
+
+/**
+ * @brief Whether firing t brought the path to a merge other than the root
+ */
+bool predicated_arrived(const graph &g, const petri::iterator &root, PredicatedPath &path, const petri::iterator &t) {
+	for (const petri::iterator &n : g.super::next(t)) {
+		if (n != root and g.super::prev(n).size() > 1) {
+			path.at = n;
+			path.arrivals = {(size_t)t.index};
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/**
+ * @brief Walk a path until it finishes or reaches the merge of the
+ * selection it is in
+ *
+ * Tokens that don't face a choice move first, and a parallel merge waits
+ * for all of its input places. At a selection each branch is walked on its
+ * own with that branch's guard as its local predicate. The branches that
+ * reach the selection's merge are each added to the result as a condition,
+ * and the path then continues from the merge once, under the disjunction
+ * of their predicates. A selection therefore adds its branches to the
+ * result rather than multiplying the paths that follow it, and the cost
+ * grows with the number of selections rather than with their product.
+ *
+ * A path finishes when none of its tokens can move: they have returned to
+ * the root or reached the end of the process. Its transitions are added to
+ * the result. If a merge is shared with an enclosing selection, the
+ * continuation stops there too and the enclosing walk joins it.
+ *
+ * @return PATH_FINISHED, PATH_PARKED at path.at, or PATH_FAILED if the
+ * graph loops somewhere other than through the root. That was reported
+ * with error().
+ */
+int walk_predicated_path(const graph &g, const petri::iterator &root, PredicatedPath &path, vector<SynthesisJob> &result, std::map<std::set<size_t>, size_t> &index) {
+	while (true) {
+		bool stepped = false;
+		for (size_t i = 0; i < path.frontier.size() and not stepped; i++) {
+			petri::iterator p = path.frontier[i];
+			if (p == root and path.started) {
+				continue;
+			}
+
+			vector<petri::iterator> outs = g.super::next(p);
+			if (outs.size() != 1 or not predicated_enabled(g, path, outs[0])) {
+				continue;
+			}
+
+			if (not predicated_fire(g, path, outs[0])) {
+				return PATH_FAILED;
+			} else if (predicated_arrived(g, root, path, outs[0])) {
+				return PATH_PARKED;
+			}
+			stepped = true;
+		}
+		if (stepped) {
+			continue;
+		}
+
+		petri::iterator split;
+		vector<petri::iterator> choices;
+		for (const petri::iterator &p : path.frontier) {
+			if ((p != root or not path.started) and g.super::next(p).size() > 1) {
+				split = p;
+				choices = g.super::next(p);
+				break;
+			}
+		}
+
+		vector<PredicatedPath> parked;
+		bool forked = false;
+		for (const petri::iterator &t : choices) {
+			if (not predicated_enabled(g, path, t)) {
+				continue;
+			}
+
+			forked = true;
+			PredicatedPath branch = path;
+			branch.base = path.base && path.local;
+			branch.local = g.transitions[t.index].guard;
+
+			int outcome = PATH_PARKED;
+			if (not predicated_fire(g, branch, t)) {
+				return PATH_FAILED;
+			} else if (not predicated_arrived(g, root, branch, t)) {
+				outcome = walk_predicated_path(g, root, branch, result, index);
+			}
+
+			if (outcome == PATH_FAILED) {
+				return PATH_FAILED;
+			} else if (outcome == PATH_PARKED) {
+				if (not parked.empty() and branch.at != parked[0].at) {
+					error("", "predicated synthesis doesn't support the selection at P" + ::to_string(split.index) + ", whose branches merge in different places", __FILE__, __LINE__);
+					return PATH_FAILED;
+				}
+				parked.push_back(branch);
+			}
+		}
+
+		if (not forked) {
+			add_predicated_path(result, index, path);
+			return PATH_FINISHED;
+		} else if (parked.empty()) {
+			return PATH_FINISHED;
+		}
+
+		Expression any = parked[0].local;
+		std::set<size_t> arrivals;
+		for (size_t i = 0; i < parked.size(); i++) {
+			add_predicated_path(result, index, parked[i]);
+			if (i > 0) {
+				any = any || parked[i].local;
+			}
+			arrivals.insert(parked[i].arrivals.begin(), parked[i].arrivals.end());
+		}
+
+		path.local = path.local && any;
+		path.transitions.clear();
+		path.fired = parked[0].fired;
+		for (size_t i = 1; i < parked.size(); i++) {
+			path.fired.insert(parked[i].fired.begin(), parked[i].fired.end());
+		}
+		path.frontier = parked[0].frontier;
+		path.started = true;
+
+		// Other branches also merge here, so this is the merge of an
+		// enclosing selection as well
+		if (arrivals.size() < g.super::prev(parked[0].at).size()) {
+			path.at = parked[0].at;
+			path.arrivals = arrivals;
+			return PATH_PARKED;
+		}
+	}
+}
+
+
+/**
+ * @brief Find the conditions of a graph with more than one selection
+ *
+ * This walks one iteration from the root split back to itself with
+ * walk_predicated_path(), so that nested and sequential selections can be
+ * synthesized without flatten(). The graph isn't modified. Each selection
+ * contributes one condition per branch, predicated on the guards chosen to
+ * reach it, and the code between selections is its own condition.
+ *
+ * @return false if the graph has a loop other than the one through the
+ * root, which was reported with error(). The conditions found up to that
+ * point are still in result.
+ */
+bool get_predicated_paths(const graph &g, const petri::iterator &root, const SynthesisContext &context, vector<SynthesisJob> &result) {
+	std::map<std::set<size_t>, size_t> index;
+	PredicatedPath path{Expression::boolOf(true), Expression::boolOf(true), {}, {}, {root}, false, petri::iterator(), {}};
+
+	int outcome = walk_predicated_path(g, root, path, result, index);
+	if (outcome == PATH_PARKED) {
+		error("", "predicated synthesis doesn't support the loop through P" + ::to_string(path.at.index), __FILE__, __LINE__);
+	}
+
+	if (context.debug) {
+		for (const SynthesisJob &job : result) {
+			cout << "_=-+_=-+_=-+_=-> PATH " << job.predicate << ": ";
+			std::copy(job.transitions.begin(), job.transitions.end(), ostream_iterator<size_t>(cout, " "));
+			cout << endl;
+		}
+	}
+
+	return outcome == PATH_FINISHED;
+}
+
+
+SynthesisCache::SynthesisCache() : buffers(4096), conditions(4096) {
+	hits = 0;
+	misses = 0;
+}
+
+SynthesisCache::SynthesisCache(size_t capacity) : buffers(capacity), conditions(capacity) {
+	hits = 0;
+	misses = 0;
+}
+
+SynthesisCache::~SynthesisCache() {
+}
+
+void SynthesisCache::clear() {
+	buffers.clear();
+	conditions.clear();
+	hits = 0;
+	misses = 0;
+}
+
+
+SynthesisOptions::SynthesisOptions() {
+	debug = false;
+	threads = 1;
+	inferWidths = false;
+	cache = nullptr;
+}
+
+SynthesisOptions::SynthesisOptions(bool debug, int threads) {
+	this->debug = debug;
+	this->threads = threads;
+	this->inferWidths = false;
+	this->cache = nullptr;
+}
+
+SynthesisOptions::~SynthesisOptions() {
+}
+
+
 flow::Func synthesizeFuncFromCHP(const graph &g, bool debug) {
+	return synthesizeFuncFromCHP(g, SynthesisOptions(debug));
+}
+
+
+flow::Func synthesizeFuncFromCHP(const graph &g, const SynthesisOptions &options) {
+	CHP_TIME(PHASE_SYNTHESIZE);
 	flow::Func func;
 	Mapping<int> channels(-1, false);
-	SynthesisContext context(g, func, channels, debug);
+	SynthesisContext context(g, func, channels, options.debug);
+
 	context.func.name = g.name;
+	if (options.inferWidths) {
+		context.widths = inferWidths(g, DATA_CHANNEL_WIDTH);
+	}
+
+	context.calls.resize(g.transitions.size());
+	for (size_t t = 0; t < g.transitions.size(); t++) {
+		if (not g.transitions.is_valid(t)) {
+			continue;
+		}
+		for (const arithmetic::Parallel &term : g.transitions[t].action.terms) {
+			for (const arithmetic::Action &action : term.actions) {
+				context.calls[t].push_back(builtinTable(action.rvalue));
+			}
+		}
+	}
+
+	// Debug output from concurrent branches would be interleaved
+	int threads = options.debug ? 1 : options.threads;
 
 	if (context.debug) { cout << endl << "?? FLAT ENOUGH FOR SYNTHESIS? " << std::boolalpha << g.isFlat() << endl << endl; }
 
-	// Confirm chp::graph has been normalized to flattened form & identify split-place dominator
+	// Nested or sequential selections are synthesized as predicated paths
+	// rather than requiring flatten() first.
+	vector<petri::iterator> splits;
+	for (size_t place_idx = 0; place_idx < g.places.size(); place_idx++) {
+		petri::iterator place_it(place::type, place_idx);
+		if (g.places.is_valid(place_idx) and g.super::next(place_it).size() > 1) {
+			splits.push_back(place_it);
+		}
+	}
+
+	if (splits.size() > 1) {
+		petri::iterator root = get_root_split(g, splits);
+		if (context.debug) { cout << endl << "SYNTH ROOT> " << root.to_string() << endl; }
+
+		// A loop other than the one through the root is reported, and the
+		// conditions found up to it are still synthesized
+		vector<SynthesisJob> jobs;
+		get_predicated_paths(g, root, context, jobs);
+		synthesizeConditions(jobs, context, options.cache, threads);
+		return context.func;
+	}
+
+	// Identify split-place dominator of a flat graph
 	petri::iterator dominator;
 
 	for (size_t place_idx = 0; place_idx < g.places.size(); place_idx++) {
@@ -246,21 +903,11 @@ flow::Func synthesizeFuncFromCHP(const graph &g, bool debug) {
 		size_t out_count = out_transitions.size();
 
 		// Is graph ready, in flat form?
-		if (in_count != out_count) {
-			string msg = "ERROR: split-place with unequal ins & outs detected [" \
-										+ std::to_string(place_idx) + "] => (" + std::to_string(in_count) + ", " + std::to_string(out_count) \
-										+ "). chp::graph isn't ready for FlowSynthesis, because it's not `flat`. chp::graph::flatten() _should_ get it ready.";
-			cerr << msg << endl;
-			//throw std::runtime_error(msg);
+		if (in_count != out_count and context.debug) {
+			cout << "split-place with unequal ins & outs detected [" << place_idx << "] => (" << in_count << ", " << out_count << ")" << endl;
 		}
 
 		if (out_count > 1) {
-			if (dominator != -1) {
-				string msg = "ERROR: multiple split-places detected. chp::graph isn't ready for FlowSynthesis, because it's not `flat`. chp::graph::flatten() _should_ get it ready.";
-				cerr << msg << endl;
-				throw std::runtime_error(msg);
-			}
-
 			dominator = place_it; // Found our dominator!
 			break;
 		}
@@ -281,51 +928,23 @@ flow::Func synthesizeFuncFromCHP(const graph &g, bool debug) {
 		}
 
 		//TODO: Can there be a non-always predicate in a guard-less default branch?
-		synthesizeConditionFromTransitions(Expression::boolOf(true), all_transition_idxs, context);
+		if (not all_transition_idxs.empty()) {
+			synthesizeConditions({SynthesisJob{Expression::boolOf(true), all_transition_idxs}}, context, options.cache, threads);
+		}
 
 	} else {
 		// Crawl each branch in flattened chp::graph
-		for (const petri::iterator &branch_head : g.super::next(dominator)) {
-			std::set<size_t> branch_transition_idxs = get_branch_transitions(g, dominator, branch_head, context);
+		vector<petri::iterator> branch_heads = g.super::next(dominator);
+		vector<SynthesisJob> jobs(branch_heads.size());
+		parallelFor(branch_heads.size(), threads, [&](size_t i, size_t) {
+			jobs[i].transitions = get_branch_transitions(g, dominator, branch_heads[i], context);
 
 			// Identify condition's predicate/condition, if there is one
-			arithmetic::Expression guard = g.transitions[branch_head.index].guard;
-
 			//guard = guard.isValid() ? Expression::boolOf(true) : guard;
-			synthesizeConditionFromTransitions(guard, branch_transition_idxs, context);
-
-			//std::list<size_t> branch_transition_idxs;
-			////auto iterator_to_transition = [&g](const petri::iterator &it) { return g.transitions[it.index]; };
-			//std::transform(branch_transitions.begin(), branch_transitions.end(), branch_transition_idxs.begin(),
-			//		[](const petri::iterator &it) { return it.index; });
-		}
-	}
+			jobs[i].predicate = g.transitions[branch_heads[i].index].guard;
+		});
 
-	// Apply all mappings post-analysis
-	Expression x = Expression::varOf(0);
-	arithmetic::RuleSet substitutions({
-		//(a[b:c]) > (),
-		(arithmetic::call("recv", {x})) > (x),
-		(arithmetic::call("probe", {x})) > (x),
-		(1 && x) > (x),
-		(0 || x) > (x),
-	});
-	for (auto condIt = func.conds.begin(); condIt != func.conds.end(); condIt++) {
-		condIt->valid.minimize(substitutions);
-		condIt->valid.minimize();
-		condIt->valid.applyVars(context.channels);
-
-		for (auto condRegIt = condIt->regs.begin(); condRegIt != condIt->regs.end(); condRegIt++) {
-			condRegIt->second.minimize(substitutions);
-			condRegIt->second.minimize();
-			condRegIt->second.applyVars(context.channels);
-		}
-
-		for (auto condOutIt = condIt->outs.begin(); condOutIt != condIt->outs.end(); condOutIt++) {
-			condOutIt->second.minimize(substitutions);
-			condOutIt->second.minimize();
-			condOutIt->second.applyVars(context.channels);
-		}
+		synthesizeConditions(jobs, context, options.cache, threads);
 	}
 
 	return context.func;
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <list>
 #include <set>
+#include <unordered_map>
 
 #include <common/mapping.h>
 #include <flow/func.h>
@@ -9,6 +11,133 @@
 
 namespace chp {
 
+// A channel declaration or condition update, recorded against CHP variable
+// indices. Flow nets are only allocated when the buffer is replayed, so that
+// branches can be synthesized concurrently and still get the same channel
+// indices as a sequential run.
+struct ConditionAction {
+	enum {
+		NET = 0,  // declare the channel without touching the condition
+		ACK = 1,
+		REQ = 2,
+		MEM = 3
+	};
+
+	int type;
+	size_t chp_var_idx;
+	flow::Net::Purpose purpose;
+	arithmetic::Expression expr;
+};
+
+// Everything synthesized for one condition, in the order it was found.
+struct ConditionBuffer {
+	arithmetic::Expression valid;
+	vector<ConditionAction> actions;
+};
+
+// A map from strings that keeps at most capacity entries. Finding an entry
+// marks it as the most recently used, and inserting past capacity removes
+// the least recently used one. A capacity of zero means no limit.
+template <typename T>
+struct lruMap {
+	typedef std::list<pair<string, T> > list_type;
+
+	lruMap() {
+		capacity = 0;
+	}
+
+	lruMap(size_t capacity) {
+		this->capacity = capacity;
+	}
+
+	~lruMap() {
+	}
+
+	// Most recently used first
+	list_type entries;
+	std::unordered_map<string, typename list_type::iterator> index;
+	size_t capacity;
+
+	T *find(const string &key) {
+		auto found = index.find(key);
+		if (found == index.end()) {
+			return nullptr;
+		}
+		entries.splice(entries.begin(), entries, found->second);
+		return &found->second->second;
+	}
+
+	void insert(const string &key, const T &value) {
+		auto found = index.find(key);
+		if (found != index.end()) {
+			found->second->second = value;
+			entries.splice(entries.begin(), entries, found->second);
+			return;
+		}
+
+		entries.push_front(pair<string, T>(key, value));
+		index.insert({key, entries.begin()});
+		while (capacity > 0 and entries.size() > capacity) {
+			index.erase(entries.back().first);
+			entries.pop_back();
+		}
+	}
+
+	size_t size() const {
+		return entries.size();
+	}
+
+	void clear() {
+		entries.clear();
+		index.clear();
+	}
+};
+
+// The results of earlier calls to synthesizeFuncFromCHP, for interactive
+// flows that resynthesize the same process after small edits. Buffers are
+// keyed on the predicate and the guards and actions of the transitions of
+// each condition. Finished conditions are additionally keyed on the flow
+// index of every variable they refer to. Only conditions whose key changed
+// are synthesized and minimized again. Each of the two maps holds at most
+// capacity entries and drops the least recently used ones beyond that.
+struct SynthesisCache {
+	SynthesisCache();
+	SynthesisCache(size_t capacity);
+	~SynthesisCache();
+
+	lruMap<ConditionBuffer> buffers;
+	lruMap<flow::Condition> conditions;
+
+	// Finished conditions reused or rebuilt, over the lifetime of the cache.
+	size_t hits;
+	size_t misses;
+
+	void clear();
+};
+
+struct SynthesisOptions {
+	SynthesisOptions();
+	SynthesisOptions(bool debug, int threads=1);
+	~SynthesisOptions();
+
+	bool debug;
+
+	// The branches of the dominating selection and the final simplification
+	// of each condition are split across this many threads. Workers only
+	// share the graph, which they read. Every expression they rewrite is
+	// their own copy, and each worker minimizes with its own copy of the
+	// rewrite rules. The result does not depend on the number of threads.
+	int threads;
+
+	// Size each channel and register to the values it carries (see width.h)
+	// instead of using the default data width for all of them.
+	bool inferWidths;
+
+	// If set, reuse and update the conditions stored in this cache.
+	SynthesisCache *cache;
+};
+
 flow::Func synthesizeFuncFromCHP(const graph &g, bool debug=false);
+flow::Func synthesizeFuncFromCHP(const graph &g, const SynthesisOptions &options);
 
 }
@@ -0,0 +1,504 @@
+#include "trace.h"
+#include "expression.h"
+#include "serialize.h"
+
+#include <cstring>
+#include <common/message.h>
+
+namespace chp
+{
+
+template <typename T>
+void tracePut(string &out, const T &value) {
+	out.append((const char*)&value, sizeof(T));
+}
+
+template <typename T>
+bool traceGet(std::string_view &in, T &value) {
+	if (in.size() < sizeof(T)) {
+		return false;
+	}
+	memcpy(&value, in.data(), sizeof(T));
+	in.remove_prefix(sizeof(T));
+	return true;
+}
+
+uint64_t tracePadding(uint64_t size) {
+	return (8 - size%8)%8;
+}
+
+/**
+ * @brief Encode the state that simulator::enabled() depends on
+ *
+ * Token guards are stored as text like the expressions in a serialized
+ * graph. Values use the same encoding as the VALUES section.
+ */
+string capture(const simulator &sim) {
+	string result;
+	tracePut(result, (uint64_t)sim.now);
+
+	tracePut(result, (uint64_t)sim.tokens.size());
+	for (const token &t : sim.tokens) {
+		string guard = emit_expression(t.guard, *sim.base);
+		tracePut(result, (int32_t)t.index);
+		tracePut(result, (uint64_t)guard.size());
+		result.append(guard);
+	}
+
+	for (const arithmetic::State *s : {&sim.encoding, &sim.global}) {
+		tracePut(result, (uint64_t)s->values.size());
+		for (const arithmetic::Value &value : s->values) {
+			writeValue(result, value);
+		}
+	}
+
+	tracePut(result, (uint64_t)sim.loaded.size());
+	for (const enabled_transition &t : sim.loaded) {
+		tracePut(result, (int32_t)t.index);
+		tracePut(result, (int32_t)t.vacuous);
+		tracePut(result, (uint64_t)t.fire_at);
+		tracePut(result, (uint64_t)t.since);
+	}
+
+	// The firings are written in the order they fired so that pushing them
+	// back rebuilds the same chains of writers.
+	vector<int> slots;
+	for (int slot = 0; slot < (int)sim.history.arena.size(); slot++) {
+		if (sim.history.arena[slot].seq != history_ring::NONE) {
+			slots.push_back(slot);
+		}
+	}
+	sort(slots.begin(), slots.end(), [&sim](int a, int b) {
+		return sim.history[a].seq < sim.history[b].seq;
+	});
+
+	tracePut(result, (uint64_t)sim.history.next);
+	tracePut(result, (uint64_t)sim.history.window);
+	tracePut(result, (uint64_t)slots.size());
+	for (int slot : slots) {
+		const firing &f = sim.history[slot];
+		tracePut(result, (uint64_t)f.seq);
+		tracePut(result, (int32_t)f.index.index);
+		tracePut(result, (int32_t)f.index.term);
+		for (const arithmetic::State *s : {&f.guard_action, &f.local_action, &f.remote_action}) {
+			tracePut(result, (uint64_t)s->values.size());
+			for (const arithmetic::Value &value : s->values) {
+				writeValue(result, value);
+			}
+		}
+	}
+	return result;
+}
+
+/**
+ * @brief Overwrite the state of a simulator with a checkpoint
+ *
+ * The error lists are left alone. Nothing is modified if the checkpoint is
+ * malformed.
+ */
+bool restore(simulator &sim, std::string_view data) {
+	uint64_t now = 0;
+	uint64_t count = 0;
+	if (not traceGet(data, now) or not traceGet(data, count)) {
+		return false;
+	}
+
+	vector<token> tokens;
+	for (uint64_t i = 0; i < count; i++) {
+		int32_t index = 0;
+		uint64_t length = 0;
+		if (not traceGet(data, index) or not traceGet(data, length) or data.size() < length) {
+			return false;
+		}
+		string guard(data.substr(0, length));
+		data.remove_prefix(length);
+		tokens.push_back(token(index, guard.empty() ? arithmetic::Expression::vdd() : read_expression(guard, *sim.base)));
+	}
+
+	arithmetic::State encodings[2];
+	for (int i = 0; i < 2; i++) {
+		if (not traceGet(data, count)) {
+			return false;
+		}
+		for (uint64_t j = 0; j < count; j++) {
+			encodings[i].values.push_back(arithmetic::Value());
+			if (not readValue(data, encodings[i].values.back())) {
+				return false;
+			}
+		}
+	}
+
+	vector<enabled_transition> loaded;
+	if (not traceGet(data, count)) {
+		return false;
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		int32_t index = 0;
+		int32_t vacuous = 0;
+		uint64_t fire_at = 0;
+		uint64_t since = 0;
+		if (not traceGet(data, index) or not traceGet(data, vacuous)
+		  or not traceGet(data, fire_at) or not traceGet(data, since)) {
+			return false;
+		}
+
+		loaded.push_back(enabled_transition(index));
+		loaded.back().vacuous = vacuous != 0;
+		loaded.back().fire_at = fire_at;
+		loaded.back().since = since;
+	}
+
+	history_ring history;
+	uint64_t next = 0;
+	uint64_t window = 0;
+	if (not traceGet(data, next) or not traceGet(data, window) or not traceGet(data, count)) {
+		return false;
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		firing f;
+		int32_t index[2];
+		if (not traceGet(data, f.seq) or not traceGet(data, index)) {
+			return false;
+		}
+		f.index = term_index(index[0], index[1]);
+		for (arithmetic::State *s : {&f.guard_action, &f.local_action, &f.remote_action}) {
+			uint64_t values = 0;
+			if (not traceGet(data, values)) {
+				return false;
+			}
+			for (uint64_t j = 0; j < values; j++) {
+				s->values.push_back(arithmetic::Value());
+				if (not readValue(data, s->values.back())) {
+					return false;
+				}
+			}
+		}
+
+		history.next = f.seq;
+		history.push(f);
+	}
+	history.next = next;
+	history.trim(window);
+
+	sim.now = now;
+	sim.history = history;
+	sim.tokens.clear();
+	for (int i = 0; i < (int)tokens.size(); i++) {
+		sim.tokens.push_back(std::move(tokens[i]));
+	}
+	sim.encoding = encodings[0];
+	sim.global = encodings[1];
+	sim.loaded.clear();
+	for (int i = 0; i < (int)loaded.size(); i++) {
+		sim.loaded.push_back(std::move(loaded[i]));
+	}
+	sim.ready.clear();
+	sim.closed = 0;
+	sim.dirty |= simulator::ENCODING | simulator::READY;
+	return true;
+}
+
+traceRecorder::traceRecorder() {
+	os = NULL;
+	interval = TRACE_INTERVAL;
+	steps = 0;
+	offset = 0;
+}
+
+traceRecorder::~traceRecorder() {
+	close();
+}
+
+void traceRecorder::open(ostream &os, uint32_t interval) {
+	close();
+	this->os = &os;
+	this->interval = interval > 0 ? interval : 1;
+	steps = 0;
+	offset = 0;
+	checkpoints.clear();
+
+	traceHeader header;
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.interval = this->interval;
+	header.reserved = 0;
+	put(&header, sizeof(header));
+}
+
+bool traceRecorder::open(const string &path, uint32_t interval) {
+	close();
+	file.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (not file.is_open()) {
+		return false;
+	}
+	open(file, interval);
+	return true;
+}
+
+bool traceRecorder::is_open() const {
+	return os != NULL;
+}
+
+void traceRecorder::attach(simulator &sim) {
+	if (find(sim.observers.begin(), sim.observers.end(), this) == sim.observers.end()) {
+		sim.observers.push_back(this);
+	}
+	checkpoint(sim);
+}
+
+/**
+ * @brief Record one call to simulator::fire()
+ *
+ * The simulator is in the state after the firing.
+ */
+void traceRecorder::fired(const simulator &sim, int choice, term_index t) {
+	if (os == NULL) {
+		return;
+	}
+
+	traceStep s;
+	s.kind = traceRecord::STEP;
+	s.choice = choice;
+	s.index = t.index;
+	s.term = t.term;
+	s.now = sim.now;
+	put(&s, sizeof(s));
+
+	if (++steps%interval == 0) {
+		checkpoint(sim);
+	}
+}
+
+void traceRecorder::checkpoint(const simulator &sim) {
+	if (os == NULL or sim.base == NULL) {
+		return;
+	}
+
+	if (not checkpoints.empty() and checkpoints.back().step == steps) {
+		return;
+	}
+
+	string data = capture(sim);
+	data.append(tracePadding(data.size()), '\0');
+
+	checkpoints.push_back(traceCheckpoint{steps, offset});
+	traceBlock block;
+	block.kind = traceRecord::CHECKPOINT;
+	block.reserved = 0;
+	block.size = data.size();
+	put(&block, sizeof(block));
+	put(data.data(), data.size());
+}
+
+void traceRecorder::close() {
+	if (os == NULL) {
+		return;
+	}
+
+	traceTrailer trailer;
+	trailer.steps = steps;
+	trailer.index = offset;
+	trailer.count = checkpoints.size();
+	trailer.magic = TRACE_MAGIC;
+
+	traceBlock block;
+	block.kind = traceRecord::INDEX;
+	block.reserved = 0;
+	block.size = checkpoints.size()*sizeof(traceCheckpoint);
+	put(&block, sizeof(block));
+	put(checkpoints.data(), block.size);
+	put(&trailer, sizeof(trailer));
+	os->flush();
+
+	os = NULL;
+	if (file.is_open()) {
+		file.close();
+	}
+}
+
+void traceRecorder::put(const void *data, size_t size) {
+	os->write((const char*)data, size);
+	offset += size;
+}
+
+traceReader::traceReader() {
+	is = NULL;
+	interval = TRACE_INTERVAL;
+	steps = 0;
+	position = -1;
+}
+
+traceReader::~traceReader() {
+}
+
+/**
+ * @brief Read the header and the checkpoint index
+ *
+ * The index is read from the trailer if the trace was closed, otherwise it
+ * is rebuilt by scanning every record.
+ */
+bool traceReader::open(istream &is) {
+	this->is = &is;
+	steps = 0;
+	position = -1;
+	checkpoints.clear();
+
+	traceHeader header;
+	is.seekg(0, std::ios::beg);
+	if (not get(&header, sizeof(header)) or header.magic != TRACE_MAGIC) {
+		return false;
+	}
+	if (header.version != TRACE_VERSION) {
+		error("", "unsupported trace version " + ::to_string(header.version), __FILE__, __LINE__);
+		return false;
+	}
+	interval = header.interval;
+
+	is.seekg(0, std::ios::end);
+	uint64_t size = is.tellg();
+
+	traceTrailer trailer;
+	if (size >= sizeof(traceHeader) + sizeof(traceBlock) + sizeof(traceTrailer)) {
+		is.seekg(size - sizeof(traceTrailer), std::ios::beg);
+		if (get(&trailer, sizeof(trailer)) and trailer.magic == TRACE_MAGIC
+		  and trailer.index + sizeof(traceBlock) + trailer.count*sizeof(traceCheckpoint) + sizeof(traceTrailer) == size) {
+			is.seekg(trailer.index + sizeof(traceBlock), std::ios::beg);
+			checkpoints.resize(trailer.count);
+			if (get(checkpoints.data(), trailer.count*sizeof(traceCheckpoint))) {
+				steps = trailer.steps;
+				return not checkpoints.empty();
+			}
+			checkpoints.clear();
+		}
+	}
+
+	return scan();
+}
+
+bool traceReader::open(const string &path) {
+	file.open(path.c_str(), std::ios::in | std::ios::binary);
+	if (not file.is_open()) {
+		return false;
+	}
+	return open(file);
+}
+
+/**
+ * @brief Rebuild the checkpoint index of a trace that wasn't closed
+ *
+ * A truncated record at the end is ignored.
+ */
+bool traceReader::scan() {
+	is->clear();
+	is->seekg(sizeof(traceHeader), std::ios::beg);
+	uint64_t offset = sizeof(traceHeader);
+	steps = 0;
+	checkpoints.clear();
+
+	uint32_t kind;
+	while (get(&kind, sizeof(kind))) {
+		if (kind == traceRecord::STEP) {
+			is->seekg(sizeof(traceStep) - sizeof(kind), std::ios::cur);
+			if (not *is) {
+				break;
+			}
+			offset += sizeof(traceStep);
+			steps++;
+		} else if (kind == traceRecord::CHECKPOINT) {
+			traceBlock block;
+			block.kind = kind;
+			if (not get(((char*)&block) + sizeof(kind), sizeof(block) - sizeof(kind))) {
+				break;
+			}
+			checkpoints.push_back(traceCheckpoint{steps, offset});
+			is->seekg(block.size, std::ios::cur);
+			offset += sizeof(block) + block.size;
+		} else {
+			break;
+		}
+	}
+
+	is->clear();
+	return not checkpoints.empty();
+}
+
+bool traceReader::seek(simulator &sim, uint64_t step) {
+	if (is == NULL or step > steps or checkpoints.empty()) {
+		return false;
+	}
+
+	// Find the last checkpoint at or before step. If the simulator is already
+	// between that checkpoint and step, it's cheaper to keep going.
+	auto cp = upper_bound(checkpoints.begin(), checkpoints.end(), step, [](uint64_t s, const traceCheckpoint &c) {
+		return s < c.step;
+	});
+	--cp;
+
+	if (position < (int64_t)cp->step or position > (int64_t)step) {
+		is->clear();
+		is->seekg(cp->offset, std::ios::beg);
+		traceBlock block;
+		if (not get(&block, sizeof(block)) or block.kind != traceRecord::CHECKPOINT) {
+			return false;
+		}
+
+		string data(block.size, '\0');
+		if (not get(data.data(), data.size()) or not restore(sim, data)) {
+			return false;
+		}
+		position = cp->step;
+	}
+
+	while (position < (int64_t)step) {
+		if (not next(sim)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool traceReader::next(simulator &sim) {
+	if (is == NULL or position < 0) {
+		return false;
+	}
+
+	uint32_t kind;
+	while (get(&kind, sizeof(kind))) {
+		if (kind == traceRecord::CHECKPOINT) {
+			traceBlock block;
+			if (not get(((char*)&block) + sizeof(kind), sizeof(block) - sizeof(kind))) {
+				return false;
+			}
+			is->seekg(block.size, std::ios::cur);
+		} else if (kind == traceRecord::STEP) {
+			traceStep s;
+			s.kind = kind;
+			if (not get(((char*)&s) + sizeof(kind), sizeof(s) - sizeof(kind))) {
+				return false;
+			}
+
+			sim.enabled();
+			if (s.choice < 0 or s.choice >= (int)sim.ready.size()
+			  or sim.loaded[sim.ready[s.choice].first].index != s.index
+			  or sim.ready[s.choice].second != s.term) {
+				error("", "trace diverged from the simulation at step " + ::to_string(position+1), __FILE__, __LINE__);
+				return false;
+			}
+
+			sim.fire(s.choice);
+			sim.now = s.now;
+			position++;
+			return true;
+		} else {
+			return false;
+		}
+	}
+	return false;
+}
+
+bool traceReader::get(void *data, size_t size) {
+	is->read((char*)data, size);
+	return (size_t)is->gcount() == size;
+}
+
+}
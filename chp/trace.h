@@ -0,0 +1,150 @@
+#pragma once
+
+#include <fstream>
+#include <string_view>
+
+#include <common/standard.h>
+
+#include "simulator.h"
+
+namespace chp
+{
+
+// Binary simulation trace
+//
+// A trace starts with a traceHeader followed by a stream of records. Every
+// call to simulator::fire() appends one fixed-width traceStep. Every
+// 'interval' steps, and once before the first step, the recorder appends a
+// checkpoint block holding everything that enabled() and fire() read: the
+// tokens, both encodings, the time, the loaded transitions, and the firings
+// held in simulator::history, from which the histories of the loaded
+// transitions are rebuilt. Closing the trace appends an index of the
+// checkpoints and a traceTrailer so that a reader can find them without
+// scanning the file.
+// A trace that was never closed, because the run crashed for example, is
+// still readable, the reader just rebuilds the index by scanning.
+//
+// Replaying a step calls enabled() and then fires the recorded ready index,
+// so seeking to step n costs at most one checkpoint restore and 'interval'
+// firings no matter how long the run was. Firing delays are random, so the
+// replay takes the time of each step from the trace instead.
+//
+// All records are aligned to 8 bytes and stored in host byte order. The
+// values inside checkpoints use the little-endian encoding of writeValue().
+
+const uint32_t TRACE_MAGIC = 0x54504843; // "CHPT"
+const uint32_t TRACE_VERSION = 3;
+const uint32_t TRACE_INTERVAL = 4096;
+
+struct traceHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t interval;
+	uint32_t reserved;
+};
+
+struct traceRecord {
+	enum {
+		STEP = 0,
+		CHECKPOINT = 1,
+		INDEX = 2
+	};
+};
+
+// One call to simulator::fire(). index and term identify the transition
+// that fired so that a replay can tell when the graph no longer matches.
+struct traceStep {
+	uint32_t kind;
+	int32_t choice;
+	int32_t index;
+	int32_t term;
+	uint64_t now;
+};
+
+// A variable length record. The payload is padded to 8 bytes.
+struct traceBlock {
+	uint32_t kind;
+	uint32_t reserved;
+	uint64_t size;
+};
+
+// The state after 'step' steps is stored in the checkpoint at 'offset'.
+struct traceCheckpoint {
+	uint64_t step;
+	uint64_t offset;
+};
+
+struct traceTrailer {
+	uint64_t steps;
+	uint64_t index;
+	uint32_t count;
+	uint32_t magic;
+};
+
+// Writes a trace of a simulation. attach() adds the recorder to the
+// simulator's observers and records the initial checkpoint. From then on,
+// the simulator calls fired() after every firing.
+struct traceRecorder : observer {
+	traceRecorder();
+	~traceRecorder();
+
+	ostream *os;
+	std::ofstream file;
+
+	uint32_t interval;
+	uint64_t steps;
+	uint64_t offset;
+	vector<traceCheckpoint> checkpoints;
+
+	void open(ostream &os, uint32_t interval=TRACE_INTERVAL);
+	bool open(const string &path, uint32_t interval=TRACE_INTERVAL);
+	bool is_open() const;
+
+	void attach(simulator &sim);
+	void fired(const simulator &sim, int choice, term_index t) override;
+	void checkpoint(const simulator &sim);
+
+	// Write the checkpoint index and the trailer. This is called by the
+	// destructor if it hasn't been called already.
+	void close();
+
+	void put(const void *data, size_t size);
+};
+
+// Reads a trace and drives a simulator through it. The simulator must be
+// constructed over the same graph that was recorded. Its state is
+// overwritten by the first checkpoint it is seeked to.
+struct traceReader {
+	traceReader();
+	~traceReader();
+
+	istream *is;
+	std::ifstream file;
+
+	uint32_t interval;
+	uint64_t steps;
+	vector<traceCheckpoint> checkpoints;
+
+	// The number of steps the simulator has been driven through, or -1 if
+	// it hasn't been restored from a checkpoint yet.
+	int64_t position;
+
+	bool open(istream &is);
+	bool open(const string &path);
+
+	// Put the simulator in the state it was in after 'step' firings.
+	bool seek(simulator &sim, uint64_t step);
+
+	// Replay the next recorded firing. Returns false at the end of the trace,
+	// or if the recorded choice doesn't fire the recorded transition.
+	bool next(simulator &sim);
+
+	bool scan();
+	bool get(void *data, size_t size);
+};
+
+// Encode and decode the part of the simulator state stored in a checkpoint.
+string capture(const simulator &sim);
+bool restore(simulator &sim, std::string_view data);
+
+}
@@ -0,0 +1,241 @@
+#include "vcd.h"
+#include "width.h"
+
+namespace chp
+{
+
+// Only the fields that show up in the waveform are compared.
+bool vcdSame(const arithmetic::Value &a, const arithmetic::Value &b) {
+	if (a.type != b.type) {
+		return false;
+	}
+	switch (a.type) {
+	case arithmetic::Value::BOOL: return a.bval == b.bval;
+	case arithmetic::Value::INT: return a.ival == b.ival;
+	case arithmetic::Value::REAL: return a.rval == b.rval;
+	default: return true;
+	}
+}
+
+// VCD identifiers are short strings of the printable characters '!' to '~'.
+string vcdId(size_t index) {
+	string result;
+	do {
+		result.push_back((char)('!' + index%94));
+		index /= 94;
+	} while (index > 0);
+	return result;
+}
+
+vcdWriter::vcdWriter() {
+	os = NULL;
+	blockSize = 1 << 20;
+	maxPending = 8;
+	done = false;
+	time = 0;
+}
+
+vcdWriter::~vcdWriter() {
+	close();
+}
+
+void vcdWriter::open(ostream &os) {
+	close();
+	this->os = &os;
+	done = false;
+	buffer.clear();
+	buffer.reserve(blockSize);
+	worker = std::thread(&vcdWriter::run, this);
+}
+
+bool vcdWriter::open(const string &path) {
+	close();
+	file.open(path.c_str(), std::ios::out | std::ios::trunc);
+	if (not file.is_open()) {
+		return false;
+	}
+	open(file);
+	return true;
+}
+
+bool vcdWriter::is_open() const {
+	return os != NULL;
+}
+
+void vcdWriter::attach(simulator &sim, int defaultWidth) {
+	if (os == NULL or sim.base == NULL) {
+		return;
+	}
+
+	const graph &g = *sim.base;
+	widths = inferWidths(g, defaultWidth);
+	ids.clear();
+	for (size_t i = 0; i < g.vars.size(); i++) {
+		ids.push_back(vcdId(i));
+	}
+
+	buffer += "$version chp $end\n";
+	buffer += "$timescale 1ps $end\n";
+	buffer += "$scope module " + (g.name.empty() ? string("chp") : g.name) + " $end\n";
+	for (size_t i = 0; i < g.vars.size(); i++) {
+		string name = g.netAt(i);
+		replace(name.begin(), name.end(), ' ', '_');
+		buffer += "$var wire " + ::to_string(widths[i]) + " " + ids[i] + " " + name + " $end\n";
+	}
+	buffer += "$upscope $end\n";
+	buffer += "$enddefinitions $end\n";
+
+	time = sim.now;
+	buffer += "#" + ::to_string(time) + "\n";
+	buffer += "$dumpvars\n";
+	last = sim.encoding.values;
+	last.resize(g.vars.size(), arithmetic::Value::U(arithmetic::Value::INT));
+	for (size_t i = 0; i < last.size(); i++) {
+		emit(i, last[i]);
+	}
+	buffer += "$end\n";
+
+	if (find(sim.observers.begin(), sim.observers.end(), this) == sim.observers.end()) {
+		sim.observers.push_back(this);
+	}
+}
+
+/**
+ * @brief Write the variables whose value changed in this firing
+ *
+ * A timestamp is only written when the time has moved and something changed.
+ */
+void vcdWriter::fired(const simulator &sim, int choice, term_index t) {
+	if (os == NULL) {
+		return;
+	}
+
+	const vector<arithmetic::Value> &values = sim.encoding.values;
+	size_t n = std::min(values.size(), last.size());
+	for (size_t i = 0; i < n; i++) {
+		if (vcdSame(values[i], last[i])) {
+			continue;
+		}
+
+		if (sim.now != time) {
+			time = sim.now;
+			buffer += "#";
+			buffer += ::to_string(time);
+			buffer += "\n";
+		}
+		last[i] = values[i];
+		emit(i, last[i]);
+	}
+
+	if (buffer.size() >= blockSize) {
+		handoff();
+	}
+}
+
+void vcdWriter::close() {
+	if (os == NULL) {
+		return;
+	}
+
+	handoff();
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		done = true;
+	}
+	changed.notify_all();
+	worker.join();
+
+	os->flush();
+	os = NULL;
+	if (file.is_open()) {
+		file.close();
+	}
+	pending.clear();
+	spare.clear();
+	buffer.clear();
+}
+
+void vcdWriter::emit(size_t var, const arithmetic::Value &value) {
+	int width = var < widths.size() ? widths[var] : 1;
+	char fill = 0;
+	uint64_t bits = 0;
+	switch (value.type) {
+	case arithmetic::Value::UNKNOWN: fill = 'x'; break;
+	case arithmetic::Value::UNSTABLE: fill = 'z'; break;
+	case arithmetic::Value::NEUTRAL: bits = 0; break;
+	case arithmetic::Value::VALID: bits = 1; break;
+	case arithmetic::Value::BOOL: bits = value.bval ? 1 : 0; break;
+	case arithmetic::Value::INT: bits = (uint64_t)value.ival; break;
+	case arithmetic::Value::REAL: bits = (uint64_t)(int64_t)value.rval; break;
+	default: fill = 'x'; break;
+	}
+
+	if (width <= 1) {
+		buffer.push_back(fill != 0 ? fill : (char)('0' + (bits&1)));
+	} else {
+		buffer.push_back('b');
+		if (fill != 0) {
+			buffer.push_back(fill);
+		} else {
+			// Leading zeros are implied
+			int top = std::min(width, 64)-1;
+			while (top > 0 and ((bits >> top)&1) == 0) {
+				top--;
+			}
+			for (int i = top; i >= 0; i--) {
+				buffer.push_back((char)('0' + ((bits >> i)&1)));
+			}
+		}
+		buffer.push_back(' ');
+	}
+	buffer += ids[var];
+	buffer.push_back('\n');
+}
+
+/**
+ * @brief Pass the current block to the writer thread
+ *
+ * Blocks if the writer has fallen maxPending blocks behind, then picks up a
+ * recycled block to format into next.
+ */
+void vcdWriter::handoff() {
+	if (buffer.empty()) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [this]() { return pending.size() < maxPending; });
+	pending.push_back(std::move(buffer));
+	if (not spare.empty()) {
+		buffer = std::move(spare.back());
+		spare.pop_back();
+	} else {
+		buffer = string();
+		buffer.reserve(blockSize);
+	}
+	guard.unlock();
+	changed.notify_all();
+}
+
+void vcdWriter::run() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (true) {
+		changed.wait(guard, [this]() { return done or not pending.empty(); });
+		if (pending.empty()) {
+			return;
+		}
+
+		string block = std::move(pending.front());
+		pending.pop_front();
+		guard.unlock();
+		changed.notify_all();
+
+		os->write(block.data(), block.size());
+		block.clear();
+
+		guard.lock();
+		spare.push_back(std::move(block));
+	}
+}
+
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#include <common/standard.h>
+#include <arithmetic/expression.h>
+
+#include "simulator.h"
+
+namespace chp
+{
+
+// Streams the value changes of a simulation to a Value Change Dump.
+//
+// Every variable is declared as a wire, with the width given by
+// inferWidths(). After each firing, the new encoding is compared against the
+// last one written and only the variables that changed are emitted, stamped
+// with simulator::now in picoseconds. Unknown values ('-') are written as x
+// and unstable values ('X') as z. Integers are written in two's complement
+// truncated to the width of the wire.
+//
+// The simulation thread only formats text into a block. Full blocks are
+// handed to a writer thread, and blocks that have been written are recycled.
+// At most maxPending blocks are in flight at once, so the memory use is
+// bounded no matter how long the run is.
+struct vcdWriter : observer
+{
+	vcdWriter();
+	~vcdWriter();
+
+	ostream *os;
+	std::ofstream file;
+
+	size_t blockSize;
+	size_t maxPending;
+
+	// The block being formatted by the simulation thread.
+	string buffer;
+
+	// Shared with the writer thread.
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<string> pending;
+	vector<string> spare;
+	bool done;
+	std::thread worker;
+
+	vector<string> ids;
+	vector<int> widths;
+	vector<arithmetic::Value> last;
+	uint64_t time;
+
+	void open(ostream &os);
+	bool open(const string &path);
+	bool is_open() const;
+
+	// Write the declarations and the initial values, and add this writer to
+	// the simulator's observers.
+	void attach(simulator &sim, int defaultWidth=32);
+	void fired(const simulator &sim, int choice, term_index t) override;
+
+	// Write everything that's left and stop the writer thread. This is
+	// called by the destructor if it hasn't been called already.
+	void close();
+
+	void emit(size_t var, const arithmetic::Value &value);
+	void handoff();
+	void run();
+};
+
+}
@@ -0,0 +1,370 @@
+#include "width.h"
+#include "expression.h"
+
+#include <algorithm>
+
+#include <arithmetic/algorithm.h>
+
+namespace chp
+{
+
+// The widest datapath we'll infer. Anything wider falls back to this.
+const int MAX_WIDTH = 64;
+
+// The number of rounds a variable on a dependence cycle may keep growing
+// before it is widened.
+const int WIDEN_AFTER = 4;
+
+int widthOf(const arithmetic::Value &v) {
+	if (v.type == arithmetic::Value::BOOL) {
+		return 1;
+	} else if (v.type == arithmetic::Value::INT) {
+		uint64_t mag = v.ival < 0 ? (uint64_t)(-(v.ival+1)) : (uint64_t)v.ival;
+		int bits = 1;
+		while (bits < MAX_WIDTH and (mag >> bits) != 0) {
+			bits++;
+		}
+		// Negative constants need a sign bit
+		return std::min(MAX_WIDTH, bits + (v.ival < 0 ? 1 : 0));
+	}
+	return 0;
+}
+
+/**
+ * @brief The width of op, reading the built-in id of each call from calls
+ * if it is given rather than from the name
+ */
+int widthOf(const arithmetic::Expression &e, const arithmetic::Operand &op, const vector<int> &widths, int defaultWidth, const builtinTable *calls) {
+	if (op.isConst()) {
+		int w = widthOf(op.cnst);
+		return w > 0 ? w : defaultWidth;
+	} else if (op.isVar()) {
+		return op.index < widths.size() ? widths[op.index] : defaultWidth;
+	} else if (not op.isExpr()) {
+		return 0;
+	}
+
+	const arithmetic::Operation &operation = *e.getExpr(op.index);
+	vector<int> args;
+	for (const arithmetic::Operand &arg : operation.operands) {
+		args.push_back(operation.func == arithmetic::Operation::OpType::CALL ? 0 : widthOf(e, arg, widths, defaultWidth, calls));
+	}
+	auto arg = [&args](size_t i) {
+		return i < args.size() ? args[i] : 0;
+	};
+
+	int result = defaultWidth;
+	switch (operation.func) {
+	case arithmetic::Operation::OpType::VALIDITY:
+	case arithmetic::Operation::OpType::BOOLEAN_NOT:
+	case arithmetic::Operation::OpType::EQUAL:
+	case arithmetic::Operation::OpType::NOT_EQUAL:
+	case arithmetic::Operation::OpType::LESS:
+	case arithmetic::Operation::OpType::GREATER:
+	case arithmetic::Operation::OpType::LESS_EQUAL:
+	case arithmetic::Operation::OpType::GREATER_EQUAL:
+	case arithmetic::Operation::OpType::BOOLEAN_OR:
+	case arithmetic::Operation::OpType::BOOLEAN_AND:
+	case arithmetic::Operation::OpType::BOOLEAN_XOR:
+		result = 1;
+		break;
+	case arithmetic::Operation::OpType::BITWISE_NOT:
+	case arithmetic::Operation::OpType::IDENTITY:
+	case arithmetic::Operation::OpType::INVERSE:
+	case arithmetic::Operation::OpType::DIVIDE:
+	case arithmetic::Operation::OpType::RIGHT_SHIFT:
+		result = arg(0);
+		break;
+	case arithmetic::Operation::OpType::NEGATION:
+		result = arg(0)+1;
+		break;
+	case arithmetic::Operation::OpType::BITWISE_AND:
+		result = std::min(arg(0), arg(1));
+		break;
+	case arithmetic::Operation::OpType::BITWISE_OR:
+	case arithmetic::Operation::OpType::BITWISE_XOR:
+		result = std::max(arg(0), arg(1));
+		break;
+	case arithmetic::Operation::OpType::ADD:
+	case arithmetic::Operation::OpType::SUBTRACT:
+		result = std::max(arg(0), arg(1))+1;
+		break;
+	case arithmetic::Operation::OpType::MULTIPLY:
+		result = arg(0)+arg(1);
+		break;
+	case arithmetic::Operation::OpType::MOD:
+		result = arg(1);
+		break;
+	case arithmetic::Operation::OpType::LEFT_SHIFT:
+		if (operation.operands.size() > 1 and operation.operands[1].isConst()
+			and operation.operands[1].cnst.type == arithmetic::Value::INT) {
+			result = arg(0) + (int)std::min((int64_t)MAX_WIDTH, std::max((int64_t)0, operation.operands[1].cnst.ival));
+		} else {
+			result = MAX_WIDTH;
+		}
+		break;
+	case arithmetic::Operation::OpType::TERNARY:
+		result = std::max(arg(1), arg(2));
+		break;
+	case arithmetic::Operation::OpType::CALL: {
+		int id = calls != nullptr ? (*calls)[op.index] : builtinOf(operation);
+		if (id == PROBE) {
+			result = 1;
+		} else if (id == RECV and operation.operands.size() > 1) {
+			size_t channel = arithmetic::lvalueBase(e, e.getExpr(operation.operands[1].index)->operands[0]);
+			result = channel < widths.size() ? widths[channel] : defaultWidth;
+		} else if (id == SEND) {
+			result = 0;
+		}
+	} break;
+	default:
+		break;
+	}
+
+	return std::min(result, MAX_WIDTH);
+}
+
+int widthOf(const arithmetic::Expression &e, const arithmetic::Operand &op, const vector<int> &widths, int defaultWidth) {
+	return widthOf(e, op, widths, defaultWidth, nullptr);
+}
+
+// One value that a variable or channel has to hold: the subexpression op of
+// e, assigned to a variable or sent on a channel.
+struct widthSource {
+	size_t target;
+	const arithmetic::Expression *e;
+	arithmetic::Operand op;
+	size_t calls;
+};
+
+/**
+ * @brief Collect the variables that the subexpression op of e reads
+ */
+void collectReads(const arithmetic::Expression &e, const arithmetic::Operand &op, vector<size_t> &reads) {
+	if (op.isVar()) {
+		reads.push_back(op.index);
+	} else if (op.isExpr()) {
+		for (const arithmetic::Operand &arg : e.getExpr(op.index)->operands) {
+			collectReads(e, arg, reads);
+		}
+	}
+}
+
+/**
+ * @brief Record a source for every value sent in e on its channel
+ */
+void collectSends(const arithmetic::Expression &e, const builtinTable &calls, size_t table, size_t nvars, vector<widthSource> &sources) {
+	for (const arithmetic::Operand &operand : e.exprIndex()) {
+		const arithmetic::Operation &operation = *e.getExpr(operand.index);
+		if (calls[operand.index] != SEND or operation.operands.size() < 3) {
+			continue;
+		}
+
+		size_t channel = arithmetic::lvalueBase(e, e.getExpr(operation.operands[1].index)->operands[0]);
+		if (channel < nvars) {
+			sources.push_back(widthSource{channel, &e, operation.operands[2], table});
+		}
+	}
+}
+
+/**
+ * @brief Group the variables into strongly connected components of the
+ * dependence graph, with every component after the ones it reads from
+ */
+vector<vector<size_t> > dependenceOrder(const vector<vector<size_t> > &readers) {
+	size_t n = readers.size();
+	vector<int> index(n, -1), low(n, 0);
+	vector<bool> onStack(n, false);
+	vector<size_t> stack;
+	vector<vector<size_t> > result;
+	int count = 0;
+
+	// Tarjan's algorithm, with an explicit stack of (node, next edge)
+	vector<pair<size_t, size_t> > work;
+	for (size_t root = 0; root < n; root++) {
+		if (index[root] >= 0) {
+			continue;
+		}
+		work.push_back({root, 0});
+		while (not work.empty()) {
+			size_t v = work.back().first;
+			size_t &edge = work.back().second;
+			if (edge == 0 and index[v] < 0) {
+				index[v] = low[v] = count++;
+				stack.push_back(v);
+				onStack[v] = true;
+			}
+
+			if (edge < readers[v].size()) {
+				size_t w = readers[v][edge++];
+				if (index[w] < 0) {
+					work.push_back({w, 0});
+				} else if (onStack[w]) {
+					low[v] = std::min(low[v], index[w]);
+				}
+				continue;
+			}
+
+			if (low[v] == index[v]) {
+				result.push_back(vector<size_t>());
+				size_t w;
+				do {
+					w = stack.back();
+					stack.pop_back();
+					onStack[w] = false;
+					result.back().push_back(w);
+				} while (w != v);
+			}
+			work.pop_back();
+			if (not work.empty()) {
+				size_t u = work.back().first;
+				low[u] = std::min(low[u], low[v]);
+			}
+		}
+	}
+
+	// Tarjan finishes the readers before the variables they read from
+	std::reverse(result.begin(), result.end());
+	return result;
+}
+
+vector<int> inferWidths(const graph &g, int defaultWidth) {
+	size_t nvars = g.vars.size();
+
+	// Find every value assigned to a variable or sent on a channel. The calls
+	// in every guard and action are resolved once, since a cycle walks the
+	// same expressions every round.
+	vector<builtinTable> tables;
+	vector<const arithmetic::Expression*> exprs;
+	for (size_t t = 0; t < g.transitions.size(); t++) {
+		if (not g.transitions.is_valid(t)) {
+			continue;
+		}
+		exprs.push_back(&g.transitions[t].guard);
+		for (const arithmetic::Parallel &term : g.transitions[t].action.terms) {
+			for (const arithmetic::Action &action : term.actions) {
+				exprs.push_back(&action.rvalue);
+			}
+		}
+	}
+	for (const arithmetic::Expression *e : exprs) {
+		tables.push_back(builtinTable(*e));
+	}
+
+	vector<widthSource> sources;
+	size_t table = 0;
+	for (size_t t = 0; t < g.transitions.size(); t++) {
+		if (not g.transitions.is_valid(t)) {
+			continue;
+		}
+		collectSends(g.transitions[t].guard, tables[table], table, nvars, sources);
+		table++;
+		for (const arithmetic::Parallel &term : g.transitions[t].action.terms) {
+			for (const arithmetic::Action &action : term.actions) {
+				collectSends(action.rvalue, tables[table], table, nvars, sources);
+				if (not action.lvalue.isUndef()) {
+					size_t v = arithmetic::lvalueBase(action.lvalue, action.lvalue.top);
+					if (v < nvars) {
+						sources.push_back(widthSource{v, &action.rvalue, action.rvalue.top, table});
+					}
+				}
+				table++;
+			}
+		}
+	}
+
+	// Variables that are never written inside the graph are driven by the
+	// environment.
+	vector<bool> written(nvars, false);
+	vector<vector<size_t> > sourcesOf(nvars);
+	for (size_t i = 0; i < sources.size(); i++) {
+		written[sources[i].target] = true;
+		sourcesOf[sources[i].target].push_back(i);
+	}
+
+	// An edge from each variable to every variable whose width depends on it.
+	// The isochronic regions of a variable share its width.
+	vector<vector<size_t> > readers(nvars);
+	vector<bool> selfEdge(nvars, false);
+	for (const widthSource &source : sources) {
+		vector<size_t> reads;
+		collectReads(*source.e, source.op, reads);
+		for (size_t v : reads) {
+			if (v < nvars) {
+				readers[v].push_back(source.target);
+				selfEdge[v] = selfEdge[v] or v == source.target;
+			}
+		}
+	}
+	for (size_t v = 0; v < nvars; v++) {
+		for (int r : g.vars[v].remote) {
+			if (r >= 0 and (size_t)r < nvars and written[v]) {
+				readers[r].push_back(v);
+			}
+		}
+	}
+
+	vector<int> widths(nvars, 0);
+	for (size_t v = 0; v < nvars; v++) {
+		if (not written[v]) {
+			widths[v] = defaultWidth;
+		}
+	}
+
+	// Everything a component reads from is final by the time it is reached.
+	// A variable outside of any cycle therefore gets exactly the width of its
+	// values in one round, however long the chain feeding it.
+	for (const vector<size_t> &component : dependenceOrder(readers)) {
+		bool cyclic = component.size() > 1 or selfEdge[component[0]];
+
+		vector<bool> frozen(component.size(), false);
+		vector<int> growing(component.size(), 0);
+		bool change = true;
+		while (change) {
+			vector<int> next(component.size(), 0);
+			for (size_t i = 0; i < component.size(); i++) {
+				size_t v = component[i];
+				next[i] = widths[v];
+				if (not written[v]) {
+					continue;
+				}
+				for (size_t s : sourcesOf[v]) {
+					const widthSource &source = sources[s];
+					next[i] = std::max(next[i], widthOf(*source.e, source.op, widths, defaultWidth, &tables[source.calls]));
+				}
+				for (int r : g.vars[v].remote) {
+					if (r >= 0 and (size_t)r < nvars) {
+						next[i] = std::max(next[i], widths[r]);
+					}
+				}
+			}
+
+			change = false;
+			for (size_t i = 0; i < component.size(); i++) {
+				size_t v = component[i];
+				if (next[i] <= widths[v] or frozen[i]) {
+					continue;
+				}
+
+				// A variable on a cycle that keeps growing, like a counter, is
+				// widened and then holds its width. Its values wrap around like
+				// a register of that width would.
+				if (cyclic) {
+					change = true;
+					if (++growing[i] > WIDEN_AFTER) {
+						next[i] = std::max(next[i], defaultWidth);
+						frozen[i] = true;
+					}
+				}
+				widths[v] = std::min(next[i], MAX_WIDTH);
+			}
+		}
+	}
+
+	for (size_t v = 0; v < nvars; v++) {
+		widths[v] = std::max(widths[v], 1);
+	}
+	return widths;
+}
+
+}
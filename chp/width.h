@@ -0,0 +1,37 @@
+#pragma once
+
+#include <common/standard.h>
+#include <arithmetic/expression.h>
+
+#include "graph.h"
+
+namespace chp
+{
+
+// Bit-width inference over the variables and channels of a graph.
+//
+// Every variable starts at zero bits and grows to fit each value assigned
+// to it. Channels grow to fit each value sent on them. Constants take the
+// bits needed to represent them, comparisons and boolean operations take
+// one bit, and arithmetic grows the widths of its operands (one carry bit
+// for addition, the sum of the widths for multiplication). Variables that
+// are never written inside the graph, like input channels, are driven by
+// the environment and get the default width.
+//
+// Variables are sized in dependence order, so a variable that isn't on a
+// dependence cycle gets exactly the width of the values assigned to it, up
+// to the widest datapath, no matter how long the chain of assignments that
+// feeds it. Only a variable on a cycle, like i in i=i+1, can keep growing.
+// Once it has grown for a few rounds it is widened to the larger of its
+// current width and the default width and then holds that width. Its values
+// wrap around like a register of that width would. Widening never narrows a
+// variable below a width the analysis has already seen.
+//
+// The result is indexed by variable, and every entry is at least one bit.
+vector<int> inferWidths(const graph &g, int defaultWidth);
+
+// The width of the subexpression op of e given the widths of the variables.
+int widthOf(const arithmetic::Expression &e, const arithmetic::Operand &op, const vector<int> &widths, int defaultWidth);
+int widthOf(const arithmetic::Value &v);
+
+}
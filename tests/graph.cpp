@@ -1,8 +1,15 @@
+#include <bit>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
 
 #include <gtest/gtest.h>
 
+#include <chp/cache.h>
+#include <chp/dataflow.h>
 #include <chp/graph.h>
+#include <chp/journal.h>
+#include <chp/serialize.h>
 //#include <common/standard.h>
 #include <interpret_chp/export_dot.h>
 #include <interpret_chp/import_chp.h>
@@ -532,6 +539,449 @@ TEST(BranchFlatten, Arbiter) {
 }
 
 
+int countValidTransitions(const chp::graph &g) {
+	int count = 0;
+	for (int i = 0; i < (int)g.transitions.size(); i++) {
+		count += g.transitions.is_valid(i) ? 1 : 0;
+	}
+	return count;
+}
+
+
+TEST(BranchFlatten, SharedTails) {
+	std::string source = R"(
+*[
+  [   b1 ->
+    [   b0 -> x=3
+    [] ~b0 -> x=2
+    ]
+  [] ~b1 ->
+    [   b0 -> x=1
+    [] ~b0 -> x=0
+    ]
+  ]; R!x; y=L?
+]
+		)";
+
+	chp::graph copied = _importCHPFromString(source);
+	copied.flatten();
+
+	chp::graph shared = _importCHPFromString(source);
+	shared.flatten(false, true);
+
+	// Every flattened branch ends in the same "R!x; y=L?" tail
+	EXPECT_LT(countValidTransitions(shared), countValidTransitions(copied));
+}
+
+
+TEST(Graph, Compact) {
+	std::string source = R"(
+*[
+  [   b1 ->
+    [   b0 -> x=3
+    [] ~b0 -> x=2
+    ]
+  [] ~b1 ->
+    [   b0 -> x=1
+    [] ~b0 -> x=0
+    ]
+  ]; R!x; y=L?
+]
+		)";
+
+	chp::graph g = _importCHPFromString(source);
+	g.flatten();
+	int valid = countValidTransitions(g);
+	size_t arcs = g.arcs[chp::place::type].size() + g.arcs[chp::transition::type].size();
+
+	Mapping<petri::iterator> m = g.compact();
+
+	// No holes remain and nothing valid was lost
+	EXPECT_EQ((int)g.transitions.size(), valid);
+	EXPECT_EQ(countValidTransitions(g), valid);
+	for (int i = 0; i < (int)g.places.size(); i++) {
+		EXPECT_TRUE(g.places.is_valid(i));
+	}
+	EXPECT_EQ(g.arcs[chp::place::type].size() + g.arcs[chp::transition::type].size(), arcs);
+	EXPECT_TRUE(g.isFlat());
+
+	ASSERT_FALSE(g.reset.empty());
+	for (const petri::token &t : g.reset[0].tokens) {
+		EXPECT_LT(t.index, (int)g.places.size());
+	}
+}
+
+
+void expectConsistentControlFlow(const chp::graph &g) {
+	const chp::graph::controlFlow &cfg = g.controlFlowGraph;
+	for (int t = 0; t < (int)g.transitions.size(); t++) {
+		if (g.transitions.is_valid(t)) {
+			EXPECT_GE(cfg.transitionToBlock[t], 0);
+		}
+	}
+
+	// Every successor edge has a matching predecessor edge
+	for (size_t b = 0; b < cfg.size(); b++) {
+		EXPECT_EQ(cfg[b].uid, b);
+		for (size_t s : cfg.outsOf(b)) {
+			auto ins = cfg.insOf(s);
+			EXPECT_NE(std::find(ins.begin(), ins.end(), b), ins.end());
+		}
+	}
+}
+
+
+TEST(ControlFlowGraph, Terminating) {
+	chp::graph g = _importCHPFromString("x=L?; y=x+1; R!y");
+	g.computeControlFlowGraph();
+
+	EXPECT_TRUE(g.controlFlowGraphReady);
+	ASSERT_GE(g.controlFlowGraph.size(), 1u);
+	expectConsistentControlFlow(g);
+}
+
+
+TEST(ControlFlowGraph, Selection) {
+	std::string source = R"(
+*[x=L?;
+	[ x==0 -> R0!x
+	[] x==1 -> R1!x
+	]
+]
+		)";
+
+	chp::graph g = _importCHPFromString(source);
+	g.computeControlFlowGraph();
+
+	// The receive, both branches, and the merge back to the receive
+	EXPECT_GE(g.controlFlowGraph.size(), 3u);
+	expectConsistentControlFlow(g);
+
+	bool entry = false;
+	for (size_t b = 0; b < g.controlFlowGraph.size(); b++) {
+		entry = entry or g.controlFlowGraph[b].entry;
+	}
+	EXPECT_TRUE(entry);
+}
+
+
+TEST(Journal, Rollback) {
+	chp::graph g = _importCHPFromString("*[x=L?; y=x+1; R!y]");
+	int transitions = countValidTransitions(g);
+	size_t arcs = g.arcs[chp::place::type].size() + g.arcs[chp::transition::type].size();
+
+	petri::iterator t0;
+	for (int i = 0; i < (int)g.transitions.size() and t0.index < 0; i++) {
+		if (g.transitions.is_valid(i)) {
+			t0 = petri::iterator(chp::transition::type, i);
+		}
+	}
+	ASSERT_GE(t0.index, 0);
+	string key = g.transitions[t0.index].key();
+
+	chp::journal j(&g);
+	j.checkpoint();
+	petri::iterator t = j.create(chp::transition());
+	petri::iterator p = j.create(chp::place());
+	j.connect(p, t);
+	j.connect(t, g.next(t0)[0]);
+	j.erase_arc(g.in(t0)[0]);
+	j.setGuard(t0, arithmetic::Expression::gnd());
+	EXPECT_NE(g.transitions[t0.index].key(), key);
+
+	j.rollback();
+	EXPECT_EQ(countValidTransitions(g), transitions);
+	EXPECT_EQ(g.arcs[chp::place::type].size() + g.arcs[chp::transition::type].size(), arcs);
+	EXPECT_EQ(g.transitions[t0.index].key(), key);
+	EXPECT_TRUE(j.edits.empty());
+}
+
+
+TEST(Journal, Snapshot) {
+	std::string source = R"(
+*[
+  [   b1 ->
+    [   b0 -> x=1
+    [] ~b0 -> x=0
+    ]
+  [] ~b1 -> x=2
+  ]; R!x
+]
+		)";
+
+	chp::graph g = _importCHPFromString(source);
+	int transitions = countValidTransitions(g);
+
+	g.computeControlFlowGraph();
+	size_t blocks = g.controlFlowGraph.size();
+
+	chp::journal j(&g);
+	j.checkpoint();
+	j.snapshot();
+
+	// The analyses are moved aside for the copy and then put back
+	EXPECT_TRUE(g.controlFlowGraphReady);
+	EXPECT_EQ(g.controlFlowGraph.size(), blocks);
+
+	g.flatten();
+	EXPECT_TRUE(g.isFlat());
+
+	// Edits covered by the snapshot aren't recorded
+	j.create(chp::place());
+	EXPECT_EQ(j.edits.size(), 1u);
+
+	j.rollback();
+	EXPECT_EQ(countValidTransitions(g), transitions);
+	EXPECT_FALSE(g.isFlat());
+
+	// A snapshot in a committed inner checkpoint covers the outer one, and
+	// one in a rolled back checkpoint doesn't
+	j.checkpoint();
+	j.checkpoint();
+	j.snapshot();
+	j.commit();
+	EXPECT_FALSE(j.recording());
+	j.rollback();
+
+	j.checkpoint();
+	j.checkpoint();
+	j.snapshot();
+	j.rollback();
+	EXPECT_TRUE(j.recording());
+	j.rollback();
+}
+
+
+TEST(Serialize, RoundTrip) {
+	chp::graph g = _importCHPFromString("*[x=L?; [x==0 -> R0!x [] x==1 -> R1!(x+1)]]");
+	g.post_process(true, false);
+
+	std::stringstream buffer;
+	chp::write(buffer, g);
+	chp::graph h;
+	ASSERT_TRUE(chp::read(buffer, h));
+
+	EXPECT_EQ(countValidTransitions(h), countValidTransitions(g));
+	EXPECT_EQ(chp::structuralHash(h), chp::structuralHash(g));
+
+	vector<string> expected, actual;
+	for (int i = 0; i < (int)g.transitions.size(); i++) {
+		if (g.transitions.is_valid(i)) {
+			expected.push_back(g.transitions[i].guard.to_string());
+		}
+	}
+	for (int i = 0; i < (int)h.transitions.size(); i++) {
+		if (h.transitions.is_valid(i)) {
+			actual.push_back(h.transitions[i].guard.to_string());
+		}
+	}
+	EXPECT_EQ(actual, expected);
+
+	// Expressions are written as operation records, so the string pool only
+	// holds names
+	if (std::endian::native == std::endian::little) {
+		string data = buffer.str();
+		vector<uint64_t> aligned((data.size()+7)/8);
+		memcpy(aligned.data(), data.data(), data.size());
+		chp::graphView view;
+		ASSERT_TRUE(view.open((const char*)aligned.data(), data.size()));
+		EXPECT_FALSE(view.operations.empty());
+		EXPECT_EQ(string(view.strings.data(), view.strings.size()).find("=="), string::npos);
+	}
+}
+
+
+TEST(Serialize, LoadMapped) {
+	chp::graph g = _importCHPFromString("*[x=L?; [x==0 -> R0!x [] x==1 -> R1!(x+1)]]");
+	g.post_process(true, false);
+	g.name = "split";
+
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "chp_serialize_test.chpg";
+	ASSERT_TRUE(chp::save(path.string(), g));
+
+	chp::graph h;
+	ASSERT_TRUE(chp::load(path.string(), h));
+	EXPECT_EQ(h.name, g.name);
+	EXPECT_EQ(h.vars.size(), g.vars.size());
+	EXPECT_EQ(chp::structuralHash(h), chp::structuralHash(g));
+
+	// A file from a different format version is rejected
+	std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+	uint32_t version = chp::SERIAL_VERSION+1;
+	file.seekp(offsetof(chp::serialHeader, version));
+	file.write((const char*)&version, sizeof(version));
+	file.close();
+	EXPECT_FALSE(chp::load(path.string(), h));
+
+	std::filesystem::remove(path);
+}
+
+
+TEST(Serialize, LittleEndian) {
+	chp::graph g = _importCHPFromString("*[x=L?; R!x]");
+	g.post_process(true, false);
+
+	// The magic number reads "CHPG" and the version is a little-endian word
+	// on every host
+	std::stringstream buffer;
+	chp::write(buffer, g);
+	string data = buffer.str();
+	ASSERT_GE(data.size(), sizeof(chp::serialHeader));
+	EXPECT_EQ(data.substr(0, 4), "CHPG");
+	EXPECT_EQ((unsigned char)data[4], chp::SERIAL_VERSION & 0xff);
+	EXPECT_EQ(data[7], 0);
+
+	arithmetic::Value value;
+	value.type = arithmetic::Value::INT;
+	value.bval = false;
+	value.ival = 0x0102;
+	value.rval = 0.0;
+	string encoded;
+	chp::writeValue(encoded, value);
+	EXPECT_EQ(encoded[16], 0x02);
+	EXPECT_EQ(encoded[17], 0x01);
+
+	arithmetic::Value decoded;
+	std::string_view view(encoded);
+	ASSERT_TRUE(chp::readValue(view, decoded));
+	EXPECT_EQ(decoded.ival, value.ival);
+	EXPECT_TRUE(view.empty());
+}
+
+
+TEST(Cache, FlattenHit) {
+	std::filesystem::path root = std::filesystem::temp_directory_path() / "chp_cache_test";
+	std::filesystem::remove_all(root);
+	chp::diskCache cache(root);
+
+	std::string source = R"(
+*[
+  [   b1 ->
+    [   b0 -> x=1
+    [] ~b0 -> x=0
+    ]
+  [] ~b1 -> x=2
+  ]; R!x
+]
+		)";
+
+	chp::graph first = _importCHPFromString(source);
+	chp::cachedFlatten(first, cache);
+	EXPECT_EQ(cache.hits, 0u);
+
+	// The key doesn't depend on the name, and a hit keeps the name of the
+	// graph and leaves the split groups computed like flatten() would
+	chp::graph second = _importCHPFromString(source);
+	second.name = "renamed";
+	chp::cachedFlatten(second, cache);
+	EXPECT_EQ(cache.hits, 1u);
+	EXPECT_EQ(second.name, "renamed");
+	EXPECT_TRUE(second.split_groups_ready);
+	EXPECT_FALSE(second.controlFlowGraphReady);
+	EXPECT_FALSE(second.useDefChainsReady);
+	EXPECT_EQ(chp::structuralHash(second), chp::structuralHash(first));
+
+	// An entry whose stored input differs is a miss even if its key matches,
+	// and an entry that can't be read is a miss that gets replaced
+	chp::graph third = _importCHPFromString(source);
+	string input = chp::passInput(third, "flatten 0");
+	uint64_t key = chp::passKey(third, "flatten 0");
+	string blob;
+	EXPECT_TRUE(cache.load(key, input, blob));
+	EXPECT_FALSE(cache.load(key, input + " ", blob));
+
+	cache.store(key, input, "corrupt");
+	chp::cachedFlatten(third, cache);
+	EXPECT_EQ(cache.hits, 1u);
+	EXPECT_EQ(cache.misses, 2u);
+	EXPECT_EQ(chp::structuralHash(third), chp::structuralHash(first));
+	ASSERT_TRUE(cache.load(key, input, blob));
+	EXPECT_NE(blob, "corrupt");
+
+	// The running size matches a fresh scan of the directory
+	uintmax_t size = cache.size;
+	cache.scan();
+	EXPECT_EQ(cache.size, size);
+
+	// Temporary files never collide, even for the same key
+	EXPECT_NE(cache.tempOf(1), cache.tempOf(1));
+	EXPECT_EQ(cache.tempOf(1).extension(), ".tmp");
+
+	// With no capacity, every entry is evicted
+	cache.capacity = 0;
+	cache.evict();
+	EXPECT_TRUE(std::filesystem::is_empty(root));
+	std::filesystem::remove_all(root);
+}
+
+
+TEST(Dataflow, Counter) {
+	std::string source = R"(
+*[x=L?; y=x+1; z=y*2; R!z]
+		)";
+
+	chp::graph g = _importCHPFromString(source);
+	chp::dataflow df(g);
+
+	int x = g.netIndex("x");
+	int z = g.netIndex("z");
+	ASSERT_GE(x, 0);
+	ASSERT_GE(z, 0);
+
+	// x, y and z are each assigned once
+	EXPECT_GE(df.defs.size(), 3u);
+	EXPECT_EQ(df.reachIn.size(), g.controlFlowGraph.size());
+	EXPECT_EQ(df.liveIn.size(), g.controlFlowGraph.size());
+
+	int y = g.netIndex("y");
+	ASSERT_GE(y, 0);
+	int xdef = -1, ydef = -1;
+	for (size_t d = 0; d < df.defs.size(); d++) {
+		if (df.defs[d].var == (size_t)x) {
+			xdef = (int)d;
+		} else if (df.defs[d].var == (size_t)y) {
+			ydef = (int)d;
+		}
+	}
+	ASSERT_GE(xdef, 0);
+	ASSERT_GE(ydef, 0);
+
+	// The definition of x is read by the transition that computes y
+	const vector<size_t> &sites = df.useSites[xdef];
+	EXPECT_NE(find(sites.begin(), sites.end(), df.defs[ydef].transition), sites.end());
+
+	// Every variable is assigned once per iteration, so no two definitions
+	// reach the same use and every definition is its own web
+	EXPECT_EQ(df.webCount, (int)df.defs.size());
+	EXPECT_NE(df.web[xdef], df.web[ydef]);
+
+	// x is live from its definition to its use. If they are in different
+	// blocks, it is live out of the block that defines it.
+	size_t xblock = g.controlFlowGraph.transitionToBlock[df.defs[xdef].transition];
+	size_t yblock = g.controlFlowGraph.transitionToBlock[df.defs[ydef].transition];
+	if (xblock != yblock) {
+		EXPECT_TRUE(df.liveOut[xblock].test(x));
+	}
+
+	// The liveness sets are a fixed point of the dataflow equations
+	for (size_t b = 0; b < g.controlFlowGraph.size(); b++) {
+		chp::bitvector out(g.vars.size());
+		for (size_t s : g.controlFlowGraph.outsOf(b)) {
+			out |= df.liveIn[s];
+		}
+		EXPECT_EQ(df.liveOut[b], out) << "block " << b;
+		EXPECT_EQ(df.liveIn[b], df.use[b] | (out - df.def[b])) << "block " << b;
+	}
+
+	// Editing the graph drops the analyses so they are computed again
+	EXPECT_TRUE(g.controlFlowGraphReady);
+	EXPECT_TRUE(g.useDefChainsReady);
+	g.post_process(true, false);
+	EXPECT_FALSE(g.controlFlowGraphReady);
+	EXPECT_FALSE(g.useDefChainsReady);
+}
+
+
 //TEST(BranchFlatten, Router) {
 //	std::string source = R"(
 //*[
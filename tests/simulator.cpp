@@ -0,0 +1,739 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+
+#include <gtest/gtest.h>
+
+#include <chp/coverage.h>
+#include <chp/expression.h>
+#include <chp/graph.h>
+#include <chp/guided.h>
+#include <chp/instrument.h>
+#include <chp/simulator.h>
+#include <chp/trace.h>
+#include <chp/vcd.h>
+#include <common/standard.h>
+#include <interpret_chp/import_chp.h>
+#include <parse/default/block_comment.h>
+#include <parse/default/line_comment.h>
+#include <parse/tokenizer.h>
+#include <parse_chp/composition.h>
+#include <parse_chp/factory.h>
+
+// Every allocation made by the test binary is counted, so that a test can
+// check how many a piece of code makes.
+std::atomic<size_t> allocations(0);
+
+void *operator new(size_t size) {
+	allocations++;
+	void *result = malloc(size > 0 ? size : 1);
+	if (result == nullptr) {
+		throw std::bad_alloc();
+	}
+	return result;
+}
+
+void operator delete(void *ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+	free(ptr);
+}
+
+chp::graph importCHPForSimulation(const string &chp_string) {
+	tokenizer tokens;
+	tokens.register_token<parse::block_comment>(false);
+	tokens.register_token<parse::line_comment>(false);
+	parse_chp::register_syntax(tokens);
+
+	tokens.insert("string_input", chp_string, nullptr);
+	chp::graph g;
+
+	tokens.increment(false);
+	tokens.expect<parse_chp::composition>();
+	if (tokens.decrement(__FILE__, __LINE__)) {
+		parse_chp::composition syntax(tokens);
+		chp::import_chp(g, syntax, &tokens, true);
+	}
+
+	g.post_process(true, false);
+	return g;
+}
+
+// Run the simulator for a number of steps, cycling through the choices so
+// that the run isn't just the first enabled transition every time. Returns
+// the state after each step.
+vector<chp::state> simulateSteps(chp::simulator &sim, int steps) {
+	vector<chp::state> result;
+	for (int i = 0; i < steps; i++) {
+		int n = sim.enabled();
+		if (n == 0) {
+			break;
+		}
+		sim.fire(i%n);
+		result.push_back(sim.get_state());
+	}
+	return result;
+}
+
+// Count the chunks that b shares with a, and the chunks that b copied even
+// though none of their elements changed. same() compares two elements.
+template <typename T, typename Same>
+pair<int, int> compareChunks(const chp::chunked<T> &a, const chp::chunked<T> &b, Same same) {
+	pair<int, int> result(0, 0);
+	for (size_t c = 0; c < a.used() and c < b.used(); c++) {
+		if (b.shares(a, c)) {
+			result.first++;
+			continue;
+		}
+
+		bool changed = false;
+		for (size_t i = c*a.CHUNK; i < (c+1)*a.CHUNK and not changed; i++) {
+			changed = (i < a.size()) != (i < b.size())
+			  or (i < a.size() and not same(a[i], b[i]));
+		}
+		if (not changed) {
+			result.second++;
+		}
+	}
+	return result;
+}
+
+// Every chunk is shared
+template <typename T>
+bool sharesAll(const chp::chunked<T> &a, const chp::chunked<T> &b) {
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (size_t c = 0; c < a.used(); c++) {
+		if (not b.shares(a, c)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+TEST(Trace, SeekReplay) {
+	chp::graph g = importCHPForSimulation("*[(a=1, b=1); (a=0, b=0)]");
+	ASSERT_FALSE(g.reset.empty());
+
+	std::stringstream buffer;
+	chp::traceRecorder recorder;
+	recorder.open(buffer, 16);
+
+	chp::simulator sim(&g, g.reset[0]);
+	recorder.attach(sim);
+	vector<chp::state> states = simulateSteps(sim, 200);
+	recorder.close();
+	ASSERT_EQ(states.size(), 200u);
+
+	chp::traceReader reader;
+	ASSERT_TRUE(reader.open(buffer));
+	EXPECT_EQ(reader.steps, 200u);
+	EXPECT_EQ(reader.checkpoints.size(), 1u + 200u/16u);
+
+	// Seek forward, backward, and to the end
+	chp::simulator replay(&g, g.reset[0]);
+	for (uint64_t step : {150u, 37u, 38u, 200u, 1u}) {
+		ASSERT_TRUE(reader.seek(replay, step));
+		EXPECT_EQ(replay.get_state(), states[step-1]) << "at step " << step;
+		EXPECT_EQ(reader.position, (int64_t)step);
+	}
+
+	EXPECT_FALSE(reader.seek(replay, 201));
+}
+
+TEST(Trace, Unclosed) {
+	chp::graph g = importCHPForSimulation("*[(a=1, b=1); (a=0, b=0)]");
+	ASSERT_FALSE(g.reset.empty());
+
+	std::stringstream buffer;
+	chp::traceRecorder recorder;
+	recorder.open(buffer, 8);
+
+	chp::simulator sim(&g, g.reset[0]);
+	recorder.attach(sim);
+	vector<chp::state> states = simulateSteps(sim, 50);
+	ASSERT_EQ(states.size(), 50u);
+
+	// Without a trailer the reader falls back to scanning the records
+	std::stringstream partial(buffer.str());
+	chp::traceReader reader;
+	ASSERT_TRUE(reader.open(partial));
+	EXPECT_EQ(reader.steps, 50u);
+
+	chp::simulator replay(&g, g.reset[0]);
+	ASSERT_TRUE(reader.seek(replay, 42));
+	EXPECT_EQ(replay.get_state(), states[41]);
+}
+
+TEST(Waveform, ValueChanges) {
+	chp::graph g = importCHPForSimulation("*[(a=1, b=1); (a=0, b=0)]");
+	ASSERT_FALSE(g.reset.empty());
+
+	std::stringstream buffer;
+	chp::vcdWriter vcd;
+	// Small blocks so that the writer thread is exercised
+	vcd.blockSize = 64;
+	vcd.maxPending = 2;
+	vcd.open(buffer);
+
+	chp::simulator sim(&g, g.reset[0]);
+	vcd.attach(sim);
+	simulateSteps(sim, 100);
+	vcd.close();
+
+	string out = buffer.str();
+	EXPECT_NE(out.find("$enddefinitions $end"), string::npos);
+	EXPECT_NE(out.find(" a $end"), string::npos);
+	EXPECT_NE(out.find(" b $end"), string::npos);
+
+	// Every firing changes a or b, so there is a change after the dump
+	size_t dump = out.find("$dumpvars");
+	ASSERT_NE(dump, string::npos);
+	EXPECT_NE(out.find("\n#", dump), string::npos);
+}
+
+TEST(Snapshot, BranchAndRestore) {
+	chp::graph g = importCHPForSimulation("*[(a=1, b=1); (a=0, b=0)]");
+	ASSERT_FALSE(g.reset.empty());
+
+	chp::simulator sim(&g, g.reset[0]);
+	simulateSteps(sim, 10);
+	sim.enabled();
+
+	chp::snapshot root = sim.snapshot();
+	chp::state start = sim.get_state();
+
+	// Nothing changed, so nothing is copied
+	chp::snapshot again = sim.snapshot();
+	EXPECT_TRUE(sharesAll(again.tokens, root.tokens));
+	EXPECT_TRUE(sharesAll(again.loaded, root.loaded));
+	EXPECT_EQ(again.encoding.get(), root.encoding.get());
+
+	// Explore every choice from the same state
+	int n = (int)sim.ready.size();
+	vector<chp::state> branches;
+	for (int i = 0; i < n; i++) {
+		sim.restore(root);
+		EXPECT_EQ(sim.get_state(), start);
+		sim.fire(i);
+		branches.push_back(sim.get_state());
+
+		// Firing doesn't add errors in this process, so they stay shared
+		chp::snapshot branch = sim.snapshot();
+		EXPECT_EQ(branch.instability_errors.get(), root.instability_errors.get());
+		EXPECT_FALSE(sharesAll(branch.tokens, root.tokens));
+	}
+
+	// Replaying a branch gets to the same place
+	sim.restore(root);
+	sim.fire(n-1);
+	EXPECT_EQ(sim.get_state(), branches.back());
+
+	// Firing straight after a restore, without calling enabled() first, does
+	// the same as firing after enabled()
+	for (int i = 0; i < n; i++) {
+		sim.restore(root);
+		sim.enabled();
+		chp::enabled_transition expected = sim.fire(i);
+		chp::state afterEnabled = sim.get_state();
+		size_t loadedAfterEnabled = sim.loaded.size();
+
+		sim.restore(root);
+		chp::enabled_transition actual = sim.fire(i);
+		EXPECT_EQ(actual.index, expected.index);
+		EXPECT_EQ(actual.tokens, expected.tokens);
+		EXPECT_EQ(sim.get_state(), afterEnabled);
+		EXPECT_EQ(sim.loaded.size(), loadedAfterEnabled);
+	}
+
+	// After a restore, the simulator shares every part with the snapshot, so
+	// saving again right away copies nothing
+	sim.restore(root);
+	chp::snapshot restored = sim.snapshot();
+	EXPECT_TRUE(sharesAll(restored.history.arena, root.history.arena));
+	EXPECT_TRUE(sharesAll(restored.history.last, root.history.last));
+	EXPECT_EQ(restored.encoding.get(), root.encoding.get());
+	EXPECT_EQ(restored.global.get(), root.global.get());
+	EXPECT_TRUE(sharesAll(restored.tokens, root.tokens));
+	EXPECT_TRUE(sharesAll(restored.loaded, root.loaded));
+	EXPECT_EQ(restored.ready.get(), root.ready.get());
+	EXPECT_EQ(restored.mutex_errors.get(), root.mutex_errors.get());
+}
+
+TEST(Snapshot, SharesUntouchedChunks) {
+	// Enough parallel assignments that the tokens, the loaded transitions,
+	// and the history each span more than one chunk
+	string up, down;
+	for (int i = 0; i < 48; i++) {
+		up += (i > 0 ? ", a" : "a") + std::to_string(i) + "=1";
+		down += (i > 0 ? ", a" : "a") + std::to_string(i) + "=0";
+	}
+	chp::graph g = importCHPForSimulation("*[(" + up + "); (" + down + ")]");
+	ASSERT_FALSE(g.reset.empty());
+
+	// Run until every assignment of a phase is ready again
+	chp::simulator sim(&g, g.reset[0]);
+	int steps = 0;
+	while (steps < 200 and (steps < 48 or sim.enabled() != 48)) {
+		if (sim.enabled() == 0) {
+			break;
+		}
+		sim.fire(0);
+		steps++;
+	}
+	ASSERT_EQ((int)sim.ready.size(), 48);
+
+	chp::snapshot before = sim.snapshot();
+	sim.fire((int)sim.ready.size()-1);
+	chp::snapshot after = sim.snapshot();
+
+	// A chunk is only copied if the firing wrote to it
+	pair<int, int> tokens = compareChunks(before.tokens, after.tokens, [](const chp::token &a, const chp::token &b) {
+		return a.index == b.index and a.cause == b.cause;
+	});
+	pair<int, int> loaded = compareChunks(before.loaded, after.loaded, [](const chp::enabled_transition &a, const chp::enabled_transition &b) {
+		return a.index == b.index and a.since == b.since and a.fire_at == b.fire_at;
+	});
+	pair<int, int> arena = compareChunks(before.history.arena, after.history.arena, [](const chp::firing &a, const chp::firing &b) {
+		return a.seq == b.seq and a.live == b.live;
+	});
+	pair<int, int> last = compareChunks(before.history.last, after.history.last, [](const chp::history_ref &a, const chp::history_ref &b) {
+		return a.slot == b.slot and a.seq == b.seq;
+	});
+	EXPECT_EQ(tokens.second, 0);
+	EXPECT_EQ(loaded.second, 0);
+	EXPECT_EQ(arena.second, 0);
+	EXPECT_EQ(last.second, 0);
+
+	// The last transition fired, so the loaded transitions before its chunk
+	// are untouched, and only a few of the firings in the history change
+	EXPECT_GT(loaded.first, 0);
+	EXPECT_GT(tokens.first + arena.first + last.first, 0);
+
+	// The simulator and the snapshot it restores still share every chunk
+	sim.restore(before);
+	EXPECT_TRUE(sharesAll(sim.tokens, before.tokens));
+	EXPECT_TRUE(sharesAll(sim.loaded, before.loaded));
+	EXPECT_TRUE(sharesAll(sim.history.arena, before.history.arena));
+}
+
+TEST(History, Bounded) {
+	chp::graph g = importCHPForSimulation("*[(a=1, b=1); (a=0, b=0)]");
+	ASSERT_FALSE(g.reset.empty());
+
+	chp::simulator sim(&g, g.reset[0]);
+	simulateSteps(sim, 1000);
+	EXPECT_EQ(sim.history.next, 1000u);
+
+	// Only the last writer of each variable and the firings since the oldest
+	// enabled transition are kept
+	EXPECT_LE(sim.history.size(), 8u);
+
+	// The last firing is the last writer of every variable it assigned
+	size_t live = 0;
+	for (const chp::history_ref &ref : sim.history.last) {
+		if (sim.history.contains(ref)) {
+			live++;
+		}
+	}
+	EXPECT_GE(live, 1u);
+	EXPECT_LE(live, g.vars.size());
+}
+
+TEST(History, Unstable) {
+	// b=1 is enabled by a=1 and then disabled by a=0. The third process
+	// keeps firing before b=1 finally does.
+	chp::graph g = importCHPForSimulation("*[a=1; a=0] || *[[a -> b=1]; b=0] || *[c=1; c=0]");
+	ASSERT_FALSE(g.reset.empty());
+
+	chp::simulator sim(&g, g.reset[0]);
+	auto choose = [&](string action) {
+		sim.enabled();
+		for (int i = 0; i < (int)sim.ready.size(); i++) {
+			int t = sim.loaded[sim.ready[i].first].index;
+			if (chp::emit_composition(g.transitions[t].action, g).find(action) != string::npos) {
+				return i;
+			}
+		}
+		return -1;
+	};
+
+	int i = choose("a=1");
+	ASSERT_GE(i, 0);
+	sim.fire(i);
+	i = choose("a=0");
+	ASSERT_GE(i, 0);
+	sim.fire(i);
+
+	const int steps = 300;
+	for (int k = 0; k < steps; k++) {
+		i = choose(k%2 == 0 ? "c=1" : "c=0");
+		ASSERT_GE(i, 0);
+		sim.fire(i);
+	}
+
+	// The loaded transitions don't keep their histories between firings
+	for (const chp::enabled_transition &t : sim.loaded) {
+		EXPECT_TRUE(t.history.empty());
+	}
+
+	i = choose("b=1");
+	ASSERT_GE(i, 0);
+	sim.fire(i);
+
+	// The error lists every firing since b=1 was enabled, however many
+	ASSERT_EQ(sim.instability_errors.size(), 1u);
+	EXPECT_EQ(sim.instability_errors[0].history.size(), (size_t)steps+1);
+}
+
+TEST(Simulator, ScratchReused) {
+	chp::graph g = importCHPForSimulation("*[(a=1, b=1); (a=0, b=0)]");
+	ASSERT_FALSE(g.reset.empty());
+
+	chp::simulator sim(&g, g.reset[0]);
+	simulateSteps(sim, 100);
+
+	// Once the simulation reaches a steady state, the per-step buffers have
+	// all the room they need and are never reallocated.
+	auto capacities = [&sim]() {
+		return vector<size_t>({
+			sim.preload.capacity(), sim.potential.capacity(),
+			sim.disabled.capacity(), sim.global_disabled.capacity(),
+			sim.erased.capacity(), sim.visited.capacity(),
+			sim.writers.capacity(), sim.conflicts.capacity(),
+			sim.tokens.capacity(),
+			sim.history.arena.capacity(), sim.history.freed.capacity()
+		});
+	};
+
+	vector<size_t> before = capacities();
+	simulateSteps(sim, 1000);
+	EXPECT_EQ(capacities(), before);
+}
+
+TEST(Simulator, Allocations) {
+	chp::graph g = importCHPForSimulation("*[(a=1, b=1); (a=0, b=0)]");
+	ASSERT_FALSE(g.reset.empty());
+
+	chp::simulator sim(&g, g.reset[0]);
+	simulateSteps(sim, 1024);
+
+	// The spans are a whole number of cycles of the process, so each one
+	// makes the same firings from the same state
+	auto count = [&sim]() {
+		size_t start = allocations;
+		simulateSteps(sim, 512);
+		return allocations - start;
+	};
+
+	// In the steady state, a step allocates the same amount however long the
+	// simulation has been running. What is left comes from building the
+	// enabled transitions and evaluating their expressions.
+	size_t early = count();
+	simulateSteps(sim, 4096);
+	size_t late = count();
+	EXPECT_EQ(late, early);
+	RecordProperty("allocations_per_step", (int)(late/512));
+
+	// The outputs of the transitions are read from the simulator's index of
+	// the graph, without allocating
+	size_t start = allocations;
+	size_t outputs = 0;
+	for (int t = 0; t < (int)g.transitions.size(); t++) {
+		outputs += sim.outputsOf(t).size();
+	}
+	EXPECT_EQ(allocations - start, 0u);
+	EXPECT_EQ(outputs, g.arcs[chp::transition::type].size());
+}
+
+TEST(State, Print) {
+	chp::graph g = importCHPForSimulation("*[(a=1, b=1); (a=0, b=0)]");
+	ASSERT_FALSE(g.reset.empty());
+
+	chp::simulator sim(&g, g.reset[0]);
+	simulateSteps(sim, 1);
+	chp::state s = sim.get_state();
+	string text = s.to_string(g);
+
+	// print() appends to whatever is already in the stream, and writes the
+	// same text as to_string()
+	std::ostringstream os;
+	os << "before ";
+	s.print(os, g);
+	os << " after";
+	EXPECT_EQ(os.str(), "before " + text + " after");
+
+	// The tokens come first, then the encoding of the variables
+	ASSERT_FALSE(text.empty());
+	EXPECT_EQ(text[0], '{');
+	EXPECT_NE(text.find("} "), string::npos);
+	EXPECT_NE(text.find("a"), string::npos);
+	EXPECT_NE(text.find("b"), string::npos);
+
+	// Several states can be formatted into one stream
+	std::ostringstream both;
+	s.print(both, g);
+	both << ";";
+	s.print(both, g);
+	EXPECT_EQ(both.str(), text + ";" + text);
+}
+
+TEST(Expression, Emit) {
+	chp::graph g = importCHPForSimulation("*[x=L?; [x==0 -> R!x [] x!=0 -> R!((x+1)*2)]]");
+
+	// Guards read back into the same expressions
+	int guards = 0;
+	for (int i = 0; i < (int)g.transitions.size(); i++) {
+		if (not g.transitions.is_valid(i) or g.transitions[i].guard.isNull()) {
+			continue;
+		}
+		string text = chp::emit_expression(g.transitions[i].guard, g);
+		EXPECT_EQ(chp::read_expression(text, g).to_string(), g.transitions[i].guard.to_string()) << text;
+		guards++;
+	}
+	EXPECT_GT(guards, 0);
+
+	// Parentheses are kept where precedence needs them, and the ostream
+	// overload appends the same text as the string one
+	bool grouped = false;
+	for (int i = 0; i < (int)g.transitions.size(); i++) {
+		if (g.transitions.is_valid(i)) {
+			string text = chp::emit_composition(g.transitions[i].action, g);
+			grouped = grouped or text.find("(x+1)*2") != string::npos;
+
+			std::ostringstream os;
+			os << "T:";
+			chp::emit_composition(os, g.transitions[i].action, g);
+			EXPECT_EQ(os.str(), "T:" + text);
+		}
+	}
+	EXPECT_TRUE(grouped);
+}
+
+TEST(Simulator, Choices) {
+	// Parallel branches don't compete for tokens
+	chp::graph par = importCHPForSimulation("*[(a=1, b=1); (a=0, b=0)]");
+	ASSERT_FALSE(par.reset.empty());
+	chp::simulator sim(&par, par.reset[0]);
+	ASSERT_GE(sim.enabled(), 2);
+	EXPECT_TRUE(sim.get_choices().empty());
+
+	// Both branches of this selection consume the same token
+	chp::graph sel = importCHPForSimulation("a=0; *[[a==0 -> b=1 [] a==0 -> b=0]]");
+	ASSERT_FALSE(sel.reset.empty());
+	chp::simulator choice(&sel, sel.reset[0]);
+	simulateSteps(choice, 4);
+	ASSERT_GE(choice.enabled(), 2);
+	vector<pair<int, int> > choices = choice.get_choices();
+	ASSERT_EQ(choices.size(), 1u);
+	EXPECT_NE(choice.loaded[choices[0].first].index, choice.loaded[choices[0].second].index);
+
+	// The same selection behind a vacuous assignment. The ready transitions
+	// come after their vacuous cause in loaded, so they are looked up by their
+	// own index and not by their position among the ready ones.
+	chp::graph chain = importCHPForSimulation("a=0; *[a=0; [a==0 -> b=1 [] a==0 -> b=0]]");
+	ASSERT_FALSE(chain.reset.empty());
+	chp::simulator behind(&chain, chain.reset[0]);
+	simulateSteps(behind, 4);
+	ASSERT_GE(behind.enabled(), 2);
+	choices = behind.get_choices();
+	ASSERT_EQ(choices.size(), 1u);
+	EXPECT_NE(behind.loaded[choices[0].first].index, behind.loaded[choices[0].second].index);
+	for (const pair<int, int> &c : choices) {
+		EXPECT_FALSE(behind.loaded[c.first].vacuous);
+		EXPECT_FALSE(behind.loaded[c.second].vacuous);
+	}
+
+	// The token sets were built by enabled() along with the closures, and
+	// asking again neither rebuilds nor changes them
+	ASSERT_EQ(behind.closed, (int)behind.loaded.size());
+	vector<const uint64_t*> words;
+	for (int i = 0; i < (int)behind.loaded.size(); i++) {
+		vector<size_t> expected(behind.loaded[i].tokens.begin(), behind.loaded[i].tokens.end());
+		sort(expected.begin(), expected.end());
+		EXPECT_EQ(behind.tokenSets[i].elems(), expected);
+		EXPECT_TRUE(behind.visitedSets[i].test(i));
+		words.push_back(behind.tokenSets[i].words.data());
+	}
+	EXPECT_EQ(behind.get_choices(), choices);
+	for (int i = 0; i < (int)behind.loaded.size(); i++) {
+		EXPECT_EQ(behind.tokenSets[i].words.data(), words[i]);
+	}
+}
+
+TEST(Simulator, VacuousChain) {
+	// The repeated assignments to a are vacuous, so the transition after each
+	// of them is enabled through a chain of tokens that they caused.
+	chp::graph g = importCHPForSimulation("a=1; b=0; *[a=1; a=1; b=1; a=1; a=1; b=0]");
+	ASSERT_FALSE(g.reset.empty());
+
+	chp::simulator sim(&g, g.reset[0]);
+	vector<chp::state> states = simulateSteps(sim, 100);
+	EXPECT_EQ(states.size(), 100u);
+
+	// Every closure holds the tokens of the transition and of all its causes
+	sim.enabled();
+	ASSERT_EQ(sim.closed, (int)sim.loaded.size());
+	for (int i = 0; i < (int)sim.loaded.size(); i++) {
+		for (int k : sim.loaded[i].tokens) {
+			EXPECT_TRUE(sim.closure[i].test(k));
+		}
+		for (int c : sim.causesOf(i)) {
+			EXPECT_LT(c, i);
+			chp::bitvector missing = sim.closure[c] - sim.closure[i];
+			EXPECT_FALSE(missing.any());
+		}
+	}
+}
+
+// Counts the errors it receives without formatting them
+struct countingSink : chp::errorSink {
+	int unstable_count = 0;
+	int interfering_count = 0;
+	int nonexclusive_count = 0;
+
+	void unstable(const chp::simulator &sim, const chp::instability &err) override {
+		unstable_count++;
+	}
+	void interfering(const chp::simulator &sim, const chp::interference &err) override {
+		interfering_count++;
+	}
+	void nonexclusive(const chp::simulator &sim, const chp::mutex &err) override {
+		nonexclusive_count++;
+	}
+};
+
+TEST(Simulator, ErrorSink) {
+	// The guards of this selection aren't exclusive, so every pass through it
+	// finds the same mutex error again
+	chp::graph g = importCHPForSimulation("a=0; *[[a==0 -> b=1 [] a==0 -> b=0]]");
+	ASSERT_FALSE(g.reset.empty());
+
+	countingSink counts;
+	chp::simulator sim(&g, g.reset[0]);
+	sim.sink = &counts;
+	simulateSteps(sim, 200);
+
+	EXPECT_FALSE(sim.mutex_errors.empty());
+	EXPECT_EQ(counts.nonexclusive_count, (int)sim.mutex_errors.size());
+	EXPECT_EQ(counts.unstable_count, (int)sim.instability_errors.size());
+	EXPECT_EQ(counts.interfering_count, (int)sim.interference_errors.size());
+
+	// Merging is a union
+	chp::simulator merged(&g, g.reset[0]);
+	merged.merge_errors(sim);
+	merged.merge_errors(sim);
+	EXPECT_EQ(merged.mutex_errors.size(), sim.mutex_errors.size());
+	EXPECT_EQ(merged.instability_errors.size(), sim.instability_errors.size());
+	EXPECT_EQ(merged.interference_errors.size(), sim.interference_errors.size());
+
+	// The lists are in discovery order until they are sorted, and sorting
+	// doesn't lose or add anything
+	size_t mutexes = sim.mutex_errors.size();
+	sim.sort_errors();
+	EXPECT_TRUE(std::is_sorted(sim.mutex_errors.begin(), sim.mutex_errors.end()));
+	EXPECT_TRUE(std::is_sorted(sim.instability_errors.begin(), sim.instability_errors.end()));
+	EXPECT_TRUE(std::is_sorted(sim.interference_errors.begin(), sim.interference_errors.end()));
+	EXPECT_EQ(sim.mutex_errors.size(), mutexes);
+	EXPECT_EQ(sim.mutex_seen.size(), mutexes);
+}
+
+TEST(Coverage, CountAndMerge) {
+	chp::graph g = importCHPForSimulation("*[(a=1, b=1); (a=0, b=0)]");
+	ASSERT_FALSE(g.reset.empty());
+
+	chp::coverage cov;
+	chp::simulator sim(&g, g.reset[0]);
+	cov.attach(sim);
+	simulateSteps(sim, 100);
+
+	// Every step fires exactly one term
+	uint64_t total = 0;
+	for (uint64_t count : cov.firings) {
+		total += count;
+	}
+	EXPECT_EQ(total, 100u);
+	EXPECT_GT(cov.points(g), 0);
+	EXPECT_EQ(cov.covered(g), cov.points(g));
+
+	// Every transition that was taken was enabled first
+	for (int i = 0; i < (int)cov.taken.size(); i++) {
+		if (cov.taken[i] > 0 and not g.transitions[i].action.isVacuous()) {
+			EXPECT_GT(cov.passed[i] + cov.unstable[i], 0u) << "T" << i;
+		}
+	}
+
+	// The report survives a round trip and merging adds the counts
+	std::stringstream buffer;
+	cov.write(buffer);
+	chp::coverage loaded;
+	ASSERT_TRUE(loaded.read(buffer));
+	EXPECT_EQ(loaded.firings, cov.firings);
+	EXPECT_EQ(loaded.taken, cov.taken);
+
+	loaded.merge(cov);
+	for (int i = 0; i < (int)cov.firings.size(); i++) {
+		EXPECT_EQ(loaded.firings[i], 2*cov.firings[i]);
+	}
+}
+
+TEST(Coverage, Guided) {
+	chp::graph g = importCHPForSimulation("*[(a=1, b=1); (a=0, b=0)]");
+	ASSERT_FALSE(g.reset.empty());
+
+	chp::guided run(&g, g.reset[0], 1);
+	run.run(10000);
+	EXPECT_TRUE(run.saturated());
+	EXPECT_LT(run.steps, 10000u);
+	EXPECT_EQ(run.covered(), run.cov.covered(g));
+
+	// The curve only goes up
+	ASSERT_FALSE(run.curve.empty());
+	for (int i = 1; i < (int)run.curve.size(); i++) {
+		EXPECT_GT(run.curve[i].first, run.curve[i-1].first);
+		EXPECT_GT(run.curve[i].second, run.curve[i-1].second);
+	}
+
+	// Both branches of a selection get taken
+	chp::graph sel = importCHPForSimulation("a=0; *[[a==0 -> b=1 [] a==0 -> b=0]]");
+	ASSERT_FALSE(sel.reset.empty());
+	chp::guided choice(&sel, sel.reset[0], 1);
+	choice.patience = 10;
+	choice.run(1000);
+	EXPECT_EQ(choice.covered(), choice.cov.covered(sel));
+
+	std::stringstream buffer;
+	choice.report(buffer);
+	EXPECT_NE(buffer.str().find("took 2 of 2 branches"), string::npos) << buffer.str();
+}
+
+TEST(Instrument, Export) {
+	chp::instrumentReset();
+	chp::instrumentTrace(true);
+	{
+		chp::scopedTimer timer(chp::PHASE_FLATTEN);
+		chp::instrumentLocal().counts[chp::GUARDS_EVALUATED] += 3;
+	}
+	chp::instrumentTrace(false);
+
+	chp::instrumentBlock totals = chp::instrumentTotals();
+	EXPECT_EQ(totals.calls[chp::PHASE_FLATTEN], 1u);
+	EXPECT_EQ(totals.counts[chp::GUARDS_EVALUATED], 3u);
+	ASSERT_EQ(totals.events.size(), 1u);
+	EXPECT_EQ(totals.events[0].phase, (int)chp::PHASE_FLATTEN);
+
+	std::stringstream json;
+	chp::writeInstrumentJSON(json);
+	EXPECT_NE(json.str().find("\"guards_evaluated\": 3"), string::npos) << json.str();
+	EXPECT_NE(json.str().find("\"flatten\": {\"calls\": 1"), string::npos) << json.str();
+
+	std::stringstream trace;
+	chp::writeInstrumentTrace(trace);
+	EXPECT_NE(trace.str().find("\"traceEvents\""), string::npos);
+	EXPECT_NE(trace.str().find("\"ph\": \"X\""), string::npos);
+}
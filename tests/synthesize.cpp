@@ -4,8 +4,10 @@
 
 #include <gtest/gtest.h>
 
+#include <chp/expression.h>
 #include <chp/graph.h>
 #include <chp/synthesize.h>
+#include <chp/width.h>
 #include <common/standard.h>
 #include <interpret_chp/export_dot.h>
 #include <interpret_chp/import_chp.h>
@@ -222,6 +224,246 @@ TEST(ChpToFlow, Split) {
 }
 
 
+TEST(ChpToFlow, ParallelBranches) {
+	string chpRaw = readStringFromFile((TEST_DIR / "split.chp").string(), true);
+	chp::graph g = importCHPFromString(chpRaw);
+	g.post_process(true, false);
+	g.name = "split";
+	g.flatten();
+
+	flow::Func sequential = chp::synthesizeFuncFromCHP(g, chp::SynthesisOptions(false, 1));
+	flow::Func parallel = chp::synthesizeFuncFromCHP(g, chp::SynthesisOptions(false, 4));
+
+	// Channel indices are assigned in branch order either way
+	ASSERT_EQ(parallel.nets.size(), sequential.nets.size());
+	for (size_t i = 0; i < parallel.nets.size(); i++) {
+		EXPECT_EQ(parallel.nets[i].name, sequential.nets[i].name);
+	}
+	EXPECT_TRUE(areEquivalent(parallel, sequential));
+}
+
+
+TEST(ChpToFlow, SynthesisCache) {
+	string chpRaw = readStringFromFile((TEST_DIR / "merge.chp").string(), true);
+	chp::graph g = importCHPFromString(chpRaw);
+	g.post_process(true, false);
+	g.name = "merge";
+	g.flatten();
+
+	chp::SynthesisCache cache;
+	chp::SynthesisOptions options;
+	options.cache = &cache;
+
+	flow::Func first = chp::synthesizeFuncFromCHP(g, options);
+	EXPECT_EQ(cache.hits, 0u);
+	EXPECT_EQ(cache.misses, first.conds.size());
+
+	// Nothing changed, so every condition is reused
+	flow::Func second = chp::synthesizeFuncFromCHP(g, options);
+	EXPECT_EQ(cache.hits, second.conds.size());
+	EXPECT_TRUE(areEquivalent(second, first));
+
+	// A full cache drops the least recently used entries
+	ASSERT_GT(first.conds.size(), 1u);
+	chp::SynthesisCache small(1);
+	options.cache = &small;
+	flow::Func third = chp::synthesizeFuncFromCHP(g, options);
+	EXPECT_EQ(small.buffers.size(), 1u);
+	EXPECT_EQ(small.conditions.size(), 1u);
+	EXPECT_TRUE(areEquivalent(third, first));
+
+	chp::lruMap<int> lru(2);
+	lru.insert("a", 0);
+	lru.insert("b", 1);
+	EXPECT_NE(lru.find("a"), nullptr);
+	lru.insert("c", 2);
+	EXPECT_EQ(lru.find("b"), nullptr);
+	EXPECT_NE(lru.find("a"), nullptr);
+	EXPECT_NE(lru.find("c"), nullptr);
+}
+
+
+TEST(ChpToFlow, NestedWithoutFlatten) {
+	std::string source = R"(
+*[
+	[   b1 ->
+		[   b0 -> R!3
+		[] ~b0 -> R!2
+		]
+	[] ~b1 ->
+		[   b0 -> R!1
+		[] ~b0 -> R!0
+		]
+	]
+]
+		)";
+
+	chp::graph g = importCHPFromString(source);
+	g.post_process(true, false);
+	g.name = "nested";
+
+	// One predicated condition for each leaf of the selection tree
+	flow::Func func;
+	EXPECT_NO_THROW(func = chp::synthesizeFuncFromCHP(g));
+	ASSERT_EQ(func.conds.size(), 4u);
+
+	// Each predicate is the conjunction of the guards of both selections,
+	// so it depends on both b1 and b0 and no two are the same
+	std::set<string> predicates;
+	for (const flow::Condition &cond : func.conds) {
+		std::set<size_t> vars;
+		if (cond.valid.top.isVar()) {
+			vars.insert(cond.valid.top.index);
+		}
+		for (const arithmetic::Operand &operand : cond.valid.exprIndex()) {
+			for (const arithmetic::Operand &arg : cond.valid.getExpr(operand.index)->operands) {
+				if (arg.isVar()) {
+					vars.insert(arg.index);
+				}
+			}
+		}
+		EXPECT_EQ(vars.size(), 2u) << cond.valid;
+		predicates.insert(cond.valid.to_string());
+	}
+	EXPECT_EQ(predicates.size(), 4u);
+}
+
+
+TEST(ChpToFlow, SequentialSelections) {
+	std::string source = R"(
+*[
+	[b0 -> R!0 [] ~b0 -> R!1];
+	[b1 -> S!2 [] ~b1 -> S!3];
+	[b2 -> T!4 [] ~b2 -> T!5]
+]
+		)";
+
+	chp::graph g = importCHPFromString(source);
+	g.post_process(true, false);
+	g.name = "sequential";
+
+	// Each selection adds its branches rather than multiplying the paths
+	// through the ones after it, and the graph is left as it was
+	size_t transitions = g.transitions.size();
+	flow::Func paths;
+	EXPECT_NO_THROW(paths = chp::synthesizeFuncFromCHP(g));
+	EXPECT_EQ(paths.conds.size(), 6u);
+	EXPECT_EQ(g.transitions.size(), transitions);
+
+	// The flattened graph has one condition for every combination of
+	// branches, but both drive the same nets with the same values
+	chp::graph flat = g;
+	flat.flatten(false, true);
+	flow::Func flattened = chp::synthesizeFuncFromCHP(flat);
+	EXPECT_EQ(flattened.conds.size(), 8u);
+
+	auto outputs = [](const flow::Func &func) {
+		std::set<pair<string, string> > result;
+		for (const flow::Condition &cond : func.conds) {
+			for (const auto &out : cond.outs) {
+				result.insert({func.nets[out.first].name, out.second.to_string()});
+			}
+			for (const auto &reg : cond.regs) {
+				result.insert({func.nets[reg.first].name, reg.second.to_string()});
+			}
+		}
+		return result;
+	};
+	EXPECT_EQ(to_unordered_multiset<flow::Net>(paths.nets), to_unordered_multiset<flow::Net>(flattened.nets));
+	EXPECT_EQ(outputs(paths), outputs(flattened));
+	EXPECT_EQ(outputs(paths).size(), 6u);
+}
+
+
+TEST(ChpToFlow, InferWidths) {
+	chp::graph g = importCHPFromString("x = 2; *[R!x; S!(x+1); T!(x==0); y=L?]");
+	vector<int> widths = chp::inferWidths(g, WIDTH);
+
+	EXPECT_EQ(widths[g.netIndex("x")], 2);
+	EXPECT_EQ(widths[g.netIndex("R")], 2);
+	EXPECT_EQ(widths[g.netIndex("S")], 3);
+	EXPECT_EQ(widths[g.netIndex("T")], 1);
+
+	// Driven by the environment
+	EXPECT_EQ(widths[g.netIndex("L")], WIDTH);
+	EXPECT_EQ(widths[g.netIndex("y")], WIDTH);
+}
+
+
+TEST(ChpToFlow, InferWidthsCounter) {
+	chp::graph g = importCHPFromString("i=0; *[i<8 -> i=i+1]");
+	vector<int> widths = chp::inferWidths(g, WIDTH);
+
+	// i keeps growing around its own cycle, so it is widened to the default
+	// width and wraps there instead of growing to the widest datapath
+	EXPECT_EQ(widths[g.netIndex("i")], WIDTH);
+
+	// Widening never narrows a variable that has already grown past the
+	// default width
+	g = importCHPFromString("i=0; *[i<8 -> i=i*1024]");
+	widths = chp::inferWidths(g, 4);
+	EXPECT_GE(widths[g.netIndex("i")], 4);
+	EXPECT_LT(widths[g.netIndex("i")], 64);
+}
+
+
+TEST(ChpToFlow, InferWidthsChain) {
+	chp::graph g = importCHPFromString("*[x=L?; y1=x+1; y2=y1+1; y3=y2+1; y4=y3+1; y5=y4+1; y6=y5+1; y7=y6+1; R!y7]");
+	vector<int> widths = chp::inferWidths(g, WIDTH);
+
+	// No cycle runs through the chain, so nothing is widened or truncated
+	// however long it is
+	EXPECT_EQ(widths[g.netIndex("x")], WIDTH);
+	EXPECT_EQ(widths[g.netIndex("y1")], WIDTH+1);
+	EXPECT_EQ(widths[g.netIndex("y7")], WIDTH+7);
+	EXPECT_EQ(widths[g.netIndex("R")], WIDTH+7);
+
+	// A long chain into a counter reaches it before the counter is widened
+	g = importCHPFromString("i=0; *[x=L?; y1=x+1; y2=y1+1; y3=y2+1; y4=y3+1; y5=y4+1; y6=y5+1; i=i+y6]");
+	widths = chp::inferWidths(g, WIDTH);
+	EXPECT_GE(widths[g.netIndex("i")], WIDTH+6);
+}
+
+
+TEST(ChpToFlow, BuiltinTable) {
+	chp::graph g = importCHPFromString("*[R?x; S!x; [#T -> y=T?]]");
+
+	int recv = 0, send = 0, probe = 0;
+	for (size_t t = 0; t < g.transitions.size(); t++) {
+		if (not g.transitions.is_valid(t)) {
+			continue;
+		}
+
+		vector<arithmetic::Expression> exprs(1, g.transitions[t].guard);
+		for (const arithmetic::Parallel &term : g.transitions[t].action.terms) {
+			for (const arithmetic::Action &action : term.actions) {
+				exprs.push_back(action.rvalue);
+			}
+		}
+
+		for (const arithmetic::Expression &e : exprs) {
+			chp::builtinTable calls(e);
+			for (const arithmetic::Operand &operand : e.exprIndex()) {
+				const arithmetic::Operation &operation = *e.getExpr(operand.index);
+				if (operation.func != arithmetic::Operation::OpType::CALL) {
+					EXPECT_EQ(calls[operand.index], chp::NOT_BUILTIN);
+					continue;
+				}
+
+				int id = calls[operand.index];
+				EXPECT_EQ(id, chp::builtinOf(operation.operands[0].cnst.sval));
+				recv += id == chp::RECV;
+				send += id == chp::SEND;
+				probe += id == chp::PROBE;
+			}
+		}
+	}
+
+	EXPECT_EQ(recv, 2);
+	EXPECT_EQ(send, 1);
+	EXPECT_EQ(probe, 1);
+}
+
 TEST(ChpToFlow, IsEven) {
 	flow::Func func;
 	func.name = "is_even";